@@ -0,0 +1,166 @@
+#include "autosave-journal.h"
+#include "surface-pool.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const char journal_magic[8] = {'M', 'P', 'J', 'R', 'N', 'L', '1', '\n'};
+const guint32 record_magic = 0x4d505243;   // "MPRC"
+const guint32 record_flag_full = 1;
+
+// Native byte order: the journal never leaves the machine that wrote it
+struct RecordHeader {
+    guint32 magic;
+    guint32 flags;
+    gint32 width;
+    gint32 height;
+    guint32 tile_count;
+};
+
+struct TileHeader {
+    gint32 x;
+    gint32 y;
+    gint32 width;
+    gint32 height;
+};
+
+// FNV-1a over the record, enough to spot a torn or partly zeroed write
+guint32 update_checksum(guint32 hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+const guint32 checksum_seed = 2166136261u;
+
+bool write_all(FILE* file, const void* data, size_t size, guint32& checksum) {
+    checksum = update_checksum(checksum, data, size);
+    return fwrite(data, 1, size, file) == size;
+}
+
+}
+
+bool write_journal_record(const std::string& path, const JournalRecord& record, bool truncate) {
+    FILE* file = fopen(path.c_str(), truncate ? "wb" : "ab");
+    if (!file) return false;
+
+    bool ok = true;
+    if (truncate || ftell(file) == 0) {
+        ok = fwrite(journal_magic, 1, sizeof(journal_magic), file) == sizeof(journal_magic);
+    }
+
+    RecordHeader header;
+    header.magic = record_magic;
+    header.flags = record.full ? record_flag_full : 0;
+    header.width = record.width;
+    header.height = record.height;
+    header.tile_count = (guint32)record.tiles.size();
+
+    guint32 checksum = checksum_seed;
+    ok = ok && write_all(file, &header, sizeof(header), checksum);
+    for (const UndoTile& tile : record.tiles) {
+        if (!ok) break;
+        TileHeader tile_header = {tile.x, tile.y, tile.width, tile.height};
+        ok = write_all(file, &tile_header, sizeof(tile_header), checksum) &&
+            write_all(file, tile.pixels.data(), tile.pixels.size() * sizeof(guint32), checksum);
+    }
+    ok = ok && fwrite(&checksum, 1, sizeof(checksum), file) == sizeof(checksum);
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+cairo_surface_t* replay_journal(const std::string& path, cairo_surface_t* base) {
+    GMappedFile* mapped = g_mapped_file_new(path.c_str(), FALSE, NULL);
+    if (!mapped) return base;
+
+    const char* data = g_mapped_file_get_contents(mapped);
+    size_t length = g_mapped_file_get_length(mapped);
+    size_t offset = sizeof(journal_magic);
+    cairo_surface_t* surface = base;
+    bool patch_full = base != nullptr;
+
+    if (length < offset || std::memcmp(data, journal_magic, sizeof(journal_magic)) != 0) {
+        length = 0;
+    }
+
+    // Validate each record in full before applying it
+    while (offset + sizeof(RecordHeader) <= length) {
+        RecordHeader header;
+        std::memcpy(&header, data + offset, sizeof(header));
+        if (header.magic != record_magic || header.width <= 0 || header.height <= 0) break;
+        if (!(header.flags & record_flag_full) && !surface) break;
+
+        guint32 checksum = update_checksum(checksum_seed, &header, sizeof(header));
+        size_t cursor = offset + sizeof(header);
+        bool intact = true;
+        for (guint32 i = 0; i < header.tile_count && intact; i++) {
+            TileHeader tile;
+            intact = cursor + sizeof(tile) <= length;
+            if (!intact) break;
+            std::memcpy(&tile, data + cursor, sizeof(tile));
+            size_t pixel_bytes = (size_t)std::max(0, tile.width) * std::max(0, tile.height) * sizeof(guint32);
+            intact = tile.x >= 0 && tile.y >= 0 && tile.width > 0 && tile.height > 0 &&
+                tile.x + tile.width <= header.width && tile.y + tile.height <= header.height &&
+                cursor + sizeof(tile) + pixel_bytes <= length;
+            if (intact) {
+                checksum = update_checksum(checksum, data + cursor, sizeof(tile) + pixel_bytes);
+                cursor += sizeof(tile) + pixel_bytes;
+            }
+        }
+        guint32 stored = 0;
+        if (!intact || cursor + sizeof(stored) > length) break;
+        std::memcpy(&stored, data + cursor, sizeof(stored));
+        if (stored != checksum) break;
+
+        if ((header.flags & record_flag_full) && patch_full) {
+            patch_full = false;
+            if (cairo_image_surface_get_width(surface) != header.width ||
+                cairo_image_surface_get_height(surface) != header.height) {
+                break;
+            }
+            cairo_surface_flush(surface);
+        } else if (header.flags & record_flag_full) {
+            if (surface) {
+                cairo_surface_destroy(surface);
+            }
+            surface = create_pooled_surface(header.width, header.height);
+            if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+                cairo_surface_destroy(surface);
+                surface = nullptr;
+                break;
+            }
+            cairo_surface_flush(surface);
+        } else if (cairo_image_surface_get_width(surface) != header.width ||
+            cairo_image_surface_get_height(surface) != header.height) {
+            break;
+        }
+
+        unsigned char* pixels = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+        size_t tile_offset = offset + sizeof(header);
+        for (guint32 i = 0; i < header.tile_count; i++) {
+            TileHeader tile;
+            std::memcpy(&tile, data + tile_offset, sizeof(tile));
+            const char* src = data + tile_offset + sizeof(tile);
+            for (int row = 0; row < tile.height; row++) {
+                std::memcpy(pixels + (size_t)(tile.y + row) * stride + (size_t)tile.x * sizeof(guint32),
+                    src + (size_t)row * tile.width * sizeof(guint32), (size_t)tile.width * sizeof(guint32));
+            }
+            tile_offset += sizeof(tile) + (size_t)tile.width * tile.height * sizeof(guint32);
+        }
+        offset = cursor + sizeof(stored);
+    }
+
+    g_mapped_file_unref(mapped);
+    if (surface) {
+        cairo_surface_mark_dirty(surface);
+    }
+    return surface;
+}
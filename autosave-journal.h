@@ -0,0 +1,25 @@
+// Crash recovery journal. The canvas is appended to a file as 64x64 tiles:
+// a full frame first, which may take several records, then only the tiles
+// changed since the previous record. Every record ends in a checksum, so a write torn by a crash
+// costs only that record, and replay stops at the last intact one.
+#ifndef MATE_PAINT_AUTOSAVE_JOURNAL_H
+#define MATE_PAINT_AUTOSAVE_JOURNAL_H
+
+#include <cairo.h>
+#include <glib.h>
+#include <string>
+#include <vector>
+
+#include "canvas-document.h"
+
+// Append a record, or with truncate start the file over with it. Flushed
+// to disk before returning. Safe on a worker thread.
+bool write_journal_record(const std::string& path, const JournalRecord& record, bool truncate);
+// Rebuild the canvas from every intact record; null if there are none.
+// With base, replay goes on from that surface (taking ownership) and a
+// full record of the same size patches it instead of starting over, which
+// recovers a full frame that was only partly written. base is returned
+// unchanged when the file does not fit it.
+cairo_surface_t* replay_journal(const std::string& path, cairo_surface_t* base = nullptr);
+
+#endif
@@ -0,0 +1,383 @@
+// Standalone timings for the pixel kernels in pixel-kernels.cpp, undo
+// capture and restore, the shape rasterizer and the image writers. Each
+// kernel runs over a matrix of canvas sizes filled with seeded synthetic
+// content, and every measurement is printed as one JSON object per line.
+//
+// Usage: pixel-kernels-benchmark [--quick]
+
+#include "canvas-document.h"
+#include "image-codecs.h"
+#include "pixel-convert.h"
+#include "pixel-kernels.h"
+#include "shape-raster.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct CanvasSize {
+    int width;
+    int height;
+};
+
+const CanvasSize canvas_sizes[] = {
+    {256, 256},
+    {1024, 768},
+    {1920, 1080},
+    {3840, 2160},
+};
+
+const guint32 synthetic_seed = 20240601;
+const guint32 white_pixel = 0xFFFFFFFF;
+const guint32 fill_pixel = 0xFFCC0000;
+
+struct BenchResult {
+    int iterations = 0;
+    double min_ms = 0;
+    double median_ms = 0;
+    double mean_ms = 0;
+};
+
+// White canvas with seeded rectangles and strokes. Column 0 is left white so
+// a fill started at the origin always reaches the whole background.
+cairo_surface_t* create_synthetic_canvas(int width, int height) {
+    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t* cr = cairo_create(surface);
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+
+    GRand* rand = g_rand_new_with_seed(synthetic_seed);
+    for (int i = 0; i < 200; i++) {
+        int x = g_rand_int_range(rand, 1, width);
+        int y = g_rand_int_range(rand, 0, height);
+        int w = g_rand_int_range(rand, 1, std::max(2, width / 8));
+        int h = g_rand_int_range(rand, 1, std::max(2, height / 8));
+        cairo_set_source_rgb(cr, g_rand_double(rand), g_rand_double(rand), g_rand_double(rand));
+        cairo_rectangle(cr, x, y, w, h);
+        cairo_fill(cr);
+    }
+    for (int i = 0; i < 50; i++) {
+        cairo_set_source_rgba(cr, g_rand_double(rand), g_rand_double(rand), g_rand_double(rand), 0.5);
+        stroke_segment(cr,
+            g_rand_int_range(rand, 8, width), g_rand_int_range(rand, 0, height),
+            g_rand_int_range(rand, 8, width), g_rand_int_range(rand, 0, height),
+            g_rand_int_range(rand, 1, 9));
+    }
+    g_rand_free(rand);
+
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    return surface;
+}
+
+// Run the kernel until it has used the time budget or the iteration cap,
+// after one untimed warm-up call
+BenchResult time_kernel(const std::function<void()>& kernel, bool quick) {
+    const gint64 budget_us = quick ? 50 * 1000 : 250 * 1000;
+    const int min_iterations = 3;
+    const int max_iterations = quick ? 10 : 100;
+
+    kernel();
+
+    std::vector<double> samples;
+    gint64 started = g_get_monotonic_time();
+    while ((int)samples.size() < min_iterations ||
+        ((int)samples.size() < max_iterations && g_get_monotonic_time() - started < budget_us)) {
+        gint64 begin = g_get_monotonic_time();
+        kernel();
+        samples.push_back((g_get_monotonic_time() - begin) / 1000.0);
+    }
+
+    BenchResult result;
+    result.iterations = (int)samples.size();
+    std::sort(samples.begin(), samples.end());
+    result.min_ms = samples.front();
+    result.median_ms = samples[samples.size() / 2];
+    double total = 0;
+    for (double sample : samples) {
+        total += sample;
+    }
+    result.mean_ms = total / samples.size();
+    return result;
+}
+
+void report(const char* kernel, const CanvasSize& size, const BenchResult& result) {
+    double megapixels = (double)size.width * size.height / 1e6;
+    std::printf(
+        "{\"kernel\":\"%s\",\"width\":%d,\"height\":%d,\"iterations\":%d,"
+        "\"min_ms\":%.4f,\"median_ms\":%.4f,\"mean_ms\":%.4f,\"mpixels_per_s\":%.2f}\n",
+        kernel, size.width, size.height, result.iterations,
+        result.min_ms, result.median_ms, result.mean_ms,
+        result.median_ms > 0 ? megapixels / (result.median_ms / 1000.0) : 0.0);
+    std::fflush(stdout);
+}
+
+void run_remap(const char* name, PixelRemap remap, cairo_surface_t* canvas,
+    int dst_width, int dst_height, const CanvasSize& size, bool quick) {
+    cairo_surface_t* result = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, dst_width, dst_height);
+    cairo_surface_flush(result);
+    SurfaceRemap r = make_surface_remap(remap, canvas, result);
+
+    report(name, size, time_kernel([&]() {
+        remap_pixel_rows(r, 0, dst_height);
+    }, quick));
+
+    cairo_surface_destroy(result);
+}
+
+// A jagged closed outline around the centre, like a long lasso drag
+std::vector<std::pair<double, double>> create_synthetic_polygon(int width, int height, int count) {
+    std::vector<std::pair<double, double>> points;
+    GRand* rand = g_rand_new_with_seed(synthetic_seed);
+    for (int i = 0; i < count; i++) {
+        double angle = 2 * M_PI * i / count;
+        double radius = g_rand_double_range(rand, 0.2, 0.5);
+        points.push_back({width * (0.5 + radius * std::cos(angle)), height * (0.5 + radius * std::sin(angle))});
+    }
+    g_rand_free(rand);
+    return points;
+}
+
+// Undo capture and restore through the document, for whole-canvas steps
+// and for the tiles a 256x256 stroke touches. A restore is timed as an
+// undo and a redo, so each figure covers two restores.
+void run_undo(cairo_surface_t* canvas, const CanvasSize& size, bool quick) {
+    int width = size.width;
+    int height = size.height;
+    Document doc;
+    document_set_surface(doc, clone_surface(canvas, width, height));
+    FloatingSelection selection;
+
+    report("undo_capture_canvas", size, time_kernel([&]() {
+        document_push_undo(doc);
+    }, quick));
+    report("undo_restore_canvas", size, time_kernel([&]() {
+        document_undo(doc, selection);
+        document_redo(doc, selection);
+    }, quick));
+
+    int area = std::min(256, std::min(width, height));
+    report("undo_capture_tiles", size, time_kernel([&]() {
+        document_begin_stroke(doc);
+        document_capture_area(doc, (width - area) / 2, (height - area) / 2, area, area);
+        document_end_stroke(doc);
+    }, quick));
+    report("undo_restore_tiles", size, time_kernel([&]() {
+        document_undo(doc, selection);
+        document_redo(doc, selection);
+    }, quick));
+
+    document_free(doc);
+}
+
+// Each shape through the span rasterizer and through cairo's own filler
+void run_shapes(cairo_surface_t* canvas, const CanvasSize& size, bool quick) {
+    int width = size.width;
+    int height = size.height;
+    cairo_surface_t* target = clone_surface(canvas, width, height);
+    std::vector<std::pair<double, double>> polygon = create_synthetic_polygon(width, height, 1000);
+
+    report("fill_ellipse_spans", size, time_kernel([&]() {
+        ShapeOutline outline = create_surface_outline(target);
+        outline_add_ellipse(outline, width / 2.0, height / 2.0, width / 2.0, height / 2.0);
+        fill_spans(target, rasterize_outline(outline, FILL_RULE_EVEN_ODD), fill_pixel);
+    }, quick));
+
+    report("fill_ellipse_cairo", size, time_kernel([&]() {
+        cairo_t* cr = cairo_create(target);
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+        cairo_set_source_rgb(cr, 0.8, 0, 0);
+        cairo_translate(cr, width / 2.0, height / 2.0);
+        cairo_scale(cr, width / 2.0, height / 2.0);
+        cairo_arc(cr, 0, 0, 1, 0, 2 * M_PI);
+        cairo_fill(cr);
+        cairo_destroy(cr);
+    }, quick));
+
+    report("fill_polygon_1000_spans", size, time_kernel([&]() {
+        ShapeOutline outline = create_surface_outline(target);
+        outline_add_polygon(outline, polygon);
+        fill_spans(target, rasterize_outline(outline, FILL_RULE_NONZERO), 0x80CC0000);
+    }, quick));
+
+    report("fill_polygon_1000_cairo", size, time_kernel([&]() {
+        cairo_t* cr = cairo_create(target);
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+        cairo_set_source_rgba(cr, 0.8, 0, 0, 0.5);
+        for (const auto& point : polygon) {
+            cairo_line_to(cr, point.first, point.second);
+        }
+        cairo_close_path(cr);
+        cairo_fill(cr);
+        cairo_destroy(cr);
+    }, quick));
+
+    report("stroke_polygon_1000_spans", size, time_kernel([&]() {
+        ShapeOutline outline = create_surface_outline(target);
+        outline_add_polygon_stroke(outline, polygon, 4.0);
+        fill_spans(target, rasterize_outline(outline, FILL_RULE_NONZERO), fill_pixel);
+    }, quick));
+
+    report("stroke_polygon_1000_cairo", size, time_kernel([&]() {
+        cairo_t* cr = cairo_create(target);
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+        cairo_set_source_rgb(cr, 0.8, 0, 0);
+        cairo_set_line_width(cr, 4.0);
+        for (const auto& point : polygon) {
+            cairo_line_to(cr, point.first, point.second);
+        }
+        cairo_close_path(cr);
+        cairo_stroke(cr);
+        cairo_destroy(cr);
+    }, quick));
+
+    cairo_surface_destroy(target);
+}
+
+// Formats with a built-in writer, timed next to PNG
+const char* const builtin_formats[] = {"qoi", "bmp", "pam"};
+
+void run_canvas_size(const CanvasSize& size, const std::string& output_base, bool quick) {
+    cairo_surface_t* canvas = create_synthetic_canvas(size.width, size.height);
+    int width = size.width;
+    int height = size.height;
+
+    FloodFillMask mask;
+    cairo_surface_t* fill_target = clone_surface(canvas, width, height);
+    cairo_surface_flush(fill_target);
+    report("flood_fill", size, time_kernel([&]() {
+        compute_flood_fill(canvas, 0, 0, white_pixel, mask, NULL);
+        apply_flood_fill_rows(fill_target, mask, fill_pixel, 0, mask.max_y - mask.min_y + 1);
+    }, quick));
+    cairo_surface_destroy(fill_target);
+
+    run_remap("rotate_clockwise", REMAP_ROTATE_CLOCKWISE, canvas, height, width, size, quick);
+    run_remap("rotate_counter_clockwise", REMAP_ROTATE_COUNTER_CLOCKWISE, canvas, height, width, size, quick);
+    run_remap("flip_horizontal", REMAP_FLIP_HORIZONTAL, canvas, width, height, size, quick);
+    run_remap("flip_vertical", REMAP_FLIP_VERTICAL, canvas, width, height, size, quick);
+    run_remap("scale_nearest_150", REMAP_SCALE_NEAREST, canvas, width * 3 / 2, height * 3 / 2, size, quick);
+
+    run_undo(canvas, size, quick);
+
+    cairo_surface_t* stroke_target = clone_surface(canvas, width, height);
+    report("brush_stroke_200_segments", size, time_kernel([&]() {
+        cairo_t* cr = cairo_create(stroke_target);
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+        cairo_set_source_rgb(cr, 0.1, 0.2, 0.8);
+        GRand* rand = g_rand_new_with_seed(synthetic_seed);
+        double x = width / 2.0;
+        double y = height / 2.0;
+        for (int i = 0; i < 200; i++) {
+            double next_x = CLAMP(x + g_rand_double_range(rand, -20, 20), 0, width - 1);
+            double next_y = CLAMP(y + g_rand_double_range(rand, -20, 20), 0, height - 1);
+            stroke_segment(cr, x, y, next_x, next_y, 8.0);
+            x = next_x;
+            y = next_y;
+        }
+        g_rand_free(rand);
+        cairo_destroy(cr);
+    }, quick));
+    cairo_surface_destroy(stroke_target);
+
+    run_shapes(canvas, size, quick);
+
+    const unsigned char* canvas_data = cairo_image_surface_get_data(canvas);
+    int canvas_stride = cairo_image_surface_get_stride(canvas);
+    std::vector<guchar> straight((size_t)width * height * 4);
+    report("argb_to_rgb", size, time_kernel([&]() {
+        for (int y = 0; y < height; y++) {
+            pack_rgb_row(reinterpret_cast<const guint32*>(canvas_data + (size_t)y * canvas_stride),
+                &straight[(size_t)y * width * 3], width);
+        }
+    }, quick));
+
+    report("unpremultiply_rgba", size, time_kernel([&]() {
+        for (int y = 0; y < height; y++) {
+            unpremultiply_row(reinterpret_cast<const guint32*>(canvas_data + (size_t)y * canvas_stride),
+                &straight[(size_t)y * width * 4], width, CHANNELS_RGBA);
+        }
+    }, quick));
+
+    cairo_surface_t* premultiplied = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    unsigned char* premultiplied_data = cairo_image_surface_get_data(premultiplied);
+    int premultiplied_stride = cairo_image_surface_get_stride(premultiplied);
+    report("premultiply_rgba", size, time_kernel([&]() {
+        for (int y = 0; y < height; y++) {
+            premultiply_row(&straight[(size_t)y * width * 4],
+                reinterpret_cast<guint32*>(premultiplied_data + (size_t)y * premultiplied_stride),
+                width, 4, CHANNELS_RGBA);
+        }
+    }, quick));
+    cairo_surface_destroy(premultiplied);
+
+    std::string png_path = output_base + ".png";
+    report("png_save", size, time_kernel([&]() {
+        cairo_surface_write_to_png(canvas, png_path.c_str());
+    }, quick));
+
+    report("png_load", size, time_kernel([&]() {
+        cairo_surface_destroy(cairo_image_surface_create_from_png(png_path.c_str()));
+    }, quick));
+    g_remove(png_path.c_str());
+
+    for (const char* format : builtin_formats) {
+        std::string path = output_base + "." + format;
+        report((std::string(format) + "_save").c_str(), size, time_kernel([&]() {
+            save_builtin_image(canvas, path);
+        }, quick));
+
+        report((std::string(format) + "_load").c_str(), size, time_kernel([&]() {
+            cairo_surface_destroy(load_builtin_image(path));
+        }, quick));
+        g_remove(path.c_str());
+    }
+
+    report("quantize_256_dither", size, time_kernel([&]() {
+        quantize_surface(canvas, 256, true);
+    }, quick));
+
+    std::string xpm_path = output_base + ".xpm";
+    report("xpm_save", size, time_kernel([&]() {
+        save_xpm_image(canvas, xpm_path);
+    }, quick));
+    g_remove(xpm_path.c_str());
+
+    cairo_surface_destroy(canvas);
+}
+
+int main(int argc, char* argv[]) {
+    bool quick = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else {
+            std::fprintf(stderr, "Usage: %s [--quick]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // A private directory, so runs at the same time keep their files apart
+    GError* error = NULL;
+    gchar* output_dir = g_dir_make_tmp("mate-paint-benchmark-XXXXXX", &error);
+    if (!output_dir) {
+        std::fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+        return 1;
+    }
+
+    char* output_base = g_build_filename(output_dir, "output", NULL);
+    for (const CanvasSize& size : canvas_sizes) {
+        run_canvas_size(size, output_base, quick);
+    }
+    g_free(output_base);
+    g_rmdir(output_dir);
+    g_free(output_dir);
+    return 0;
+}
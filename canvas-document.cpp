@@ -0,0 +1,837 @@
+#include "canvas-document.h"
+#include "image-codecs.h"
+#include "pixel-convert.h"
+#include "shape-raster.h"
+#include "surface-pool.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+UndoSnapshot take_snapshot(const Document& doc) {
+    UndoSnapshot snapshot;
+    snapshot.surface = clone_surface(doc.surface, doc.width, doc.height);
+    snapshot.width = doc.width;
+    snapshot.height = doc.height;
+    return snapshot;
+}
+
+void destroy_snapshot(UndoSnapshot& snapshot) {
+    if (snapshot.surface) {
+        cairo_surface_destroy(snapshot.surface);
+    }
+    if (snapshot.selection.surface) {
+        cairo_surface_destroy(snapshot.selection.surface);
+    }
+}
+
+void push_snapshot(std::vector<UndoSnapshot>& stack, UndoSnapshot snapshot) {
+    if (snapshot.kind == UNDO_CANVAS && !snapshot.surface) return;
+
+    stack.push_back(std::move(snapshot));
+    if (stack.size() > Document::max_undo_steps) {
+        destroy_snapshot(stack.front());
+        stack.erase(stack.begin());
+    }
+}
+
+void clear_snapshots(std::vector<UndoSnapshot>& stack) {
+    for (UndoSnapshot& snapshot : stack) {
+        destroy_snapshot(snapshot);
+    }
+    stack.clear();
+}
+
+// Exchange the saved tile pixels with the canvas, turning an undo step
+// into the matching redo step and back
+void swap_tiles(Document& doc, std::vector<UndoTile>& tiles) {
+    cairo_surface_flush(doc.surface);
+    unsigned char* data = cairo_image_surface_get_data(doc.surface);
+    int stride = cairo_image_surface_get_stride(doc.surface);
+
+    for (UndoTile& tile : tiles) {
+        if (tile.x + tile.width > doc.width || tile.y + tile.height > doc.height) continue;
+
+        for (int row = 0; row < tile.height; row++) {
+            guint32* canvas_row = reinterpret_cast<guint32*>(data + (size_t)(tile.y + row) * stride) + tile.x;
+            guint32* saved_row = &tile.pixels[(size_t)row * tile.width];
+            std::swap_ranges(saved_row, saved_row + tile.width, canvas_row);
+        }
+        cairo_surface_mark_dirty_rectangle(doc.surface, tile.x, tile.y, tile.width, tile.height);
+        document_mark_dirty(doc, tile.x, tile.y, tile.width, tile.height);
+    }
+}
+
+// Apply the top of from, saving the state it replaces onto to
+UndoKind restore_snapshot(Document& doc, FloatingSelection& selection,
+    std::vector<UndoSnapshot>& from, std::vector<UndoSnapshot>& to) {
+    if (from.empty()) return UNDO_NONE;
+
+    UndoSnapshot snapshot = std::move(from.back());
+    from.pop_back();
+
+    if (snapshot.kind == UNDO_SELECTION) {
+        // Hand the pixels over instead of copying them
+        UndoSnapshot current;
+        current.kind = UNDO_SELECTION;
+        current.selection = selection;
+        push_snapshot(to, current);
+        selection = snapshot.selection;
+        return UNDO_SELECTION;
+    }
+
+    if (snapshot.kind == UNDO_TILES) {
+        swap_tiles(doc, snapshot.tiles);
+        push_snapshot(to, std::move(snapshot));
+        return UNDO_TILES;
+    }
+
+    push_snapshot(to, take_snapshot(doc));
+
+    if (doc.surface) {
+        cairo_surface_destroy(doc.surface);
+    }
+    doc.surface = snapshot.surface;
+    doc.width = snapshot.width;
+    doc.height = snapshot.height;
+    return UNDO_CANVAS;
+}
+
+size_t journal_tile_count(const Document& doc) {
+    const int tile_size = Document::undo_tile_size;
+    return (size_t)((doc.width + tile_size - 1) / tile_size) * ((doc.height + tile_size - 1) / tile_size);
+}
+
+// The dirty marks are sized lazily so a canvas that was never marked
+// counts as entirely new
+bool journal_layout_current(const Document& doc) {
+    return doc.journal_width == doc.width && doc.journal_height == doc.height &&
+        doc.journal_dirty.size() == journal_tile_count(doc);
+}
+
+// Resize the generation and hash tables after the canvas size changed;
+// every tile then needs hashing again
+void ensure_tile_layout(Document& doc) {
+    if (doc.tile_layout_width == doc.width && doc.tile_layout_height == doc.height) return;
+
+    size_t count = journal_tile_count(doc);
+    doc.tile_generations.assign(count, 1);
+    doc.tile_hash_generations.assign(count, 0);
+    doc.tile_hashes.assign(count, 0);
+    doc.tile_layout_width = doc.width;
+    doc.tile_layout_height = doc.height;
+}
+
+const guint64 hash_seed = 14695981039346656037ull;
+const guint64 hash_prime = 1099511628211ull;
+
+// FNV-1a over whole pixels rather than bytes
+guint64 hash_words(guint64 hash, const guint32* words, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ words[i]) * hash_prime;
+    }
+    return hash;
+}
+
+}
+
+void document_reset(Document& doc, int width, int height) {
+    cairo_surface_t* surface = create_pooled_surface_uninitialized(width, height);
+    cairo_t* cr = cairo_create(surface);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    document_set_surface(doc, surface);
+}
+
+void document_set_surface(Document& doc, cairo_surface_t* surface) {
+    document_end_stroke(doc);
+    doc.revision++;
+    if (doc.surface) {
+        cairo_surface_destroy(doc.surface);
+    }
+    doc.surface = surface;
+    doc.width = cairo_image_surface_get_width(surface);
+    doc.height = cairo_image_surface_get_height(surface);
+    document_mark_dirty(doc, 0, 0, doc.width, doc.height);
+}
+
+void document_free(Document& doc) {
+    if (doc.surface) {
+        cairo_surface_destroy(doc.surface);
+        doc.surface = nullptr;
+    }
+    doc.stroke_active = false;
+    doc.stroke_tiles.clear();
+    clear_snapshots(doc.undo_stack);
+    clear_snapshots(doc.redo_stack);
+}
+
+void document_push_undo(Document& doc) {
+    document_end_stroke(doc);
+    if (!doc.surface) return;
+
+    UndoSnapshot snapshot = take_snapshot(doc);
+    if (!snapshot.surface) return;
+
+    push_snapshot(doc.undo_stack, snapshot);
+    clear_snapshots(doc.redo_stack);
+    doc.revision++;
+    // Whatever follows may touch any pixel
+    document_mark_dirty(doc, 0, 0, doc.width, doc.height);
+}
+
+void document_push_selection_undo(Document& doc, const FloatingSelection& selection) {
+    document_end_stroke(doc);
+    UndoSnapshot snapshot;
+    snapshot.kind = UNDO_SELECTION;
+    snapshot.selection = selection;
+    if (selection.surface) {
+        snapshot.selection.surface = clone_surface(selection.surface,
+            cairo_image_surface_get_width(selection.surface),
+            cairo_image_surface_get_height(selection.surface));
+        if (!snapshot.selection.surface) return;
+    }
+
+    push_snapshot(doc.undo_stack, snapshot);
+    clear_snapshots(doc.redo_stack);
+    doc.revision++;
+}
+
+void document_begin_stroke(Document& doc) {
+    document_end_stroke(doc);
+    if (!doc.surface) return;
+
+    const int tile_size = Document::undo_tile_size;
+    int columns = (doc.width + tile_size - 1) / tile_size;
+    int rows = (doc.height + tile_size - 1) / tile_size;
+    doc.stroke_tile_saved.assign((size_t)columns * rows, 0);
+    doc.stroke_tiles.clear();
+    doc.stroke_active = true;
+}
+
+void document_capture_area(Document& doc, int x, int y, int width, int height) {
+    if (!doc.stroke_active) return;
+
+    int x1 = std::max(0, x);
+    int y1 = std::max(0, y);
+    int x2 = std::min(doc.width, x + width);
+    int y2 = std::min(doc.height, y + height);
+    if (x1 >= x2 || y1 >= y2) return;
+    doc.revision++;
+    document_mark_dirty(doc, x1, y1, x2 - x1, y2 - y1);
+
+    const int tile_size = Document::undo_tile_size;
+    int columns = (doc.width + tile_size - 1) / tile_size;
+    const unsigned char* data = nullptr;
+    int stride = 0;
+
+    for (int ty = y1 / tile_size; ty <= (y2 - 1) / tile_size; ty++) {
+        for (int tx = x1 / tile_size; tx <= (x2 - 1) / tile_size; tx++) {
+            unsigned char& saved = doc.stroke_tile_saved[(size_t)ty * columns + tx];
+            if (saved) continue;
+            saved = 1;
+
+            if (!data) {
+                cairo_surface_flush(doc.surface);
+                data = cairo_image_surface_get_data(doc.surface);
+                stride = cairo_image_surface_get_stride(doc.surface);
+            }
+
+            UndoTile tile;
+            tile.x = tx * tile_size;
+            tile.y = ty * tile_size;
+            tile.width = std::min(tile_size, doc.width - tile.x);
+            tile.height = std::min(tile_size, doc.height - tile.y);
+            tile.pixels.resize((size_t)tile.width * tile.height);
+            for (int row = 0; row < tile.height; row++) {
+                const guint32* src = reinterpret_cast<const guint32*>(data + (size_t)(tile.y + row) * stride) + tile.x;
+                std::copy(src, src + tile.width, &tile.pixels[(size_t)row * tile.width]);
+            }
+            doc.stroke_tiles.push_back(std::move(tile));
+        }
+    }
+}
+
+void document_end_stroke(Document& doc) {
+    if (!doc.stroke_active) return;
+    doc.stroke_active = false;
+    if (doc.stroke_tiles.empty()) return;
+
+    UndoSnapshot snapshot;
+    snapshot.kind = UNDO_TILES;
+    snapshot.width = doc.width;
+    snapshot.height = doc.height;
+    snapshot.tiles.swap(doc.stroke_tiles);
+    push_snapshot(doc.undo_stack, std::move(snapshot));
+    clear_snapshots(doc.redo_stack);
+}
+
+size_t undo_snapshot_byte_size(const UndoSnapshot& snapshot) {
+    size_t total = 0;
+    if (snapshot.surface) {
+        total += (size_t)cairo_image_surface_get_stride(snapshot.surface) * cairo_image_surface_get_height(snapshot.surface);
+    }
+    if (snapshot.selection.surface) {
+        total += (size_t)cairo_image_surface_get_stride(snapshot.selection.surface) *
+            cairo_image_surface_get_height(snapshot.selection.surface);
+    }
+    for (const UndoTile& tile : snapshot.tiles) {
+        total += tile.pixels.size() * sizeof(guint32);
+    }
+    return total;
+}
+
+UndoKind document_undo(Document& doc, FloatingSelection& selection) {
+    document_end_stroke(doc);
+    UndoKind kind = restore_snapshot(doc, selection, doc.undo_stack, doc.redo_stack);
+    if (kind != UNDO_NONE) doc.revision++;
+    // Tile steps mark the tiles they swapped back
+    if (kind == UNDO_CANVAS) document_mark_dirty(doc, 0, 0, doc.width, doc.height);
+    return kind;
+}
+
+UndoKind document_redo(Document& doc, FloatingSelection& selection) {
+    document_end_stroke(doc);
+    UndoKind kind = restore_snapshot(doc, selection, doc.redo_stack, doc.undo_stack);
+    if (kind != UNDO_NONE) doc.revision++;
+    if (kind == UNDO_CANVAS) document_mark_dirty(doc, 0, 0, doc.width, doc.height);
+    return kind;
+}
+
+void document_revert(Document& doc) {
+    document_end_stroke(doc);
+    if (doc.undo_stack.empty() || doc.undo_stack.back().kind == UNDO_SELECTION) return;
+
+    std::vector<UndoSnapshot> discarded;
+    FloatingSelection selection;
+    UndoKind kind = restore_snapshot(doc, selection, doc.undo_stack, discarded);
+    clear_snapshots(discarded);
+    doc.revision++;
+    if (kind == UNDO_CANVAS) document_mark_dirty(doc, 0, 0, doc.width, doc.height);
+}
+
+bool document_contains(const Document& doc, int x, int y) {
+    return doc.surface && x >= 0 && x < doc.width && y >= 0 && y < doc.height;
+}
+
+guint32 document_read_pixel(const Document& doc, int x, int y) {
+    unsigned char* data = cairo_image_surface_get_data(doc.surface);
+    int stride = cairo_image_surface_get_stride(doc.surface);
+    const guint32* row = reinterpret_cast<const guint32*>(data + (size_t)y * stride);
+    return row[x];
+}
+
+bool document_flood_fill(Document& doc, int x, int y, guint32 replacement) {
+    if (!document_contains(doc, x, y)) return false;
+
+    cairo_surface_flush(doc.surface);
+    guint32 target = document_read_pixel(doc, x, y);
+    if (target == replacement) return false;
+
+    FloodFillMask mask;
+    compute_flood_fill(doc.surface, x, y, target, mask, NULL);
+
+    document_push_undo(doc);
+    apply_flood_fill_rows(doc.surface, mask, replacement, 0, mask.max_y - mask.min_y + 1);
+    cairo_surface_mark_dirty(doc.surface);
+    return true;
+}
+
+cairo_surface_t* create_remapped_surface(cairo_surface_t* source, PixelRemap remap, int width, int height) {
+    cairo_surface_t* result = create_pooled_surface_uninitialized(width, height);
+    if (cairo_surface_status(result) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(result);
+        return nullptr;
+    }
+
+    cairo_surface_flush(source);
+    cairo_surface_flush(result);
+    SurfaceRemap r = make_surface_remap(remap, source, result);
+    remap_pixel_rows(r, 0, r.dst_height);
+    cairo_surface_mark_dirty(result);
+    return result;
+}
+
+cairo_surface_t* create_resized_surface(cairo_surface_t* source, int width, int height, const RgbaColor& fill) {
+    cairo_surface_t* result = create_pooled_surface_uninitialized(width, height);
+    if (cairo_surface_status(result) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(result);
+        return nullptr;
+    }
+
+    cairo_t* cr = cairo_create(result);
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_rgba(cr, fill.red, fill.green, fill.blue, fill.alpha);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    cairo_set_source_surface(cr, source, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return result;
+}
+
+cairo_surface_t* extract_selection(cairo_surface_t* surface, int x, int y, int width, int height,
+    const SelectionPath& path) {
+    cairo_surface_t* result = create_pooled_surface(width, height);
+
+    if (path.size() <= 2) {
+        cairo_t* cr = cairo_create(result);
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+        cairo_translate(cr, -x, -y);
+        cairo_set_source_surface(cr, surface, 0, 0);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        return result;
+    }
+
+    // Copy the lasso's spans, clipped to both the rectangle and the source
+    int left = std::max(x, 0);
+    int top = std::max(y, 0);
+    int right = std::min(x + width, cairo_image_surface_get_width(surface));
+    int bottom = std::min(y + height, cairo_image_surface_get_height(surface));
+    ShapeOutline outline(left, top, right - left, bottom - top);
+    outline_add_polygon(outline, path);
+
+    cairo_surface_flush(surface);
+    const unsigned char* src = cairo_image_surface_get_data(surface);
+    int src_stride = cairo_image_surface_get_stride(surface);
+    unsigned char* dst = cairo_image_surface_get_data(result);
+    int dst_stride = cairo_image_surface_get_stride(result);
+    for (const PixelSpan& span : rasterize_outline(outline, FILL_RULE_NONZERO)) {
+        std::memcpy(dst + (size_t)(span.y - y) * dst_stride + (size_t)(span.x - x) * 4,
+            src + (size_t)span.y * src_stride + (size_t)span.x * 4, (size_t)span.width * 4);
+    }
+    cairo_surface_mark_dirty(result);
+    return result;
+}
+
+void fill_selection(cairo_surface_t* surface, int x, int y, int width, int height,
+    const SelectionPath& path, const RgbaColor& color) {
+    ShapeOutline outline = create_surface_outline(surface);
+    if (path.size() > 2) {
+        outline_add_polygon(outline, path);
+    } else {
+        outline_add_rectangle(outline, x, y, width, height);
+    }
+
+    guint32 pixel = (channel_to_byte(color.alpha) << 24) | (channel_to_byte(color.red) << 16) |
+        (channel_to_byte(color.green) << 8) | channel_to_byte(color.blue);
+    cairo_surface_flush(surface);
+    fill_spans(surface, rasterize_outline(outline, FILL_RULE_NONZERO), pixel);
+    cairo_surface_mark_dirty(surface);
+}
+
+std::string get_file_extension_lowercase(const std::string& filename) {
+    size_t dot_pos = filename.find_last_of('.');
+    if (dot_pos == std::string::npos || dot_pos + 1 >= filename.size()) {
+        return "";
+    }
+
+    std::string extension = filename.substr(dot_pos + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) {
+        return static_cast<char>(std::tolower(ch));
+    });
+    return extension;
+}
+
+bool is_save_format(const std::string& extension) {
+    return extension == "png" || extension == "jpg" || extension == "jpeg" || extension == "xpm" ||
+        is_builtin_image_format(extension);
+}
+
+bool save_surface_to_file(cairo_surface_t* surface, const std::string& filename, const RowRunner& for_rows) {
+    if (!surface || filename.empty()) {
+        return false;
+    }
+
+    std::string extension = get_file_extension_lowercase(filename);
+    if (is_builtin_image_format(extension)) {
+        return save_builtin_image(surface, filename);
+    }
+    if (extension == "xpm") {
+        return save_xpm_image(surface, filename, for_rows);
+    }
+    if (extension == "jpg" || extension == "jpeg") {
+        GdkPixbuf* pixbuf = create_pixbuf_from_surface(surface, false);
+        if (!pixbuf) return false;
+
+        bool save_success = gdk_pixbuf_save(pixbuf, filename.c_str(), "jpeg", NULL, "quality", "95", NULL);
+        g_object_unref(pixbuf);
+        return save_success;
+    }
+
+    return cairo_surface_write_to_png(surface, filename.c_str()) == CAIRO_STATUS_SUCCESS;
+}
+
+cairo_surface_t* load_surface_from_file(const std::string& filename) {
+    std::string extension = get_file_extension_lowercase(filename);
+    if (is_builtin_image_format(extension)) {
+        cairo_surface_t* surface = load_builtin_image(filename);
+        if (surface) return surface;
+    }
+
+    if (extension == "png") {
+        cairo_surface_t* surface = cairo_image_surface_create_from_png(filename.c_str());
+        if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS) {
+            return surface;
+        }
+        cairo_surface_destroy(surface);
+    }
+
+    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(filename.c_str(), NULL);
+    if (!pixbuf) return nullptr;
+
+    cairo_surface_t* surface = create_surface_from_pixbuf(pixbuf);
+    g_object_unref(pixbuf);
+    return surface;
+}
+
+namespace {
+
+bool pixbuf_is_convertible(GdkPixbuf* pixbuf) {
+    return pixbuf && gdk_pixbuf_get_width(pixbuf) > 0 && gdk_pixbuf_get_height(pixbuf) > 0 &&
+        gdk_pixbuf_get_n_channels(pixbuf) >= 3 && gdk_pixbuf_get_bits_per_sample(pixbuf) == 8;
+}
+
+// Premultiply a rectangle of the pixbuf into the same rectangle of surface.
+// Does not flush or mark the surface dirty.
+void copy_pixbuf_area(GdkPixbuf* pixbuf, cairo_surface_t* surface, int x, int y, int width, int height) {
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    const guchar* src_data = gdk_pixbuf_read_pixels(pixbuf);
+    int src_stride = gdk_pixbuf_get_rowstride(pixbuf);
+    unsigned char* dst_data = cairo_image_surface_get_data(surface);
+    int dst_stride = cairo_image_surface_get_stride(surface);
+
+    for (int row = y; row < y + height; row++) {
+        const guchar* src = src_data + (size_t)row * src_stride + (size_t)x * channels;
+        guint32* dst = (guint32*)(dst_data + (size_t)row * dst_stride) + x;
+        premultiply_row(src, dst, width, gdk_pixbuf_get_has_alpha(pixbuf) ? 4 : 3, CHANNELS_RGBA);
+    }
+}
+
+// File chunk handed to the pixbuf loader per read
+const gsize stream_chunk_size = 256 * 1024;
+
+struct StreamDecode {
+    const ImageStreamSink* sink = nullptr;
+    cairo_surface_t* surface = nullptr;
+    int max_size = 0;
+};
+
+void on_stream_size_prepared(GdkPixbufLoader* loader, int width, int height, gpointer data) {
+    StreamDecode* decode = static_cast<StreamDecode*>(data);
+    if (decode->max_size <= 0 || (width <= decode->max_size && height <= decode->max_size)) return;
+
+    double scale = std::min((double)decode->max_size / width, (double)decode->max_size / height);
+    gdk_pixbuf_loader_set_size(loader, std::max(1, (int)(width * scale + 0.5)), std::max(1, (int)(height * scale + 0.5)));
+}
+
+void on_stream_area_prepared(GdkPixbufLoader* loader, gpointer data) {
+    StreamDecode* decode = static_cast<StreamDecode*>(data);
+    GdkPixbuf* pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (decode->surface || !pixbuf_is_convertible(pixbuf)) return;
+
+    cairo_surface_t* surface = create_pooled_surface(gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return;
+    }
+    cairo_surface_flush(surface);
+    decode->surface = surface;
+    if (decode->sink->started) {
+        decode->sink->started(surface);
+    }
+}
+
+void on_stream_area_updated(GdkPixbufLoader* loader, int x, int y, int width, int height, gpointer data) {
+    StreamDecode* decode = static_cast<StreamDecode*>(data);
+    GdkPixbuf* pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (!decode->surface || !pixbuf_is_convertible(pixbuf)) return;
+
+    int x2 = std::min(x + width, std::min(gdk_pixbuf_get_width(pixbuf), cairo_image_surface_get_width(decode->surface)));
+    int y2 = std::min(y + height, std::min(gdk_pixbuf_get_height(pixbuf), cairo_image_surface_get_height(decode->surface)));
+    x = std::max(0, x);
+    y = std::max(0, y);
+    if (x >= x2 || y >= y2) return;
+
+    copy_pixbuf_area(pixbuf, decode->surface, x, y, x2 - x, y2 - y);
+    if (decode->sink->rows) {
+        decode->sink->rows(y, y2 - y);
+    }
+}
+
+}
+
+GdkPixbuf* create_pixbuf_from_surface(cairo_surface_t* surface, bool with_alpha) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    if (width <= 0 || height <= 0) return nullptr;
+
+    GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, with_alpha, 8, width, height);
+    if (!pixbuf) return nullptr;
+
+    cairo_surface_flush(surface);
+    const unsigned char* src_data = cairo_image_surface_get_data(surface);
+    int src_stride = cairo_image_surface_get_stride(surface);
+    guchar* dst_data = gdk_pixbuf_get_pixels(pixbuf);
+    int dst_stride = gdk_pixbuf_get_rowstride(pixbuf);
+
+    for (int row = 0; row < height; row++) {
+        const guint32* src = (const guint32*)(src_data + (size_t)row * src_stride);
+        guchar* dst = dst_data + (size_t)row * dst_stride;
+        if (with_alpha) {
+            unpremultiply_row(src, dst, width, CHANNELS_RGBA);
+        } else {
+            pack_rgb_row(src, dst, width);
+        }
+    }
+    return pixbuf;
+}
+
+// Only touches pixbuf and cairo image memory, so it may run on a worker thread
+cairo_surface_t* create_surface_from_pixbuf(GdkPixbuf* pixbuf) {
+    if (!pixbuf_is_convertible(pixbuf)) return nullptr;
+
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
+    cairo_surface_t* surface = create_pooled_surface_uninitialized(width, height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return nullptr;
+    }
+    cairo_surface_flush(surface);
+    copy_pixbuf_area(pixbuf, surface, 0, 0, width, height);
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+cairo_surface_t* stream_surface_from_file(const std::string& filename, const ImageStreamSink& sink,
+    GCancellable* cancellable, int max_size) {
+    // Uncompressed enough that decoding in one go beats streaming. They are
+    // never scaled: the preview size check reads sizes through gdk-pixbuf,
+    // which does not know QOI or PAM.
+    if (is_builtin_image_format(get_file_extension_lowercase(filename))) {
+        cairo_surface_t* surface = load_builtin_image(filename);
+        if (surface) {
+            if (sink.started) {
+                sink.started(surface);
+            }
+            if (sink.rows) {
+                sink.rows(0, cairo_image_surface_get_height(surface));
+            }
+            return surface;
+        }
+    }
+
+    GFile* file = g_file_new_for_path(filename.c_str());
+    GFileInputStream* input = g_file_read(file, cancellable, NULL);
+    g_object_unref(file);
+    if (!input) return nullptr;
+
+    goffset file_size = 0;
+    GFileInfo* info = g_file_input_stream_query_info(input, G_FILE_ATTRIBUTE_STANDARD_SIZE, cancellable, NULL);
+    if (info) {
+        file_size = g_file_info_get_size(info);
+        g_object_unref(info);
+    }
+
+    StreamDecode decode;
+    decode.sink = &sink;
+    decode.max_size = max_size;
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(on_stream_size_prepared), &decode);
+    g_signal_connect(loader, "area-prepared", G_CALLBACK(on_stream_area_prepared), &decode);
+    g_signal_connect(loader, "area-updated", G_CALLBACK(on_stream_area_updated), &decode);
+
+    std::vector<guchar> buffer(stream_chunk_size);
+    goffset bytes_read = 0;
+    bool ok = true;
+    while (ok) {
+        gssize count = g_input_stream_read(G_INPUT_STREAM(input), buffer.data(), buffer.size(), cancellable, NULL);
+        if (count <= 0) {
+            ok = count == 0;
+            break;
+        }
+        ok = gdk_pixbuf_loader_write(loader, buffer.data(), count, NULL);
+        bytes_read += count;
+        if (sink.progress) {
+            sink.progress(bytes_read, file_size);
+        }
+    }
+
+    // The loader must always be closed; it may still emit the last rows
+    ok = gdk_pixbuf_loader_close(loader, NULL) && ok;
+    g_object_unref(loader);
+    g_object_unref(input);
+
+    if (!decode.surface) return nullptr;
+    if (!ok) {
+        cairo_surface_destroy(decode.surface);
+        return nullptr;
+    }
+    cairo_surface_mark_dirty(decode.surface);
+    return decode.surface;
+}
+
+cairo_surface_t* render_preview_recipe(const PreviewRecipe& recipe, GCancellable* cancellable) {
+    cairo_surface_t* surface = stream_surface_from_file(recipe.path, ImageStreamSink(), cancellable);
+    if (!surface) return nullptr;
+
+    // Full-resolution pixels per preview pixel, fixed at open time
+    double scale_x = (double)cairo_image_surface_get_width(surface) / std::max(1, recipe.preview_width);
+    double scale_y = (double)cairo_image_surface_get_height(surface) / std::max(1, recipe.preview_height);
+
+    for (const PreviewStep& step : recipe.steps) {
+        if (g_cancellable_is_cancelled(cancellable)) break;
+
+        bool swaps_axes = !step.resize &&
+            (step.remap == REMAP_ROTATE_CLOCKWISE || step.remap == REMAP_ROTATE_COUNTER_CLOCKWISE);
+        if (swaps_axes) {
+            std::swap(scale_x, scale_y);
+        }
+        int width = std::max(1, (int)(step.width * scale_x + 0.5));
+        int height = std::max(1, (int)(step.height * scale_y + 0.5));
+
+        cairo_surface_t* next = step.resize ?
+            create_resized_surface(surface, width, height, step.fill) :
+            create_remapped_surface(surface, step.remap, width, height);
+        cairo_surface_destroy(surface);
+        if (!next) return nullptr;
+        surface = next;
+    }
+
+    if (g_cancellable_is_cancelled(cancellable)) {
+        cairo_surface_destroy(surface);
+        return nullptr;
+    }
+    return surface;
+}
+
+void document_mark_dirty(Document& doc, int x, int y, int width, int height) {
+    ensure_tile_layout(doc);
+    bool journal = journal_layout_current(doc);
+
+    int x1 = std::max(0, x);
+    int y1 = std::max(0, y);
+    int x2 = std::min(doc.width, x + width);
+    int y2 = std::min(doc.height, y + height);
+    if (x1 >= x2 || y1 >= y2) return;
+
+    const int tile_size = Document::undo_tile_size;
+    int columns = (doc.width + tile_size - 1) / tile_size;
+    for (int ty = y1 / tile_size; ty <= (y2 - 1) / tile_size; ty++) {
+        for (int tx = x1 / tile_size; tx <= (x2 - 1) / tile_size; tx++) {
+            size_t index = (size_t)ty * columns + tx;
+            doc.tile_generations[index]++;
+            if (journal && !doc.journal_dirty[index]) {
+                doc.journal_dirty[index] = 1;
+                doc.journal_dirty_count++;
+            }
+        }
+    }
+}
+
+guint64 document_content_hash(Document& doc) {
+    guint32 size[2] = {(guint32)doc.width, (guint32)doc.height};
+    guint64 hash = hash_words(hash_seed, size, 2);
+    if (!doc.surface) return hash;
+
+    ensure_tile_layout(doc);
+    const int tile_size = Document::undo_tile_size;
+    int columns = (doc.width + tile_size - 1) / tile_size;
+    const unsigned char* data = nullptr;
+    int stride = 0;
+
+    for (size_t i = 0; i < doc.tile_generations.size(); i++) {
+        if (doc.tile_hash_generations[i] != doc.tile_generations[i]) {
+            if (!data) {
+                cairo_surface_flush(doc.surface);
+                data = cairo_image_surface_get_data(doc.surface);
+                stride = cairo_image_surface_get_stride(doc.surface);
+            }
+
+            int x = (int)(i % columns) * tile_size;
+            int y = (int)(i / columns) * tile_size;
+            int width = std::min(tile_size, doc.width - x);
+            int height = std::min(tile_size, doc.height - y);
+            guint64 tile_hash = hash_seed;
+            for (int row = 0; row < height; row++) {
+                tile_hash = hash_words(tile_hash,
+                    reinterpret_cast<const guint32*>(data + (size_t)(y + row) * stride) + x, width);
+            }
+            doc.tile_hashes[i] = tile_hash;
+            doc.tile_hash_generations[i] = doc.tile_generations[i];
+        }
+        hash = (hash ^ doc.tile_hashes[i]) * hash_prime;
+    }
+    return hash;
+}
+
+bool document_journal_clean(const Document& doc) {
+    return journal_layout_current(doc) && doc.journal_dirty_count == 0;
+}
+
+JournalRecord document_take_journal_record(Document& doc, size_t max_tiles, bool full) {
+    JournalRecord record;
+    record.width = doc.width;
+    record.height = doc.height;
+    if (!doc.surface) return record;
+
+    record.full = full || !journal_layout_current(doc);
+    if (record.full) {
+        doc.journal_width = doc.width;
+        doc.journal_height = doc.height;
+        doc.journal_dirty.assign(journal_tile_count(doc), 1);
+        doc.journal_dirty_count = doc.journal_dirty.size();
+        doc.journal_cursor = 0;
+        doc.journal_frame_remaining = doc.journal_dirty.size();
+    }
+
+    const int tile_size = Document::undo_tile_size;
+    int columns = (doc.width + tile_size - 1) / tile_size;
+    cairo_surface_flush(doc.surface);
+    const unsigned char* data = cairo_image_surface_get_data(doc.surface);
+    int stride = cairo_image_surface_get_stride(doc.surface);
+
+    // Each scan goes on from where the last one stopped, so tiles painted
+    // over again and again cannot hold back the rest of a full frame: it
+    // is complete once the scan has passed every tile
+    size_t count = doc.journal_dirty.size();
+    size_t scanned = 0;
+    for (; scanned < count && record.tiles.size() < max_tiles; scanned++) {
+        size_t i = (doc.journal_cursor + scanned) % count;
+        if (!doc.journal_dirty[i]) continue;
+        doc.journal_dirty[i] = 0;
+        doc.journal_dirty_count--;
+
+        UndoTile tile;
+        tile.x = (int)(i % columns) * tile_size;
+        tile.y = (int)(i / columns) * tile_size;
+        tile.width = std::min(tile_size, doc.width - tile.x);
+        tile.height = std::min(tile_size, doc.height - tile.y);
+        tile.pixels.resize((size_t)tile.width * tile.height);
+        for (int row = 0; row < tile.height; row++) {
+            const guint32* src = reinterpret_cast<const guint32*>(data + (size_t)(tile.y + row) * stride) + tile.x;
+            std::copy(src, src + tile.width, &tile.pixels[(size_t)row * tile.width]);
+        }
+        record.tiles.push_back(std::move(tile));
+    }
+    doc.journal_cursor = count ? (doc.journal_cursor + scanned) % count : 0;
+    doc.journal_frame_remaining -= std::min(doc.journal_frame_remaining, scanned);
+    record.complete = doc.journal_frame_remaining == 0;
+    return record;
+}
+
+void document_reset_journal(Document& doc) {
+    doc.journal_width = doc.width;
+    doc.journal_height = doc.height;
+    doc.journal_dirty.assign(journal_tile_count(doc), 0);
+    doc.journal_dirty_count = 0;
+    doc.journal_cursor = 0;
+    doc.journal_frame_remaining = 0;
+}
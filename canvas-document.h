@@ -0,0 +1,243 @@
+// The canvas document: pixel surface, undo history and the whole-image
+// operations on it. Only depends on cairo, GIO and gdk-pixbuf, so the GUI,
+// the benchmarks and headless front-ends all build on it.
+#ifndef MATE_PAINT_CANVAS_DOCUMENT_H
+#define MATE_PAINT_CANVAS_DOCUMENT_H
+
+#include <cairo.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <gio/gio.h>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "color-quantizer.h"
+#include "pixel-kernels.h"
+
+typedef std::vector<std::pair<double, double>> SelectionPath;
+
+// What an undo step restores
+enum UndoKind {
+    UNDO_NONE,
+    UNDO_CANVAS,
+    UNDO_SELECTION,
+    UNDO_TILES
+};
+
+// Pixels lifted off the canvas and their outline; surface is null when
+// nothing is floating
+struct FloatingSelection {
+    cairo_surface_t* surface = nullptr;
+    double x1 = 0;
+    double y1 = 0;
+    double x2 = 0;
+    double y2 = 0;
+    bool is_rect = true;
+    SelectionPath path;
+};
+
+// Canvas pixels saved before a stroke first painted over them
+struct UndoTile {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<guint32> pixels;
+};
+
+// Canvas steps hold the whole canvas; selection steps only hold the
+// floating selection, so transforming it costs memory in proportion to
+// the selection rather than the canvas. Tile steps hold just the parts of
+// the canvas a stroke touched.
+struct UndoSnapshot {
+    UndoKind kind = UNDO_CANVAS;
+    cairo_surface_t* surface = nullptr;
+    int width = 0;
+    int height = 0;
+    FloatingSelection selection;
+    std::vector<UndoTile> tiles;
+};
+
+struct Document {
+    cairo_surface_t* surface = nullptr;
+    int width = 0;
+    int height = 0;
+    std::vector<UndoSnapshot> undo_stack;
+    std::vector<UndoSnapshot> redo_stack;
+    static constexpr size_t max_undo_steps = 50;
+    // Bumped by every change to the canvas or its history, so callers can
+    // tell whether anything happened since they last looked
+    unsigned revision = 0;
+
+    // Copy-before-write state of the stroke in progress
+    static constexpr int undo_tile_size = 64;
+    bool stroke_active = false;
+    std::vector<unsigned char> stroke_tile_saved;
+    std::vector<UndoTile> stroke_tiles;
+
+    // Per 64x64 tile: a generation bumped whenever its pixels may have
+    // changed, and the content hash cached at some generation, laid out
+    // for a canvas of tile_layout_width x tile_layout_height
+    std::vector<guint32> tile_generations;
+    std::vector<guint32> tile_hash_generations;
+    std::vector<guint64> tile_hashes;
+    int tile_layout_width = 0;
+    int tile_layout_height = 0;
+
+    // Tiles changed since the last autosave journal record, laid out for
+    // a canvas of journal_width x journal_height
+    std::vector<unsigned char> journal_dirty;
+    size_t journal_dirty_count = 0;
+    int journal_width = 0;
+    int journal_height = 0;
+    // Where the next record's scan starts, and how many tiles the scan
+    // still has to pass before a full frame in progress is complete
+    size_t journal_cursor = 0;
+    size_t journal_frame_remaining = 0;
+};
+
+// Straight-alpha colour with channels in [0, 1]
+struct RgbaColor {
+    double red;
+    double green;
+    double blue;
+    double alpha;
+};
+
+// Whole-image step taken on a preview canvas: a remap, or a crop/extend
+// from the top-left corner filled with fill. Sizes are in preview pixels.
+struct PreviewStep {
+    bool resize = false;
+    PixelRemap remap = REMAP_SCALE_NEAREST;
+    int width = 0;
+    int height = 0;
+    RgbaColor fill = {0, 0, 0, 0};
+};
+
+// A canvas decoded at reduced resolution from path, and the whole-image
+// steps taken on it since, so they can be replayed on the full image
+struct PreviewRecipe {
+    std::string path;
+    int source_width = 0;
+    int source_height = 0;
+    int preview_width = 0;
+    int preview_height = 0;
+    std::vector<PreviewStep> steps;
+};
+
+// Canvas pixels copied for one journal record. A full record starts a new
+// canvas of its size; the others patch tiles of the current one. A full
+// frame is spread over several records, and complete is set on the one
+// that finishes it.
+struct JournalRecord {
+    bool full = false;
+    bool complete = false;
+    int width = 0;
+    int height = 0;
+    std::vector<UndoTile> tiles;
+};
+
+// Mark canvas pixels as changed: bumps the tile generations and flags the
+// tiles for the next journal record
+void document_mark_dirty(Document& doc, int x, int y, int width, int height);
+// Hash of the canvas size and pixels. Only tiles whose generation moved
+// since the previous call are read again.
+guint64 document_content_hash(Document& doc);
+// Copy up to max_tiles changed tiles off the canvas and clear their marks.
+// After a size change, or with full set, a full frame starts: every tile
+// is marked, and this record and the next ones take them max_tiles at a
+// time until one comes back complete.
+JournalRecord document_take_journal_record(Document& doc, size_t max_tiles, bool full);
+// Nothing changed since the last record
+bool document_journal_clean(const Document& doc);
+// Forget what the journal holds: every mark is cleared, so nothing is
+// recorded until the canvas changes again
+void document_reset_journal(Document& doc);
+
+// Replace the canvas with a white one; the undo history is kept
+void document_reset(Document& doc, int width, int height);
+// Take ownership of surface as the new canvas
+void document_set_surface(Document& doc, cairo_surface_t* surface);
+// Release the canvas and its history
+void document_free(Document& doc);
+
+void document_push_undo(Document& doc);
+// Record the floating selection before it is transformed in place
+void document_push_selection_undo(Document& doc, const FloatingSelection& selection);
+// Strokes record an undo step lazily: call document_capture_area() for
+// each rectangle just before painting it, and the tiles it covers are
+// saved the first time. The step is pushed by document_end_stroke(), or by
+// anything else that changes the history first.
+void document_begin_stroke(Document& doc);
+void document_capture_area(Document& doc, int x, int y, int width, int height);
+void document_end_stroke(Document& doc);
+// Memory held by one history step
+size_t undo_snapshot_byte_size(const UndoSnapshot& snapshot);
+// Step through the history. Selection steps swap their pixels with
+// selection, which the caller owns before and after; canvas steps leave
+// it alone.
+UndoKind document_undo(Document& doc, FloatingSelection& selection);
+UndoKind document_redo(Document& doc, FloatingSelection& selection);
+// Roll back the newest canvas step without offering it for redo
+void document_revert(Document& doc);
+
+bool document_contains(const Document& doc, int x, int y);
+guint32 document_read_pixel(const Document& doc, int x, int y);
+
+// Fill the region around (x, y) in one go, recording an undo step.
+// Returns false if nothing changed.
+bool document_flood_fill(Document& doc, int x, int y, guint32 replacement);
+
+// Whole-image transforms; both return a new surface owned by the caller,
+// or null if it could not be allocated, and only read source, so they may
+// run on a worker thread
+cairo_surface_t* create_remapped_surface(cairo_surface_t* source, PixelRemap remap, int width, int height);
+cairo_surface_t* create_resized_surface(cairo_surface_t* source, int width, int height, const RgbaColor& fill);
+
+// Pixels of a rectangle, or of a closed path clipped to that rectangle
+// when path has at least three points, copied into a new surface
+cairo_surface_t* extract_selection(cairo_surface_t* surface, int x, int y, int width, int height,
+    const SelectionPath& path);
+void fill_selection(cairo_surface_t* surface, int x, int y, int width, int height,
+    const SelectionPath& path, const RgbaColor& color);
+
+std::string get_file_extension_lowercase(const std::string& filename);
+// Whether save_surface_to_file() knows the extension
+bool is_save_format(const std::string& extension);
+// PNG, or JPEG/XPM/QOI/BMP/PAM/PNM picked by extension. for_rows lets the
+// XPM colour quantizer use several threads.
+bool save_surface_to_file(cairo_surface_t* surface, const std::string& filename,
+    const RowRunner& for_rows = RowRunner());
+// The built-in formats or anything gdk-pixbuf can read; null on failure
+cairo_surface_t* load_surface_from_file(const std::string& filename);
+// Convert an 8-bit RGB(A) pixbuf to a premultiplied ARGB32 surface
+cairo_surface_t* create_surface_from_pixbuf(GdkPixbuf* pixbuf);
+// Copy an ARGB32 surface into a new pixbuf: straight RGBA, or RGB
+// flattened onto black. Both may run on a worker thread.
+GdkPixbuf* create_pixbuf_from_surface(cairo_surface_t* surface, bool with_alpha);
+
+// Callbacks for stream_surface_from_file(), all run on the decoding thread.
+// started() gets the surface as soon as the image size is known, cleared
+// to transparent; take a reference to keep it. rows() follows each band of
+// rows written into it and progress() each chunk read from the file.
+struct ImageStreamSink {
+    std::function<void(cairo_surface_t* surface)> started;
+    std::function<void(int y, int height)> rows;
+    std::function<void(goffset bytes_read, goffset file_size)> progress;
+};
+
+// Decode any format gdk-pixbuf can read, a chunk at a time, so the image
+// can be shown while it loads. With max_size set, images larger than that
+// in either direction are decoded scaled down to fit, which JPEG does
+// cheaply in the DCT. The built-in formats are decoded in one go at full
+// size. Returns the finished surface, or null on failure or cancellation.
+cairo_surface_t* stream_surface_from_file(const std::string& filename, const ImageStreamSink& sink,
+    GCancellable* cancellable, int max_size = 0);
+
+// Decode the recipe's file at full resolution and replay its steps, scaled
+// up to match. Returns null if the file no longer decodes or on
+// cancellation. Safe on a worker thread.
+cairo_surface_t* render_preview_recipe(const PreviewRecipe& recipe, GCancellable* cancellable);
+
+#endif
@@ -0,0 +1,380 @@
+#include "color-quantizer.h"
+#include "pixel-convert.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+namespace {
+
+const int bin_bits = 5;
+const int bin_levels = 1 << bin_bits;
+const int bin_count = bin_levels * bin_levels * bin_levels;
+const int bin_shift = 8 - bin_bits;
+const guint32 opaque_threshold = 128;
+const int refine_passes = 2;
+
+inline int bin_of(guint32 r, guint32 g, guint32 b) {
+    return ((r >> bin_shift) << (2 * bin_bits)) | ((g >> bin_shift) << bin_bits) | (b >> bin_shift);
+}
+
+inline int bin_channel(int bin, int channel) {
+    return (bin >> ((2 - channel) * bin_bits)) & (bin_levels - 1);
+}
+
+struct ColorBin {
+    guint64 count = 0;
+    guint64 sum[3] = {0, 0, 0};
+};
+
+// Distinct opaque colours (0xRRGGBB) are collected next to the bins until
+// there are more than exact_limit of them, so an image with few colours
+// keeps them exactly even where they share a bin
+struct ColorHistogram {
+    std::vector<ColorBin> bins;
+    guint64 transparent = 0;
+    std::unordered_set<guint32> exact;
+    size_t exact_limit;
+    bool exact_overflow = false;
+
+    explicit ColorHistogram(size_t limit) : bins(bin_count), exact_limit(limit) {}
+
+    void add_exact(guint32 color) {
+        if (exact_overflow) return;
+        exact.insert(color);
+        if (exact.size() > exact_limit) {
+            exact_overflow = true;
+            exact.clear();
+        }
+    }
+};
+
+void run_rows(const RowRunner& for_rows, int count, const std::function<void(int, int)>& body) {
+    if (for_rows) {
+        for_rows(count, body);
+    } else if (count > 0) {
+        body(0, count);
+    }
+}
+
+const guint32* surface_row(const unsigned char* data, int stride, int y) {
+    return reinterpret_cast<const guint32*>(data + (size_t)y * stride);
+}
+
+void accumulate_rows(const unsigned char* data, int stride, int width, int begin, int end,
+    ColorHistogram& histogram) {
+    std::vector<guchar> rgba((size_t)width * 4);
+    guint32 last = G_MAXUINT32;   // no 0xRRGGBB value
+    for (int y = begin; y < end; y++) {
+        unpremultiply_row(surface_row(data, stride, y), rgba.data(), width, CHANNELS_RGBA);
+        const guchar* p = rgba.data();
+        for (int x = 0; x < width; x++, p += 4) {
+            if (p[3] < opaque_threshold) {
+                histogram.transparent++;
+                continue;
+            }
+            guint32 color = ((guint32)p[0] << 16) | ((guint32)p[1] << 8) | p[2];
+            if (color != last) {
+                last = color;
+                histogram.add_exact(color);
+            }
+            ColorBin& bin = histogram.bins[bin_of(p[0], p[1], p[2])];
+            bin.count++;
+            bin.sum[0] += p[0];
+            bin.sum[1] += p[1];
+            bin.sum[2] += p[2];
+        }
+    }
+}
+
+guint32 mean_color(const guint64 sum[3], guint64 count) {
+    guint32 color = 0;
+    for (int c = 0; c < 3; c++) {
+        color = (color << 8) | (guint32)((sum[c] + count / 2) / count);
+    }
+    return color;
+}
+
+// Palette channels kept apart so the distance loop is a plain sweep over
+// three arrays
+struct PaletteSearch {
+    std::vector<int> r;
+    std::vector<int> g;
+    std::vector<int> b;
+
+    explicit PaletteSearch(const std::vector<guint32>& colors) {
+        for (guint32 color : colors) {
+            r.push_back((color >> 16) & 0xFF);
+            g.push_back((color >> 8) & 0xFF);
+            b.push_back(color & 0xFF);
+        }
+    }
+
+    int nearest(int red, int green, int blue) const {
+        int best = 0;
+        int best_distance = G_MAXINT;
+        for (size_t i = 0; i < r.size(); i++) {
+            int dr = r[i] - red;
+            int dg = g[i] - green;
+            int db = b[i] - blue;
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = (int)i;
+            }
+        }
+        return best;
+    }
+};
+
+// The colour a bin stands for: its pixels' mean, or its centre when empty
+void bin_color(const ColorHistogram& histogram, int bin, int rgb[3]) {
+    const ColorBin& entry = histogram.bins[bin];
+    for (int c = 0; c < 3; c++) {
+        rgb[c] = entry.count ?
+            (int)((entry.sum[c] + entry.count / 2) / entry.count) :
+            (bin_channel(bin, c) << bin_shift) + (1 << (bin_shift - 1));
+    }
+}
+
+// A run of bins in the median cut's working list
+struct CutBox {
+    size_t begin;
+    size_t end;
+    guint64 weight;
+    int axis;    // channel with the widest range
+    int range;
+};
+
+CutBox make_box(const ColorHistogram& histogram, const std::vector<int>& bins, size_t begin, size_t end) {
+    CutBox box = {begin, end, 0, 0, 0};
+    int low[3] = {bin_levels, bin_levels, bin_levels};
+    int high[3] = {-1, -1, -1};
+    for (size_t i = begin; i < end; i++) {
+        box.weight += histogram.bins[bins[i]].count;
+        for (int c = 0; c < 3; c++) {
+            low[c] = std::min(low[c], bin_channel(bins[i], c));
+            high[c] = std::max(high[c], bin_channel(bins[i], c));
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        if (high[c] - low[c] > box.range) {
+            box.range = high[c] - low[c];
+            box.axis = c;
+        }
+    }
+    return box;
+}
+
+// Median cut: split the box with the most pixels times spread at the
+// weighted median of its widest channel until there are enough boxes
+std::vector<guint32> cut_palette(const ColorHistogram& histogram, std::vector<int> bins, int target) {
+    std::vector<CutBox> boxes;
+    boxes.push_back(make_box(histogram, bins, 0, bins.size()));
+
+    while ((int)boxes.size() < target) {
+        size_t pick = boxes.size();
+        guint64 best_score = 0;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            guint64 score = boxes[i].weight * boxes[i].range;
+            if (boxes[i].end - boxes[i].begin > 1 && score > best_score) {
+                best_score = score;
+                pick = i;
+            }
+        }
+        if (pick == boxes.size()) break;
+
+        CutBox box = boxes[pick];
+        int axis = box.axis;
+        std::sort(bins.begin() + box.begin, bins.begin() + box.end, [axis](int a, int b) {
+            return bin_channel(a, axis) < bin_channel(b, axis);
+        });
+
+        size_t split = box.begin + 1;
+        guint64 below = histogram.bins[bins[box.begin]].count;
+        while (split < box.end - 1 && below * 2 < box.weight) {
+            below += histogram.bins[bins[split]].count;
+            split++;
+        }
+        boxes[pick] = make_box(histogram, bins, box.begin, split);
+        boxes.push_back(make_box(histogram, bins, split, box.end));
+    }
+
+    std::vector<guint32> colors;
+    for (const CutBox& box : boxes) {
+        ColorBin total;
+        for (size_t i = box.begin; i < box.end; i++) {
+            const ColorBin& bin = histogram.bins[bins[i]];
+            total.count += bin.count;
+            for (int c = 0; c < 3; c++) {
+                total.sum[c] += bin.sum[c];
+            }
+        }
+        colors.push_back(mean_color(total.sum, total.count));
+    }
+    return colors;
+}
+
+// Lloyd passes over the occupied bins: move each entry to the mean of
+// the pixels now nearest to it
+void refine_palette(const ColorHistogram& histogram, const std::vector<int>& bins, std::vector<guint32>& colors) {
+    for (int pass = 0; pass < refine_passes; pass++) {
+        PaletteSearch search(colors);
+        std::vector<ColorBin> clusters(colors.size());
+        for (int bin : bins) {
+            int rgb[3];
+            bin_color(histogram, bin, rgb);
+            ColorBin& cluster = clusters[search.nearest(rgb[0], rgb[1], rgb[2])];
+            cluster.count += histogram.bins[bin].count;
+            for (int c = 0; c < 3; c++) {
+                cluster.sum[c] += histogram.bins[bin].sum[c];
+            }
+        }
+        for (size_t i = 0; i < colors.size(); i++) {
+            if (clusters[i].count) {
+                colors[i] = mean_color(clusters[i].sum, clusters[i].count);
+            }
+        }
+    }
+}
+
+// Thresholds of the 8x8 Bayer matrix, 0 to 63
+int bayer_threshold(int x, int y) {
+    int value = 0;
+    int xc = x ^ y;
+    for (int bit = 0; bit < 3; bit++) {
+        value = (value << 2) | (((xc >> bit) & 1) << 1) | ((y >> bit) & 1);
+    }
+    return value;
+}
+
+}
+
+IndexedImage quantize_surface(cairo_surface_t* surface, int max_colors, bool dither, const RowRunner& for_rows) {
+    IndexedImage image;
+    image.width = cairo_image_surface_get_width(surface);
+    image.height = cairo_image_surface_get_height(surface);
+    if (image.width <= 0 || image.height <= 0) return image;
+    max_colors = CLAMP(max_colors, 2, 256);
+
+    cairo_surface_flush(surface);
+    const unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int width = image.width;
+
+    // Each range fills its own histogram and adds it to the total. Up to
+    // max_colors distinct colours are tracked: one more than the target
+    // would be enough, but the target depends on transparency seen later.
+    ColorHistogram histogram(max_colors);
+    GMutex mutex;
+    g_mutex_init(&mutex);
+    run_rows(for_rows, image.height, [&](int begin, int end) {
+        ColorHistogram part(max_colors);
+        accumulate_rows(data, stride, width, begin, end, part);
+        g_mutex_lock(&mutex);
+        if (part.exact_overflow) {
+            histogram.exact_overflow = true;
+            histogram.exact.clear();
+        }
+        for (guint32 color : part.exact) {
+            histogram.add_exact(color);
+        }
+        for (int i = 0; i < bin_count; i++) {
+            const ColorBin& bin = part.bins[i];
+            if (!bin.count) continue;
+            histogram.bins[i].count += bin.count;
+            for (int c = 0; c < 3; c++) {
+                histogram.bins[i].sum[c] += bin.sum[c];
+            }
+        }
+        histogram.transparent += part.transparent;
+        g_mutex_unlock(&mutex);
+    });
+    g_mutex_clear(&mutex);
+
+    std::vector<int> occupied;
+    for (int i = 0; i < bin_count; i++) {
+        if (histogram.bins[i].count) {
+            occupied.push_back(i);
+        }
+    }
+    image.has_transparent = histogram.transparent > 0;
+    int target = std::max(1, max_colors - (image.has_transparent ? 1 : 0));
+
+    // With no more distinct colours than the target they are the palette,
+    // sorted so pixels find theirs by binary search. Otherwise each bin gets
+    // a palette index; when every occupied bin fits, the bins are the
+    // palette.
+    bool exact = !histogram.exact_overflow && (int)histogram.exact.size() <= target;
+    std::vector<guchar> bin_index(bin_count, 0);
+    bool reduced = !exact && (int)occupied.size() > target;
+    if (exact) {
+        image.colors.assign(histogram.exact.begin(), histogram.exact.end());
+        std::sort(image.colors.begin(), image.colors.end());
+    } else if (!reduced) {
+        for (int bin : occupied) {
+            bin_index[bin] = (guchar)image.colors.size();
+            image.colors.push_back(mean_color(histogram.bins[bin].sum, histogram.bins[bin].count));
+        }
+    } else {
+        image.colors = cut_palette(histogram, occupied, target);
+        refine_palette(histogram, occupied, image.colors);
+
+        // Dithering can push a pixel into any bin, so match all of them
+        PaletteSearch search(image.colors);
+        run_rows(for_rows, bin_levels, [&](int begin, int end) {
+            for (int bin = begin * bin_levels * bin_levels; bin < end * bin_levels * bin_levels; bin++) {
+                int rgb[3];
+                bin_color(histogram, bin, rgb);
+                bin_index[bin] = (guchar)search.nearest(rgb[0], rgb[1], rgb[2]);
+            }
+        });
+    }
+    if (image.colors.empty()) {
+        image.colors.push_back(0);
+    }
+
+    // Offsets per position in the 8x8 tile, spread over about one
+    // palette step per channel
+    bool dithered = reduced && dither;
+    int offsets[64] = {0};
+    if (dithered) {
+        double spread = 255.0 / std::cbrt((double)image.colors.size());
+        for (int i = 0; i < 64; i++) {
+            offsets[i] = (int)std::lround((bayer_threshold(i % 8, i / 8) - 31.5) / 64.0 * spread);
+        }
+    }
+
+    guchar transparent = (guchar)image.transparent_index();
+    image.pixels.resize((size_t)image.width * image.height);
+    run_rows(for_rows, image.height, [&](int begin, int end) {
+        std::vector<guchar> rgba((size_t)width * 4);
+        guint32 last = G_MAXUINT32;
+        guchar last_index = 0;
+        for (int y = begin; y < end; y++) {
+            unpremultiply_row(surface_row(data, stride, y), rgba.data(), width, CHANNELS_RGBA);
+            guchar* out = &image.pixels[(size_t)y * width];
+            const guchar* p = rgba.data();
+            for (int x = 0; x < width; x++, p += 4) {
+                if (p[3] < opaque_threshold) {
+                    out[x] = transparent;
+                } else if (exact) {
+                    guint32 color = ((guint32)p[0] << 16) | ((guint32)p[1] << 8) | p[2];
+                    if (color != last) {
+                        last = color;
+                        last_index = (guchar)(std::lower_bound(image.colors.begin(), image.colors.end(), color) -
+                            image.colors.begin());
+                    }
+                    out[x] = last_index;
+                } else if (dithered) {
+                    int offset = offsets[(y & 7) * 8 + (x & 7)];
+                    out[x] = bin_index[bin_of(CLAMP(p[0] + offset, 0, 255), CLAMP(p[1] + offset, 0, 255),
+                        CLAMP(p[2] + offset, 0, 255))];
+                } else {
+                    out[x] = bin_index[bin_of(p[0], p[1], p[2])];
+                }
+            }
+        }
+    });
+    return image;
+}
@@ -0,0 +1,39 @@
+// Colour reduction for indexed formats such as XPM. Images with few enough
+// colours keep them exactly. Otherwise colours are binned to 5 bits per
+// channel, a palette is cut from the bins and refined with a few k-means
+// passes, and every bin is matched to its palette entry once, so mapping
+// the image costs a table lookup per pixel.
+#ifndef MATE_PAINT_COLOR_QUANTIZER_H
+#define MATE_PAINT_COLOR_QUANTIZER_H
+
+#include <cairo.h>
+#include <glib.h>
+#include <functional>
+#include <vector>
+
+// Runs body over row ranges that together cover [0, count), possibly on
+// several threads at once. Empty runs a single call on this thread.
+typedef std::function<void(int count, const std::function<void(int begin, int end)>& body)> RowRunner;
+
+// An image reduced to a palette. Pixels under half opacity use the entry
+// after the last colour when has_transparent is set.
+struct IndexedImage {
+    int width = 0;
+    int height = 0;
+    std::vector<guint32> colors;   // 0xRRGGBB
+    bool has_transparent = false;
+    std::vector<guchar> pixels;    // palette index per pixel, row by row
+
+    int transparent_index() const {
+        return (int)colors.size();
+    }
+};
+
+// Reduce surface to at most max_colors entries (2 to 256, the transparent
+// one included). Images with few enough colours keep them as they are;
+// dither adds an 8x8 ordered dither when colours had to be merged. Safe
+// on a worker thread.
+IndexedImage quantize_surface(cairo_surface_t* surface, int max_colors, bool dither,
+    const RowRunner& for_rows = RowRunner());
+
+#endif
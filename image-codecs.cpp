@@ -0,0 +1,625 @@
+#include "image-codecs.h"
+#include "canvas-document.h"
+#include "pixel-convert.h"
+#include "surface-pool.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// cairo image surfaces are limited to 32767 pixels in either direction
+const int max_image_size = 32767;
+
+void put_le16(guchar* p, guint32 value) {
+    p[0] = (guchar)value;
+    p[1] = (guchar)(value >> 8);
+}
+
+void put_le32(guchar* p, guint32 value) {
+    put_le16(p, value);
+    put_le16(p + 2, value >> 16);
+}
+
+void put_be32(guchar* p, guint32 value) {
+    p[0] = (guchar)(value >> 24);
+    p[1] = (guchar)(value >> 16);
+    p[2] = (guchar)(value >> 8);
+    p[3] = (guchar)value;
+}
+
+guint32 get_le16(const guchar* p) {
+    return p[0] | (p[1] << 8);
+}
+
+guint32 get_le32(const guchar* p) {
+    return get_le16(p) | (get_le16(p + 2) << 16);
+}
+
+guint32 get_be32(const guchar* p) {
+    return ((guint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+const guint32* surface_row(const unsigned char* data, int stride, int y) {
+    return reinterpret_cast<const guint32*>(data + (size_t)y * stride);
+}
+
+guint32* surface_row(unsigned char* data, int stride, int y) {
+    return reinterpret_cast<guint32*>(data + (size_t)y * stride);
+}
+
+// Surface for a decoder to overwrite, or null if the size is unusable
+cairo_surface_t* create_decode_surface(int width, int height) {
+    if (width <= 0 || height <= 0 || width > max_image_size || height > max_image_size) return nullptr;
+
+    cairo_surface_t* surface = create_pooled_surface_uninitialized(width, height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return nullptr;
+    }
+    cairo_surface_flush(surface);
+    return surface;
+}
+
+// QOI, "The Quite OK Image Format" (qoiformat.org): each pixel is coded
+// against the previous one and a 64-entry hash of recent colours
+const guchar qoi_op_index = 0x00;
+const guchar qoi_op_diff = 0x40;
+const guchar qoi_op_luma = 0x80;
+const guchar qoi_op_run = 0xc0;
+const guchar qoi_op_rgb = 0xfe;
+const guchar qoi_op_rgba = 0xff;
+const guchar qoi_op_mask = 0xc0;
+const int qoi_max_run = 62;
+const size_t qoi_header_size = 14;
+const guchar qoi_end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+struct QoiPixel {
+    guchar r;
+    guchar g;
+    guchar b;
+    guchar a;
+};
+
+inline bool same_pixel(const QoiPixel& p, const QoiPixel& q) {
+    return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+}
+
+inline int qoi_hash(const QoiPixel& p) {
+    return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+}
+
+// Difference of two channels, wrapped to [-128, 127]
+inline int wrap_difference(guchar a, guchar b) {
+    int difference = (a - b) & 0xFF;
+    return difference < 128 ? difference : difference - 256;
+}
+
+bool write_qoi(FILE* file, const unsigned char* data, int stride, int width, int height) {
+    guchar header[qoi_header_size];
+    std::memcpy(header, "qoif", 4);
+    put_be32(header + 4, width);
+    put_be32(header + 8, height);
+    header[12] = 4;   // RGBA
+    header[13] = 0;   // sRGB with linear alpha
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) return false;
+
+    std::vector<guchar> rgba((size_t)width * 4);
+    std::vector<guchar> out;
+    out.reserve((size_t)width * 5 + sizeof(qoi_end_marker));
+    QoiPixel index[64];
+    std::memset(index, 0, sizeof(index));
+    QoiPixel previous = {0, 0, 0, 255};
+    int run = 0;
+
+    for (int y = 0; y < height; y++) {
+        unpremultiply_row(surface_row(data, stride, y), rgba.data(), width, CHANNELS_RGBA);
+        out.clear();
+
+        for (int x = 0; x < width; x++) {
+            const guchar* p = &rgba[(size_t)x * 4];
+            QoiPixel pixel = {p[0], p[1], p[2], p[3]};
+            if (same_pixel(pixel, previous)) {
+                if (++run == qoi_max_run) {
+                    out.push_back(qoi_op_run | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out.push_back(qoi_op_run | (run - 1));
+                run = 0;
+            }
+
+            int hash = qoi_hash(pixel);
+            if (same_pixel(index[hash], pixel)) {
+                out.push_back(qoi_op_index | hash);
+            } else {
+                index[hash] = pixel;
+                if (pixel.a == previous.a) {
+                    int dr = wrap_difference(pixel.r, previous.r);
+                    int dg = wrap_difference(pixel.g, previous.g);
+                    int db = wrap_difference(pixel.b, previous.b);
+                    int dr_dg = dr - dg;
+                    int db_dg = db - dg;
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                        out.push_back(qoi_op_diff | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                    } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                        out.push_back(qoi_op_luma | (dg + 32));
+                        out.push_back(((dr_dg + 8) << 4) | (db_dg + 8));
+                    } else {
+                        guchar rgb[4] = {qoi_op_rgb, pixel.r, pixel.g, pixel.b};
+                        out.insert(out.end(), rgb, rgb + 4);
+                    }
+                } else {
+                    guchar rgba_op[5] = {qoi_op_rgba, pixel.r, pixel.g, pixel.b, pixel.a};
+                    out.insert(out.end(), rgba_op, rgba_op + 5);
+                }
+            }
+            previous = pixel;
+        }
+
+        if (y == height - 1) {
+            if (run > 0) {
+                out.push_back(qoi_op_run | (run - 1));
+            }
+            out.insert(out.end(), qoi_end_marker, qoi_end_marker + sizeof(qoi_end_marker));
+        }
+        if (fwrite(out.data(), 1, out.size(), file) != out.size()) return false;
+    }
+    return true;
+}
+
+cairo_surface_t* read_qoi(const guchar* data, size_t length) {
+    if (length < qoi_header_size + sizeof(qoi_end_marker) || std::memcmp(data, "qoif", 4) != 0) return nullptr;
+
+    guint32 width = get_be32(data + 4);
+    guint32 height = get_be32(data + 8);
+    int channels = data[12];
+    if ((channels != 3 && channels != 4) || width > (guint32)max_image_size || height > (guint32)max_image_size) {
+        return nullptr;
+    }
+    cairo_surface_t* surface = create_decode_surface(width, height);
+    if (!surface) return nullptr;
+
+    unsigned char* pixels = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    std::vector<guchar> rgba((size_t)width * 4);
+    QoiPixel index[64];
+    std::memset(index, 0, sizeof(index));
+    QoiPixel pixel = {0, 0, 0, 255};
+    int run = 0;
+
+    // The end marker is padding, so an op read just before it never
+    // reaches past the buffer. A truncated file repeats its last pixel.
+    size_t pos = qoi_header_size;
+    size_t chunks_end = length - sizeof(qoi_end_marker);
+    for (guint32 y = 0; y < height; y++) {
+        for (guint32 x = 0; x < width; x++) {
+            if (run > 0) {
+                run--;
+            } else if (pos < chunks_end) {
+                guchar op = data[pos++];
+                if (op == qoi_op_rgb) {
+                    pixel.r = data[pos];
+                    pixel.g = data[pos + 1];
+                    pixel.b = data[pos + 2];
+                    pos += 3;
+                } else if (op == qoi_op_rgba) {
+                    pixel.r = data[pos];
+                    pixel.g = data[pos + 1];
+                    pixel.b = data[pos + 2];
+                    pixel.a = data[pos + 3];
+                    pos += 4;
+                } else if ((op & qoi_op_mask) == qoi_op_index) {
+                    pixel = index[op];
+                } else if ((op & qoi_op_mask) == qoi_op_diff) {
+                    pixel.r += ((op >> 4) & 0x03) - 2;
+                    pixel.g += ((op >> 2) & 0x03) - 2;
+                    pixel.b += (op & 0x03) - 2;
+                } else if ((op & qoi_op_mask) == qoi_op_luma) {
+                    guchar next = data[pos++];
+                    int dg = (op & 0x3f) - 32;
+                    pixel.r += dg - 8 + ((next >> 4) & 0x0f);
+                    pixel.g += dg;
+                    pixel.b += dg - 8 + (next & 0x0f);
+                } else {
+                    run = op & 0x3f;
+                }
+                index[qoi_hash(pixel)] = pixel;
+            }
+
+            guchar* p = &rgba[(size_t)x * 4];
+            p[0] = pixel.r;
+            p[1] = pixel.g;
+            p[2] = pixel.b;
+            p[3] = channels == 4 ? pixel.a : 255;
+        }
+        premultiply_row(rgba.data(), surface_row(pixels, stride, y), width, 4, CHANNELS_RGBA);
+    }
+
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+// BMP: a BITMAPV4HEADER with bit masks, so readers know the fourth byte
+// is alpha. Rows are stored top-down.
+const size_t bmp_file_header_size = 14;
+const size_t bmp_v4_header_size = 108;
+const guint32 bmp_compression_rgb = 0;
+const guint32 bmp_compression_bitfields = 3;
+const guint32 bmp_pixels_per_meter = 2835;   // 72 dpi
+const guint32 bmp_color_space_srgb = 0x73524742;   // 'sRGB'
+
+bool write_bmp(FILE* file, const unsigned char* data, int stride, int width, int height) {
+    guint32 image_size = (guint32)width * height * 4;
+    guchar header[bmp_file_header_size + bmp_v4_header_size];
+    std::memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    put_le32(header + 2, sizeof(header) + image_size);
+    put_le32(header + 10, sizeof(header));
+
+    guchar* info = header + bmp_file_header_size;
+    put_le32(info, bmp_v4_header_size);
+    put_le32(info + 4, width);
+    put_le32(info + 8, (guint32)-height);
+    put_le16(info + 12, 1);
+    put_le16(info + 14, 32);
+    put_le32(info + 16, bmp_compression_bitfields);
+    put_le32(info + 20, image_size);
+    put_le32(info + 24, bmp_pixels_per_meter);
+    put_le32(info + 28, bmp_pixels_per_meter);
+    put_le32(info + 40, 0x00FF0000);
+    put_le32(info + 44, 0x0000FF00);
+    put_le32(info + 48, 0x000000FF);
+    put_le32(info + 52, 0xFF000000);
+    put_le32(info + 56, bmp_color_space_srgb);
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) return false;
+
+    std::vector<guchar> bgra((size_t)width * 4);
+    for (int y = 0; y < height; y++) {
+        unpremultiply_row(surface_row(data, stride, y), bgra.data(), width, CHANNELS_BGRA);
+        if (fwrite(bgra.data(), 1, bgra.size(), file) != bgra.size()) return false;
+    }
+    return true;
+}
+
+// Uncompressed 24-bit, and 32-bit with or without an alpha mask. Palette
+// and RLE images return null and are left to gdk-pixbuf.
+cairo_surface_t* read_bmp(const guchar* data, size_t length) {
+    const size_t masks_offset = bmp_file_header_size + 40;
+    if (length < masks_offset || data[0] != 'B' || data[1] != 'M') return nullptr;
+
+    size_t pixels_offset = get_le32(data + 10);
+    size_t info_size = get_le32(data + 14);
+    gint32 width = (gint32)get_le32(data + 18);
+    gint32 height = (gint32)get_le32(data + 22);
+    int bits = get_le16(data + 28);
+    guint32 compression = get_le32(data + 30);
+    if (info_size < 40 || width <= 0 || height == 0 || height < -max_image_size) return nullptr;
+
+    bool top_down = height < 0;
+    height = std::abs(height);
+    bool has_alpha = false;
+    if (compression == bmp_compression_rgb) {
+        if (bits != 24 && bits != 32) return nullptr;
+    } else if (compression == bmp_compression_bitfields && bits == 32) {
+        // The masks follow a 40-byte header and sit at the same place
+        // inside the larger ones
+        if (length < masks_offset + 12) return nullptr;
+        if (get_le32(data + masks_offset) != 0x00FF0000 || get_le32(data + masks_offset + 4) != 0x0000FF00 ||
+            get_le32(data + masks_offset + 8) != 0x000000FF) {
+            return nullptr;
+        }
+        if (info_size >= 56 && length >= masks_offset + 16) {
+            guint32 alpha_mask = get_le32(data + masks_offset + 12);
+            if (alpha_mask != 0 && alpha_mask != 0xFF000000) return nullptr;
+            has_alpha = alpha_mask != 0;
+        }
+    } else {
+        return nullptr;
+    }
+
+    size_t row_bytes = ((size_t)width * (bits / 8) + 3) & ~(size_t)3;
+    if (pixels_offset > length || row_bytes * height > length - pixels_offset) return nullptr;
+
+    cairo_surface_t* surface = create_decode_surface(width, height);
+    if (!surface) return nullptr;
+
+    unsigned char* pixels = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    for (int y = 0; y < height; y++) {
+        const guchar* src = data + pixels_offset + row_bytes * (top_down ? y : height - 1 - y);
+        guint32* dst = surface_row(pixels, stride, y);
+        if (bits == 24) {
+            premultiply_row(src, dst, width, 3, CHANNELS_BGRA);
+        } else if (has_alpha) {
+            premultiply_row(src, dst, width, 4, CHANNELS_BGRA);
+        } else {
+            for (int x = 0; x < width; x++) {
+                dst[x] = get_le32(src + (size_t)x * 4) | 0xFF000000;
+            }
+        }
+    }
+
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+// Netpbm: PAM (P7) keeps alpha, PPM (P6) holds RGB only
+bool write_pam(FILE* file, const unsigned char* data, int stride, int width, int height) {
+    if (fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+            width, height) < 0) {
+        return false;
+    }
+
+    std::vector<guchar> rgba((size_t)width * 4);
+    for (int y = 0; y < height; y++) {
+        unpremultiply_row(surface_row(data, stride, y), rgba.data(), width, CHANNELS_RGBA);
+        if (fwrite(rgba.data(), 1, rgba.size(), file) != rgba.size()) return false;
+    }
+    return true;
+}
+
+bool write_ppm(FILE* file, const unsigned char* data, int stride, int width, int height) {
+    if (fprintf(file, "P6\n%d %d\n255\n", width, height) < 0) return false;
+
+    std::vector<guchar> rgb((size_t)width * 3);
+    for (int y = 0; y < height; y++) {
+        pack_rgb_row(surface_row(data, stride, y), rgb.data(), width);
+        if (fwrite(rgb.data(), 1, rgb.size(), file) != rgb.size()) return false;
+    }
+    return true;
+}
+
+// Pixel codes: one printable character each, or two for larger palettes.
+// Quote and backslash would need escaping in the C string.
+std::string xpm_symbols() {
+    std::string symbols;
+    for (char c = ' '; c <= '~'; c++) {
+        if (c != '"' && c != '\\') {
+            symbols += c;
+        }
+    }
+    return symbols;
+}
+
+bool write_xpm(FILE* file, const IndexedImage& image) {
+    const std::string symbols = xpm_symbols();
+    int entries = (int)image.colors.size() + (image.has_transparent ? 1 : 0);
+    int chars_per_pixel = entries <= (int)symbols.size() ? 1 : 2;
+    std::vector<std::string> codes(entries);
+    for (int i = 0; i < entries; i++) {
+        codes[i] = chars_per_pixel == 1 ? std::string(1, symbols[i]) :
+            std::string(1, symbols[i / symbols.size()]) + symbols[i % symbols.size()];
+    }
+
+    if (fprintf(file, "/* XPM */\nstatic char * image_xpm[] = {\n\"%d %d %d %d\",\n",
+            image.width, image.height, entries, chars_per_pixel) < 0) {
+        return false;
+    }
+    for (size_t i = 0; i < image.colors.size(); i++) {
+        if (fprintf(file, "\"%s c #%06X\",\n", codes[i].c_str(), image.colors[i]) < 0) return false;
+    }
+    if (image.has_transparent &&
+        fprintf(file, "\"%s c None\",\n", codes[image.transparent_index()].c_str()) < 0) {
+        return false;
+    }
+
+    std::string row;
+    row.reserve((size_t)image.width * chars_per_pixel + 8);
+    for (int y = 0; y < image.height; y++) {
+        const guchar* indices = &image.pixels[(size_t)y * image.width];
+        row = "\"";
+        for (int x = 0; x < image.width; x++) {
+            row += codes[indices[x]];
+        }
+        row += y == image.height - 1 ? "\"\n};\n" : "\",\n";
+        if (fwrite(row.data(), 1, row.size(), file) != row.size()) return false;
+    }
+    return true;
+}
+
+struct PnmHeader {
+    int width = 0;
+    int height = 0;
+    int depth = 0;
+    int maxval = 0;
+    size_t data_offset = 0;
+};
+
+// Next whitespace-separated header token, skipping # comments. pos is
+// left on the character after it.
+bool next_pnm_token(const guchar* data, size_t length, size_t& pos, std::string& token) {
+    while (pos < length) {
+        if (data[pos] == '#') {
+            while (pos < length && data[pos] != '\n') {
+                pos++;
+            }
+        } else if (g_ascii_isspace(data[pos])) {
+            pos++;
+        } else {
+            break;
+        }
+    }
+
+    size_t start = pos;
+    while (pos < length && !g_ascii_isspace(data[pos]) && data[pos] != '#') {
+        pos++;
+    }
+    token.assign(reinterpret_cast<const char*>(data) + start, pos - start);
+    return !token.empty();
+}
+
+bool parse_pnm_number(const std::string& token, int& value) {
+    char* end = nullptr;
+    long parsed = std::strtol(token.c_str(), &end, 10);
+    if (token.empty() || *end != '\0' || parsed <= 0 || parsed > max_image_size) return false;
+    value = (int)parsed;
+    return true;
+}
+
+bool parse_pnm_header(const guchar* data, size_t length, PnmHeader& header) {
+    size_t pos = 2;
+    std::string token;
+
+    if (data[1] == '7') {
+        while (next_pnm_token(data, length, pos, token) && token != "ENDHDR") {
+            std::string value;
+            if (token == "TUPLTYPE") {
+                // Only informative once DEPTH is known
+                while (pos < length && data[pos] != '\n') {
+                    pos++;
+                }
+                continue;
+            }
+            if (!next_pnm_token(data, length, pos, value)) return false;
+
+            if (token == "WIDTH") {
+                if (!parse_pnm_number(value, header.width)) return false;
+            } else if (token == "HEIGHT") {
+                if (!parse_pnm_number(value, header.height)) return false;
+            } else if (token == "DEPTH") {
+                if (!parse_pnm_number(value, header.depth)) return false;
+            } else if (token == "MAXVAL") {
+                if (!parse_pnm_number(value, header.maxval)) return false;
+            } else {
+                return false;
+            }
+        }
+        if (token != "ENDHDR" || pos >= length || data[pos] != '\n') return false;
+    } else {
+        header.depth = data[1] == '5' ? 1 : 3;
+        if (!next_pnm_token(data, length, pos, token) || !parse_pnm_number(token, header.width) ||
+            !next_pnm_token(data, length, pos, token) || !parse_pnm_number(token, header.height) ||
+            !next_pnm_token(data, length, pos, token) || !parse_pnm_number(token, header.maxval) ||
+            pos >= length || !g_ascii_isspace(data[pos])) {
+            return false;
+        }
+    }
+
+    header.data_offset = pos + 1;
+    return header.width > 0 && header.height > 0 && header.depth >= 1 && header.depth <= 4;
+}
+
+// 8-bit greyscale, RGB and their alpha variants. 16-bit files return null
+// and are left to gdk-pixbuf.
+cairo_surface_t* read_pnm(const guchar* data, size_t length) {
+    PnmHeader header;
+    if (!parse_pnm_header(data, length, header) || header.maxval != 255) return nullptr;
+
+    size_t row_bytes = (size_t)header.width * header.depth;
+    if (header.data_offset > length || row_bytes * header.height > length - header.data_offset) return nullptr;
+
+    cairo_surface_t* surface = create_decode_surface(header.width, header.height);
+    if (!surface) return nullptr;
+
+    unsigned char* pixels = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    std::vector<guchar> rgba;
+    if (header.depth < 3) {
+        rgba.resize((size_t)header.width * 4);
+    }
+
+    for (int y = 0; y < header.height; y++) {
+        const guchar* src = data + header.data_offset + row_bytes * y;
+        guint32* dst = surface_row(pixels, stride, y);
+        if (header.depth >= 3) {
+            premultiply_row(src, dst, header.width, header.depth, CHANNELS_RGBA);
+            continue;
+        }
+
+        for (int x = 0; x < header.width; x++) {
+            const guchar* gray = src + (size_t)x * header.depth;
+            guchar* p = &rgba[(size_t)x * 4];
+            p[0] = p[1] = p[2] = gray[0];
+            p[3] = header.depth == 2 ? gray[1] : 255;
+        }
+        premultiply_row(rgba.data(), dst, header.width, 4, CHANNELS_RGBA);
+    }
+
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+}
+
+bool is_builtin_image_format(const std::string& extension) {
+    return extension == "qoi" || extension == "bmp" || extension == "pam" ||
+        extension == "pnm" || extension == "ppm";
+}
+
+bool save_builtin_image(cairo_surface_t* surface, const std::string& filename) {
+    std::string extension = get_file_extension_lowercase(filename);
+    if (!surface || !is_builtin_image_format(extension) ||
+        cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) {
+        return false;
+    }
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) return false;
+
+    cairo_surface_flush(surface);
+    const unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+
+    bool ok;
+    if (extension == "qoi") {
+        ok = write_qoi(file, data, stride, width, height);
+    } else if (extension == "bmp") {
+        ok = write_bmp(file, data, stride, width, height);
+    } else if (extension == "pam") {
+        ok = write_pam(file, data, stride, width, height);
+    } else {
+        ok = write_ppm(file, data, stride, width, height);
+    }
+
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        g_remove(filename.c_str());
+    }
+    return ok;
+}
+
+bool save_xpm_image(cairo_surface_t* surface, const std::string& filename, const RowRunner& for_rows) {
+    if (!surface || cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) return false;
+
+    IndexedImage image = quantize_surface(surface, xpm_max_colors, true, for_rows);
+    if (image.pixels.empty()) return false;
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) return false;
+
+    bool ok = write_xpm(file, image);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        g_remove(filename.c_str());
+    }
+    return ok;
+}
+
+cairo_surface_t* load_builtin_image(const std::string& filename) {
+    GMappedFile* mapped = g_mapped_file_new(filename.c_str(), FALSE, NULL);
+    if (!mapped) return nullptr;
+
+    const guchar* data = reinterpret_cast<const guchar*>(g_mapped_file_get_contents(mapped));
+    size_t length = g_mapped_file_get_length(mapped);
+    cairo_surface_t* surface = nullptr;
+    if (length >= 4 && std::memcmp(data, "qoif", 4) == 0) {
+        surface = read_qoi(data, length);
+    } else if (length >= 2 && data[0] == 'B' && data[1] == 'M') {
+        surface = read_bmp(data, length);
+    } else if (length >= 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6' || data[1] == '7')) {
+        surface = read_pnm(data, length);
+    }
+
+    g_mapped_file_unref(mapped);
+    return surface;
+}
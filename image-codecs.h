@@ -0,0 +1,33 @@
+// Built-in lossless formats written straight from the ARGB32 buffer: QOI,
+// BMP and PAM/PNM. None of them has a deflate pass, so they save much
+// faster than PNG when a quick dump for other tools is all that is needed.
+// XPM is written here too, through the colour quantizer.
+#ifndef MATE_PAINT_IMAGE_CODECS_H
+#define MATE_PAINT_IMAGE_CODECS_H
+
+#include <cairo.h>
+#include <string>
+
+#include "color-quantizer.h"
+
+// qoi, bmp, pam, pnm or ppm, lower case
+bool is_builtin_image_format(const std::string& extension);
+
+// Write surface in the format named by the file extension: QOI, 32-bit
+// BMP and PAM keep alpha; PNM/PPM are flattened onto black. Safe on a
+// worker thread.
+bool save_builtin_image(cairo_surface_t* surface, const std::string& filename);
+
+// XPM has to list every colour, so the image is quantized to at most 256
+// first, with pixels under half opacity written as "None". for_rows may
+// spread the quantizer's passes across threads. Safe on a worker thread.
+const int xpm_max_colors = 256;
+bool save_xpm_image(cairo_surface_t* surface, const std::string& filename,
+    const RowRunner& for_rows = RowRunner());
+
+// Decode a QOI, uncompressed 24/32-bit BMP or 8-bit PAM/PGM/PPM file,
+// recognised by its contents. Returns null for anything else, including
+// the BMP and PNM variants left to gdk-pixbuf. Safe on a worker thread.
+cairo_surface_t* load_builtin_image(const std::string& filename);
+
+#endif
@@ -1,4 +1,5 @@
 #include <gtk/gtk.h>
+#include <pango/pangocairo.h>
 #include <cairo.h>
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
@@ -10,8 +11,20 @@
 #include <iterator>
 #include <string>
 #include <cctype>
-#include <queue>
 #include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+#include <functional>
+#include <map>
+#include <unordered_map>
+
+#include "autosave-journal.h"
+#include "canvas-document.h"
+#include "pixel-convert.h"
+#include "shape-raster.h"
+#include "surface-pool.h"
 
 const double line_thickness_options[] = {1.0, 2.0, 4.0, 6.0, 8.0};
 const double zoom_options[] = {1.0, 2.0, 4.0, 6.0, 8.0};
@@ -39,15 +52,18 @@ enum Tool {
 // Forward declarations
 void update_color_indicators();
 void save_image_dialog(GtkWidget* parent);
-void open_image_dialog(GtkWidget* parent);
+void open_image_dialog(GtkWidget* parent, bool as_preview);
+void start_save_job(const std::string& filename);
+bool confirm_close();
+void reset_autosave_journal();
+void on_tool_clicked(GtkButton* button, gpointer data);
 void clear_selection();
 void copy_selection();
 void cut_selection();
 void paste_selection();
 void copy_surface_to_system_clipboard(cairo_surface_t* surface);
-cairo_surface_t* get_surface_from_system_clipboard(int& width, int& height);
 bool should_expand_canvas_for_paste(int pasted_width, int pasted_height);
-void resize_canvas_for_paste(int new_width, int new_height);
+bool start_canvas_resize_job(int new_width, int new_height, bool reset_overlays, std::function<void()> then);
 void commit_floating_selection(bool record_undo = true);
 void finalize_text();
 void cancel_text();
@@ -64,24 +80,81 @@ void undo_last_operation();
 void redo_last_operation();
 void draw_canvas_grid_background(cairo_t* cr, double width, double height);
 bool is_transparent_color(const GdkRGBA& color);
-bool save_surface_to_file(cairo_surface_t* surface, const std::string& filename);
 void load_custom_palette_colors();
 void save_custom_palette_colors();
+gboolean ant_path_timer(gpointer data);
+void invalidate_canvas_area(double x, double y, double width, double height);
+void invalidate_canvas();
+void queue_overlay_redraw();
+
+// Geometry the cached marching-ants outline was built from
+struct SelectionOutlineKey {
+    bool is_rect = false;
+    double x1 = 0;
+    double y1 = 0;
+    double x2 = 0;
+    double y2 = 0;
+    size_t point_count = 0;
+    guint64 points_hash = 0;   // over every lasso point
+};
 
-struct UndoSnapshot {
-    cairo_surface_t* surface = nullptr;
+// Aliased coverage mask for one glyph, offset from the glyph origin.
+// Blank glyphs such as spaces have no mask.
+struct GlyphMask {
+    cairo_surface_t* mask = nullptr;
+    int x = 0;
+    int y = 0;
+};
+
+// Masks for one PangoFont, which pins the family and size
+struct GlyphFontCache {
+    cairo_scaled_font_t* scaled_font = nullptr;
+    std::unordered_map<PangoGlyph, GlyphMask> glyphs;
+};
+
+// What the cached text preview was rasterized from
+struct TextPreviewKey {
+    guint layout_serial = 0;
+    guint32 color = 0;
+    double x = 0;
+    double y = 0;
     int width = 0;
     int height = 0;
 };
 
+// Canvas-space rectangle covered by an overlay
+struct OverlayBounds {
+    bool empty = true;
+    double x1 = 0;
+    double y1 = 0;
+    double x2 = 0;
+    double y2 = 0;
+};
+
+struct CanvasJob;
+
+// Most recent timings, kept as a ring buffer
+struct PerfSamples {
+    std::vector<double> values;
+    size_t next = 0;
+};
+
+// Measurements shown by the performance HUD
+struct PerfStats {
+    PerfSamples frame_ms;
+    PerfSamples input_latency_ms;
+    double composite_ms = 0;
+    gint64 pending_input_time = 0;
+    std::string last_job_title;
+    double last_job_ms = 0;
+};
+
 // Application state
 struct AppState {
     Tool current_tool = TOOL_PENCIL;
     GdkRGBA fg_color = {0.0, 0.5, 0.0, 1.0}; // Green
     GdkRGBA bg_color = {1.0, 1.0, 1.0, 1.0}; // White
-    cairo_surface_t* surface = nullptr;
-    int canvas_width = 800;
-    int canvas_height = 600;
+    Document document;
     double last_x = 0;
     double last_y = 0;
     bool is_drawing = false;
@@ -139,6 +212,14 @@ struct AppState {
     std::string text_content;
     std::string text_font_family = "Sans";
     int text_font_size = 14;
+    PangoLayout* text_layout = nullptr;
+    // Glyph masks keyed by font (a ref is held on each), shared by the
+    // preview and the commit
+    std::map<PangoFont*, GlyphFontCache> glyph_cache;
+    size_t glyph_cache_count = 0;
+    size_t glyph_cache_bytes = 0;   // mask pixels held
+    cairo_surface_t* text_preview_surface = nullptr;
+    TextPreviewKey text_preview_key;
     GtkWidget* text_window = nullptr;
     GtkWidget* text_entry = nullptr;
     
@@ -146,11 +227,44 @@ struct AppState {
     cairo_surface_t* clipboard_surface = nullptr;
     int clipboard_width = 0;
     int clipboard_height = 0;
+    // Incremented per paste so stale clipboard replies are dropped
+    guint paste_request_id = 0;
+    // True while the system clipboard holds our copy of clipboard_surface
+    bool clipboard_owned = false;
+    // --replay: nothing may reach files, settings or the system clipboard,
+    // so copy and paste stay within clipboard_surface and saving is off
+    bool replaying = false;
     
     // Ant path animation
     double ant_offset = 0;
     guint ant_timer_id = 0;
-    
+    bool ant_animation_requested = false;
+    bool window_iconified = false;
+    cairo_path_t* selection_outline_path = nullptr;
+    SelectionOutlineKey selection_outline_key;
+
+    // Zoomed checkerboard + canvas composite reused between frames, and the
+    // device-space area of it that is out of date
+    cairo_surface_t* composite_cache = nullptr;
+    cairo_region_t* composite_dirty = nullptr;
+    // Canvas-space area covered by overlays in the last queued frame
+    OverlayBounds last_overlay_bounds;
+
+    // Worker pool shared by background jobs and parallel pixel kernels
+    GThreadPool* job_pool = nullptr;
+    CanvasJob* active_job = nullptr;
+    guint job_progress_timer_id = 0;
+    // Made insensitive while a job that leaves the canvas viewable runs
+    GtkWidget* menubar = nullptr;
+    GtkWidget* tool_column = nullptr;
+    GtkWidget* palette_grid = nullptr;
+
+    // Performance HUD
+    bool perf_hud_visible = false;
+    guint perf_hud_timer_id = 0;
+    GdkRectangle perf_hud_area = {0, 0, 0, 0};
+    PerfStats perf;
+
     // UI elements
     GtkWidget* fg_button = nullptr;
     GtkWidget* bg_button = nullptr;
@@ -167,20 +281,174 @@ struct AppState {
     GtkWidget* scrolled_window = nullptr;
     GtkWidget* canvas_dimensions_label = nullptr;
     GtkWidget* cursor_position_label = nullptr;
+    GtkWidget* job_box = nullptr;
+    GtkWidget* job_label = nullptr;
+    GtkWidget* job_progress_bar = nullptr;
+    GtkWidget* job_cancel_button = nullptr;
     std::vector<GdkRGBA> palette_button_colors;
     std::vector<bool> custom_palette_slots;
     std::vector<GtkWidget*> palette_buttons;
 
     std::string current_filename;
+    // Content hash of the canvas when it was last opened, created or
+    // written to saved_filename; a different hash means unsaved changes
+    guint64 saved_hash = 0;
+    std::string saved_filename;
+    bool quit_after_save = false;
+    // Closing was asked for while a job ran; ask again once it finishes
+    bool close_after_job = false;
+    // Open as Preview: the canvas is a scaled-down decode of preview.path.
+    // Save replays its whole-image steps on the full-size file as long as
+    // the document revision still matches preview_revision.
+    bool preview_open = false;
+    PreviewRecipe preview;
+    unsigned preview_revision = 0;
+
+    // Crash recovery journal for this process, written on the worker pool
+    std::string autosave_path;
+    guint autosave_timer_id = 0;
+    bool autosave_writing = false;
+    bool autosave_needs_full = false;
+    // A new journal with a full frame is being written beside the old one
+    bool autosave_rebuilding = false;
+    // Start a new journal at the next change; reset after a write finishes
+    bool autosave_restart = false;
+    bool autosave_reset_pending = false;
+    // The write in flight completes a full frame
+    bool autosave_frame_pending = false;
+    // Journal the canvas was recovered from; it stays until this session's
+    // own journal holds a full frame, so a second crash loses nothing
+    std::string autosave_recovered_path;
+    gint64 autosave_journal_bytes = 0;
+    gint64 autosave_pending_bytes = 0;
 
-    std::vector<UndoSnapshot> undo_stack;
-    std::vector<UndoSnapshot> redo_stack;
-    static constexpr size_t max_undo_steps = 50;
     bool drag_undo_snapshot_taken = false;
 };
 
 AppState app_state;
 
+// Span tracing, enabled by pointing MATE_PAINT_TRACE at an output file.
+// The trace is written in Chrome trace event format at exit or on
+// Ctrl+Shift+T, and can be loaded in chrome://tracing or Perfetto.
+
+struct TraceEvent {
+    const char* name;   // must be a string literal
+    gint64 start_us;
+    gint64 duration_us;
+};
+
+// Spans recorded by one thread; only that thread writes to it, without
+// locks. An event is written first and then published by bumping count.
+struct TraceBuffer {
+    static const int capacity = 16384;
+    TraceEvent events[capacity];
+    gint count = 0;
+    int thread_id = 0;
+};
+
+bool trace_enabled = false;
+std::string trace_path;
+// Entry to main(), where the startup span begins
+gint64 trace_main_start_us = 0;
+bool trace_startup_recorded = false;
+GMutex trace_buffers_mutex;
+std::vector<TraceBuffer*> trace_buffers;
+thread_local TraceBuffer* trace_thread_buffer = nullptr;
+
+TraceBuffer* get_trace_buffer() {
+    if (!trace_thread_buffer) {
+        trace_thread_buffer = new TraceBuffer();
+        g_mutex_lock(&trace_buffers_mutex);
+        trace_thread_buffer->thread_id = (int)trace_buffers.size() + 1;
+        trace_buffers.push_back(trace_thread_buffer);
+        g_mutex_unlock(&trace_buffers_mutex);
+    }
+    return trace_thread_buffer;
+}
+
+// Records the lifetime of the enclosing scope as a trace span
+struct TraceSpan {
+    const char* name;
+    gint64 start_us;
+
+    explicit TraceSpan(const char* span_name) : name(span_name), start_us(trace_enabled ? g_get_monotonic_time() : 0) {}
+
+    ~TraceSpan() {
+        if (!start_us) return;
+        record_trace_event(name, start_us, g_get_monotonic_time());
+    }
+
+    static void record_trace_event(const char* event_name, gint64 start, gint64 end) {
+        TraceBuffer* buffer = get_trace_buffer();
+        int index = g_atomic_int_get(&buffer->count);
+        TraceEvent& event = buffer->events[index % TraceBuffer::capacity];
+        event.name = event_name;
+        event.start_us = start;
+        event.duration_us = end - start;
+        g_atomic_int_set(&buffer->count, index + 1);
+    }
+};
+
+// Cold startup: from entering main(), before GTK is initialized, to the
+// end of the first canvas frame. Recorded once.
+void trace_first_frame() {
+    if (!trace_enabled || trace_startup_recorded) return;
+    trace_startup_recorded = true;
+    TraceSpan::record_trace_event("startup_to_first_frame", trace_main_start_us, g_get_monotonic_time());
+}
+
+void init_tracing() {
+    const char* path = g_getenv("MATE_PAINT_TRACE");
+    if (!path || !*path) return;
+
+    trace_path = path;
+    trace_enabled = true;
+}
+
+// Write every buffered span; ring buffers keep only the newest events
+void write_trace_file() {
+    if (!trace_enabled) return;
+
+    FILE* file = g_fopen(trace_path.c_str(), "w");
+    if (!file) {
+        g_warning("Could not write trace file %s", trace_path.c_str());
+        return;
+    }
+
+    // Pool workers keep recording while the rings are copied. Once count
+    // has moved on to after, the slots of events up to after - capacity
+    // may have been overwritten (the one being written is not published
+    // yet), so those copies are dropped.
+    std::vector<std::pair<int, TraceEvent>> events;
+    g_mutex_lock(&trace_buffers_mutex);
+    for (TraceBuffer* buffer : trace_buffers) {
+        int before = g_atomic_int_get(&buffer->count);
+        int begin = std::max(0, before - TraceBuffer::capacity);
+        std::vector<TraceEvent> copied;
+        for (int i = begin; i < before; i++) {
+            copied.push_back(buffer->events[i % TraceBuffer::capacity]);
+        }
+        int after = g_atomic_int_get(&buffer->count);
+        int first_intact = std::max(begin, after - TraceBuffer::capacity + 1);
+        for (int i = first_intact; i < before; i++) {
+            events.push_back(std::make_pair(buffer->thread_id, copied[i - begin]));
+        }
+    }
+    g_mutex_unlock(&trace_buffers_mutex);
+
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (const std::pair<int, TraceEvent>& entry : events) {
+        const TraceEvent& event = entry.second;
+        std::fprintf(file,
+            "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":%d}",
+            first ? "" : ",\n", event.name, event.start_us, event.duration_us, entry.first);
+        first = false;
+    }
+    std::fprintf(file, "\n]}\n");
+    std::fclose(file);
+}
+
 // Color palette
 const GdkRGBA palette_colors[] = {
     {0.0, 0.0, 0.0, 0.0},   // Transparency
@@ -341,7 +609,9 @@ void update_canvas_dimensions_label() {
         return;
     }
 
-    gchar* dimensions_text = g_strdup_printf("%dx%d", app_state.canvas_width, app_state.canvas_height);
+    gchar* dimensions_text = app_state.preview_open ?
+        g_strdup_printf(_("%dx%d (preview)"), app_state.document.width, app_state.document.height) :
+        g_strdup_printf("%dx%d", app_state.document.width, app_state.document.height);
     gtk_label_set_text(GTK_LABEL(app_state.canvas_dimensions_label), dimensions_text);
     g_free(dimensions_text);
 }
@@ -356,8 +626,8 @@ void update_cursor_position_label(double canvas_x, double canvas_y, bool cursor_
         return;
     }
 
-    int x = static_cast<int>(std::lround(clamp_double(canvas_x, 0.0, app_state.canvas_width * 1.0)));
-    int y = static_cast<int>(std::lround(clamp_double(canvas_y, 0.0, app_state.canvas_height * 1.0)));
+    int x = static_cast<int>(std::lround(clamp_double(canvas_x, 0.0, app_state.document.width * 1.0)));
+    int y = static_cast<int>(std::lround(clamp_double(canvas_y, 0.0, app_state.document.height * 1.0)));
 
     gchar* position_text = g_strdup_printf("%dx%d", x, y);
     gtk_label_set_text(GTK_LABEL(app_state.cursor_position_label), position_text);
@@ -376,8 +646,8 @@ void apply_zoom(double zoom_factor, double focus_x, double focus_y) {
     app_state.zoom_factor = zoom_factor;
     gtk_widget_set_size_request(
         app_state.drawing_area,
-        static_cast<int>(app_state.canvas_width * app_state.zoom_factor),
-        static_cast<int>(app_state.canvas_height * app_state.zoom_factor)
+        static_cast<int>(app_state.document.width * app_state.zoom_factor),
+        static_cast<int>(app_state.document.height * app_state.zoom_factor)
     );
 
     if (app_state.scrolled_window) {
@@ -402,7 +672,7 @@ void apply_zoom(double zoom_factor, double focus_x, double focus_y) {
         gtk_adjustment_set_value(vadj, target_v);
     }
 
-    gtk_widget_queue_draw(app_state.drawing_area);
+    invalidate_canvas();
 }
 
 void reset_zoom_to_default() {
@@ -410,7 +680,7 @@ void reset_zoom_to_default() {
         return;
     }
 
-    apply_zoom(1.0, app_state.canvas_width / 2.0, app_state.canvas_height / 2.0);
+    apply_zoom(1.0, app_state.document.width / 2.0, app_state.document.height / 2.0);
 
     if (app_state.scrolled_window) {
         GtkAdjustment* hadj = gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(app_state.scrolled_window));
@@ -461,104 +731,261 @@ bool point_in_text_box(double x, double y) {
            y >= app_state.text_y && y <= app_state.text_y + app_state.text_box_height;
 }
 
+// Text tool layout, shared by box sizing, the preview and the commit.
+// Pango keeps the line breaks and shaped glyph runs between calls and only
+// redoes them when the text, font or wrap width actually changes.
+const double text_padding = 5.0;
+const double text_wrap_padding = 10.0;
+
+PangoLayout* get_text_layout() {
+    if (!app_state.text_layout) {
+        PangoContext* context = pango_font_map_create_context(pango_cairo_font_map_get_default());
+        app_state.text_layout = pango_layout_new(context);
+        g_object_unref(context);
+        pango_layout_set_wrap(app_state.text_layout, PANGO_WRAP_WORD_CHAR);
+    }
+
+    PangoLayout* layout = app_state.text_layout;
+
+    // Font size is in canvas pixels, as with cairo_set_font_size()
+    PangoFontDescription* desc = pango_font_description_new();
+    pango_font_description_set_family(desc, app_state.text_font_family.c_str());
+    pango_font_description_set_absolute_size(desc, app_state.text_font_size * PANGO_SCALE);
+    pango_layout_set_font_description(layout, desc);
+    pango_font_description_free(desc);
+
+    if (app_state.text_content != pango_layout_get_text(layout)) {
+        pango_layout_set_text(layout, app_state.text_content.c_str(), -1);
+    }
+    return layout;
+}
+
+void set_text_layout_box_width(PangoLayout* layout, double box_width) {
+    pango_layout_set_width(layout, static_cast<int>(fmax(1.0, box_width - text_wrap_padding) * PANGO_SCALE));
+}
+
+// Glyph masks are rendered once per font and glyph, then blended straight
+// into the target, so redraws of the preview and the commit skip the font
+// rasterizer entirely. Large font sizes make big masks, so the cache is
+// capped by mask bytes as well as by glyph count.
+const size_t glyph_cache_limit = 4096;
+const size_t glyph_cache_byte_limit = 32 * 1024 * 1024;
+guint32 rgba_to_pixel(const GdkRGBA& color);
+
+void clear_glyph_cache() {
+    for (auto& font_entry : app_state.glyph_cache) {
+        for (auto& glyph_entry : font_entry.second.glyphs) {
+            if (glyph_entry.second.mask) {
+                cairo_surface_destroy(glyph_entry.second.mask);
+            }
+        }
+        cairo_scaled_font_destroy(font_entry.second.scaled_font);
+        g_object_unref(font_entry.first);
+    }
+    app_state.glyph_cache.clear();
+    app_state.glyph_cache_count = 0;
+    app_state.glyph_cache_bytes = 0;
+}
+
+GlyphFontCache& get_glyph_font_cache(PangoFont* font) {
+    auto it = app_state.glyph_cache.find(font);
+    if (it != app_state.glyph_cache.end()) {
+        return it->second;
+    }
+
+    // Same face, size and hinting as Pango uses, without antialiasing
+    cairo_scaled_font_t* base = pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(font));
+    cairo_matrix_t font_matrix;
+    cairo_matrix_t ctm;
+    cairo_scaled_font_get_font_matrix(base, &font_matrix);
+    cairo_scaled_font_get_ctm(base, &ctm);
+    cairo_font_options_t* options = cairo_font_options_create();
+    cairo_scaled_font_get_font_options(base, options);
+    cairo_font_options_set_antialias(options, CAIRO_ANTIALIAS_NONE);
+
+    GlyphFontCache& cache = app_state.glyph_cache[PANGO_FONT(g_object_ref(font))];
+    cache.scaled_font = cairo_scaled_font_create(cairo_scaled_font_get_font_face(base), &font_matrix, &ctm, options);
+    cairo_font_options_destroy(options);
+    return cache;
+}
+
+const GlyphMask& get_glyph_mask(GlyphFontCache& cache, PangoGlyph glyph_id) {
+    auto it = cache.glyphs.find(glyph_id);
+    if (it != cache.glyphs.end()) {
+        return it->second;
+    }
+
+    GlyphMask& mask = cache.glyphs[glyph_id];
+    app_state.glyph_cache_count++;
+
+    cairo_glyph_t glyph = {glyph_id, 0, 0};
+    cairo_text_extents_t extents;
+    cairo_scaled_font_glyph_extents(cache.scaled_font, &glyph, 1, &extents);
+    if (extents.width <= 0 || extents.height <= 0) {
+        return mask;
+    }
+
+    // One pixel of slack on each side for hinting outside the extents
+    mask.x = static_cast<int>(std::floor(extents.x_bearing)) - 1;
+    mask.y = static_cast<int>(std::floor(extents.y_bearing)) - 1;
+    int width = static_cast<int>(std::ceil(extents.x_bearing + extents.width)) + 1 - mask.x;
+    int height = static_cast<int>(std::ceil(extents.y_bearing + extents.height)) + 1 - mask.y;
+
+    mask.mask = cairo_image_surface_create(CAIRO_FORMAT_A8, width, height);
+    app_state.glyph_cache_bytes += (size_t)cairo_image_surface_get_stride(mask.mask) * height;
+    cairo_t* cr = cairo_create(mask.mask);
+    cairo_set_scaled_font(cr, cache.scaled_font);
+    glyph.x = -mask.x;
+    glyph.y = -mask.y;
+    cairo_show_glyphs(cr, &glyph, 1);
+    cairo_destroy(cr);
+    cairo_surface_flush(mask.mask);
+    return mask;
+}
+
+// Blend the layout's glyphs into an ARGB32 surface with the layout's
+// top-left corner at (origin_x, origin_y), glyphs snapped to whole pixels
+void blit_text_layout(cairo_surface_t* target, PangoLayout* layout, double origin_x, double origin_y, guint32 color) {
+    if (app_state.glyph_cache_count > glyph_cache_limit || app_state.glyph_cache_bytes > glyph_cache_byte_limit) {
+        clear_glyph_cache();
+    }
+
+    cairo_surface_flush(target);
+    PangoLayoutIter* iter = pango_layout_get_iter(layout);
+    do {
+        PangoLayoutRun* run = pango_layout_iter_get_run_readonly(iter);
+        if (!run) continue;
+
+        PangoRectangle logical;
+        pango_layout_iter_get_run_extents(iter, NULL, &logical);
+        double baseline = origin_y + pango_layout_iter_get_baseline(iter) / (double)PANGO_SCALE;
+        GlyphFontCache& cache = get_glyph_font_cache(run->item->analysis.font);
+
+        int pen_x = logical.x;
+        for (int i = 0; i < run->glyphs->num_glyphs; i++) {
+            const PangoGlyphInfo& info = run->glyphs->glyphs[i];
+            if (info.glyph != PANGO_GLYPH_EMPTY && !(info.glyph & PANGO_GLYPH_UNKNOWN_FLAG)) {
+                const GlyphMask& mask = get_glyph_mask(cache, info.glyph);
+                if (mask.mask) {
+                    int x = static_cast<int>(std::lround(origin_x + (pen_x + info.geometry.x_offset) / (double)PANGO_SCALE));
+                    int y = static_cast<int>(std::lround(baseline + info.geometry.y_offset / (double)PANGO_SCALE));
+                    blend_color_through_mask(target, mask.mask, x + mask.x, y + mask.y, color);
+                }
+            }
+            pen_x += info.geometry.width;
+        }
+    } while (pango_layout_iter_next_run(iter));
+    pango_layout_iter_free(iter);
+    cairo_surface_mark_dirty(target);
+}
+
+// Canvas position of the layout's top-left corner inside the text box
+double text_layout_origin_x() {
+    return app_state.text_x + text_padding;
+}
+
+double text_layout_origin_y(PangoLayout* layout) {
+    return app_state.text_y + app_state.text_font_size + text_padding -
+        pango_layout_get_baseline(layout) / (double)PANGO_SCALE;
+}
+
+void invalidate_text_preview() {
+    if (app_state.text_preview_surface) {
+        cairo_surface_destroy(app_state.text_preview_surface);
+        app_state.text_preview_surface = nullptr;
+    }
+}
+
 // Calculate required text box size based on content and font
 void update_text_box_size() {
     if (!app_state.text_active) return;
 
-    // Create a temporary cairo surface for measurements
-    cairo_surface_t* temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-    cairo_t* cr = cairo_create(temp_surface);
-    configure_crisp_rendering(cr);
-
-    // Set font
-    cairo_select_font_face(cr, app_state.text_font_family.c_str(), 
-                          CAIRO_FONT_SLANT_NORMAL, 
-                          CAIRO_FONT_WEIGHT_NORMAL);
-    cairo_set_font_size(cr, app_state.text_font_size);
+    PangoLayout* layout = get_text_layout();
 
     // Calculate size needed for text
     const double min_width = 200.0;
     const double width_padding = 20.0;
-    const double wrap_padding = 10.0;
-    const double max_canvas_width = fmax(20.0, app_state.canvas_width - app_state.text_x);
+    const double max_canvas_width = fmax(20.0, app_state.document.width - app_state.text_x);
     double target_width = fmin(min_width, max_canvas_width);
     double total_height = app_state.text_font_size + 10;
 
     if (!app_state.text_content.empty()) {
-        const std::string& text = app_state.text_content;
-        const bool has_manual_line_break = text.find('\n') != std::string::npos;
-        cairo_text_extents_t extents;
-
+        const bool has_manual_line_break = app_state.text_content.find('\n') != std::string::npos;
 
         // Grow width with the current line while typing until we hit the canvas edge.
         if (!has_manual_line_break) {
-            cairo_text_extents(cr, text.c_str(), &extents);
-            double content_width = extents.width + width_padding;
-            target_width = fmin(fmax(min_width, content_width), max_canvas_width);
+            set_text_layout_box_width(layout, max_canvas_width);
+            if (pango_layout_get_line_count(layout) > 1) {
+                target_width = max_canvas_width;
+            } else {
+                PangoRectangle logical;
+                pango_layout_get_pixel_extents(layout, NULL, &logical);
+                target_width = fmin(fmax(min_width, logical.width + width_padding), max_canvas_width);
+            }
         } else {
             // Once Enter is used, keep current width and wrap without expanding further right.
             target_width = fmin(fmax(app_state.text_box_width, min_width), max_canvas_width);
         }
 
-        // Measure wrapped line count based on the chosen width.
-        std::string word;
-        std::string line;
-        int line_count = 1;
-
-        for (size_t i = 0; i <= text.length(); i++) {
-            if (i == text.length() || text[i] == ' ' || text[i] == '\n') {
-                if (!word.empty()) {
-                    std::string test_line = line.empty() ? word : line + " " + word;
-                    cairo_text_extents(cr, test_line.c_str(), &extents);
-
-                    if (extents.width > target_width - wrap_padding && !line.empty()) {
-                    } else {
-                        line = test_line;
-                    }
-                    word.clear();
-                }
-
-                if (i < text.length() && text[i] == '\n') {
-                    line.clear();
-                    line_count++;
-                }
-            } else {
-                word += text[i];
-            }
-        }
-        total_height = line_count * (app_state.text_font_size + 2) + 15;
+        set_text_layout_box_width(layout, target_width);
+        PangoRectangle logical;
+        pango_layout_get_pixel_extents(layout, NULL, &logical);
+        total_height = logical.height + 15;
     } else {
         // Empty text, use minimum size based on font
         total_height = app_state.text_font_size * 3 + 20;
     }
-    cairo_destroy(cr);
-    cairo_surface_destroy(temp_surface);
 
     // Update text box dimensions
     app_state.text_box_width = target_width;
     app_state.text_box_height = fmax(total_height, app_state.text_font_size * 2 + 20);
 
     // Make sure box doesn't go off canvas
-    if (app_state.text_x + app_state.text_box_width > app_state.canvas_width) {
-        app_state.text_box_width = app_state.canvas_width - app_state.text_x;
+    if (app_state.text_x + app_state.text_box_width > app_state.document.width) {
+        app_state.text_box_width = app_state.document.width - app_state.text_x;
     }
-    if (app_state.text_y + app_state.text_box_height > app_state.canvas_height) {
-        app_state.text_box_height = app_state.canvas_height - app_state.text_y;
+    if (app_state.text_y + app_state.text_box_height > app_state.document.height) {
+        app_state.text_box_height = app_state.document.height - app_state.text_y;
     }
+    set_text_layout_box_width(layout, app_state.text_box_width);
 }
 
-// Stop ant path animation
-void stop_ant_animation() {
-    if (app_state.ant_timer_id != 0) {
+// The ants only march while the user can see them: the timer is paused
+// whenever neither the main window nor the text tool window is active, or
+// the main window is iconified or unmapped.
+bool ant_animation_visible() {
+    if (!app_state.window || app_state.window_iconified || !gtk_widget_get_mapped(app_state.window)) {
+        return false;
+    }
+
+    if (gtk_window_is_active(GTK_WINDOW(app_state.window))) {
+        return true;
+    }
+
+    return app_state.text_window && gtk_window_is_active(GTK_WINDOW(app_state.text_window));
+}
+
+void update_ant_timer() {
+    bool should_run = app_state.ant_animation_requested && ant_animation_visible();
+    if (should_run && app_state.ant_timer_id == 0) {
+        app_state.ant_timer_id = g_timeout_add(50, ant_path_timer, NULL);
+    } else if (!should_run && app_state.ant_timer_id != 0) {
         g_source_remove(app_state.ant_timer_id);
         app_state.ant_timer_id = 0;
     }
 }
 
+// Stop ant path animation
+void stop_ant_animation() {
+    app_state.ant_animation_requested = false;
+    update_ant_timer();
+}
+
 // Cancel text without rendering
 void cancel_text() {
     app_state.text_active = false;
     app_state.text_content.clear();
+    invalidate_text_preview();
     
     // Destroy text window if it exists
     if (app_state.text_window) {
@@ -572,14 +999,12 @@ void cancel_text() {
         stop_ant_animation();
     }
     
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
+    queue_overlay_redraw();
 }
 
 // Finalize text onto canvas
 void finalize_text() {
-    if (!app_state.text_active || app_state.text_content.empty() || !app_state.surface) {
+    if (!app_state.text_active || app_state.text_content.empty() || !app_state.document.surface) {
         // If text is active but empty, just cancel it
         if (app_state.text_active) {
             cancel_text();
@@ -587,77 +1012,22 @@ void finalize_text() {
         return;
     }
     
-    push_undo_state();
-
-    cairo_t* cr = cairo_create(app_state.surface);
-    configure_crisp_rendering(cr);
-    
-    // Set font
-    cairo_select_font_face(cr, app_state.text_font_family.c_str(), 
-                          CAIRO_FONT_SLANT_NORMAL, 
-                          CAIRO_FONT_WEIGHT_NORMAL);
-    cairo_set_font_size(cr, app_state.text_font_size);
-    
-    // Set color
-    cairo_set_source_rgba(cr, 
-        app_state.fg_color.red,
-        app_state.fg_color.green,
-        app_state.fg_color.blue,
-        app_state.fg_color.alpha
-    );
-    
-    // Draw text with word wrapping
-    std::string text = app_state.text_content;
-    double y = app_state.text_y + app_state.text_font_size + 5;
-    double x = app_state.text_x + 5;
-    
-    cairo_text_extents_t extents;
-    std::string word;
-    std::string line;
-    
-    for (size_t i = 0; i <= text.length(); i++) {
-        if (i == text.length() || text[i] == ' ' || text[i] == '\n') {
-            if (!word.empty()) {
-                std::string test_line = line.empty() ? word : line + " " + word;
-                cairo_text_extents(cr, test_line.c_str(), &extents);
-                
-                if (extents.width > app_state.text_box_width - 10) {
-                    if (!line.empty()) {
-                        cairo_move_to(cr, x, y);
-                        cairo_show_text(cr, line.c_str());
-                        y += app_state.text_font_size + 2;
-                        line = word;
-                    } else {
-                        cairo_move_to(cr, x, y);
-                        cairo_show_text(cr, word.c_str());
-                        y += app_state.text_font_size + 2;
-                        line.clear();
-                    }
-                } else {
-                    line = test_line;
-                }
-                word.clear();
-            }
-            
-            if (i < text.length() && text[i] == '\n') {
-                if (!line.empty()) {
-                    cairo_move_to(cr, x, y);
-                    cairo_show_text(cr, line.c_str());
-                    y += app_state.text_font_size + 2;
-                    line.clear();
-                }
-            }
-        } else {
-            word += text[i];
-        }
-    }
-    
-    if (!line.empty()) {
-        cairo_move_to(cr, x, y);
-        cairo_show_text(cr, line.c_str());
-    }
-    
-    cairo_destroy(cr);
+    PangoLayout* layout = get_text_layout();
+
+    // Only the pixels under the text go into the undo step
+    PangoRectangle ink;
+    pango_layout_get_pixel_extents(layout, &ink, NULL);
+    double origin_x = text_layout_origin_x();
+    double origin_y = text_layout_origin_y(layout);
+    document_begin_stroke(app_state.document);
+    document_capture_area(app_state.document,
+        static_cast<int>(std::floor(origin_x)) + ink.x - 2,
+        static_cast<int>(std::floor(origin_y)) + ink.y - 2,
+        ink.width + 5, ink.height + 5);
+
+    blit_text_layout(app_state.document.surface, layout, origin_x, origin_y, rgba_to_pixel(app_state.fg_color));
+    document_end_stroke(app_state.document);
+    invalidate_text_preview();
     
     // Clear text state
     app_state.text_active = false;
@@ -675,13 +1045,49 @@ void finalize_text() {
         stop_ant_animation();
     }
     
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
+    invalidate_canvas();
+}
+
+SelectionOutlineKey get_selection_outline_key() {
+    SelectionOutlineKey key;
+    key.is_rect = app_state.selection_is_rect;
+    key.x1 = app_state.selection_x1;
+    key.y1 = app_state.selection_y1;
+    key.x2 = app_state.selection_x2;
+    key.y2 = app_state.selection_y2;
+    if (!app_state.selection_is_rect && !app_state.selection_path.empty()) {
+        // FNV-1a over the coordinates' bits, so moving any point misses
+        guint64 hash = 14695981039346656037ull;
+        for (const std::pair<double, double>& point : app_state.selection_path) {
+            guint64 bits[2];
+            std::memcpy(&bits[0], &point.first, sizeof(double));
+            std::memcpy(&bits[1], &point.second, sizeof(double));
+            hash = (hash ^ bits[0]) * 1099511628211ull;
+            hash = (hash ^ bits[1]) * 1099511628211ull;
+        }
+        key.point_count = app_state.selection_path.size();
+        key.points_hash = hash;
+    }
+    return key;
+}
+
+bool selection_outline_keys_equal(const SelectionOutlineKey& a, const SelectionOutlineKey& b) {
+    return a.is_rect == b.is_rect &&
+           a.x1 == b.x1 && a.y1 == b.y1 && a.x2 == b.x2 && a.y2 == b.y2 &&
+           a.point_count == b.point_count &&
+           a.points_hash == b.points_hash;
+}
+
+void invalidate_selection_outline_cache() {
+    if (app_state.selection_outline_path) {
+        cairo_path_destroy(app_state.selection_outline_path);
+        app_state.selection_outline_path = nullptr;
     }
 }
 
 // Clear selection
 void clear_selection() {
+    invalidate_selection_outline_cache();
     if (app_state.floating_surface) {
         cairo_surface_destroy(app_state.floating_surface);
         app_state.floating_surface = nullptr;
@@ -692,13 +1098,11 @@ void clear_selection() {
     app_state.has_selection = false;
     app_state.selection_path.clear();
     app_state.drag_undo_snapshot_taken = false;
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
+    queue_overlay_redraw();
 }
 
 void commit_floating_selection(bool record_undo) {
-    if (!app_state.floating_selection_active || !app_state.floating_surface || !app_state.surface) {
+    if (!app_state.floating_selection_active || !app_state.floating_surface || !app_state.document.surface) {
         return;
     }
 
@@ -709,28 +1113,19 @@ void commit_floating_selection(bool record_undo) {
         push_undo_state();
     }
 
-    cairo_t* cr = cairo_create(app_state.surface);
+    cairo_t* cr = cairo_create(app_state.document.surface);
     configure_crisp_rendering(cr);
     cairo_set_source_surface(cr, app_state.floating_surface, x, y);
     cairo_paint(cr);
     cairo_destroy(cr);
+    invalidate_canvas_area(x, y,
+        cairo_image_surface_get_width(app_state.floating_surface),
+        cairo_image_surface_get_height(app_state.floating_surface));
 
     clear_selection();
     app_state.drag_undo_snapshot_taken = false;
 }
 
-void append_selection_path(cairo_t* cr) {
-    if (app_state.selection_path.size() < 3) {
-        return;
-    }
-
-    cairo_move_to(cr, app_state.selection_path[0].first, app_state.selection_path[0].second);
-    for (size_t i = 1; i < app_state.selection_path.size(); i++) {
-        cairo_line_to(cr, app_state.selection_path[i].first, app_state.selection_path[i].second);
-    }
-    cairo_close_path(cr);
-}
-
 void finalize_lasso_selection() {
     if (app_state.lasso_points.size() < 3) {
         app_state.lasso_points.clear();
@@ -761,6 +1156,16 @@ void finalize_lasso_selection() {
     app_state.is_drawing = false;
 }
 
+RgbaColor to_rgba_color(const GdkRGBA& color) {
+    return {color.red, color.green, color.blue, color.alpha};
+}
+
+// Lasso outline, or empty for rectangle selections
+const SelectionPath& get_selection_shape_path() {
+    static const SelectionPath no_path;
+    return app_state.selection_is_rect ? no_path : app_state.selection_path;
+}
+
 struct SelectionPixelBounds {
     int x;
     int y;
@@ -783,7 +1188,7 @@ SelectionPixelBounds get_selection_pixel_bounds() {
 }
 
 void start_selection_drag() {
-    if (!app_state.has_selection || !app_state.surface) return;
+    if (!app_state.has_selection || !app_state.document.surface) return;
 
     if (app_state.floating_selection_active) return;
 
@@ -797,39 +1202,10 @@ void start_selection_drag() {
     int h = bounds.height;
     if (w <= 0 || h <= 0) return;
 
-    app_state.floating_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
-    cairo_t* float_cr = cairo_create(app_state.floating_surface);
-    configure_crisp_rendering(float_cr);
-
-    if (app_state.selection_is_rect) {
-        cairo_set_source_surface(float_cr, app_state.surface, -bounds.x, -bounds.y);
-        cairo_paint(float_cr);
-    } else if (app_state.selection_path.size() > 2) {
-        cairo_save(float_cr);
-        cairo_translate(float_cr, -bounds.x, -bounds.y);
-	append_selection_path(float_cr);
-        cairo_clip(float_cr);
-        cairo_set_source_surface(float_cr, app_state.surface, 0, 0);
-        cairo_paint(float_cr);
-        cairo_restore(float_cr);
-    }
-    cairo_destroy(float_cr);
-
-    cairo_t* cr = cairo_create(app_state.surface);
-    configure_crisp_rendering(cr);
-    cairo_set_source_rgba(cr,
-        app_state.bg_color.red,
-        app_state.bg_color.green,
-        app_state.bg_color.blue,
-        app_state.bg_color.alpha
-    );
-    if (app_state.selection_is_rect) {
-        cairo_rectangle(cr, bounds.x, bounds.y, w, h);
-    } else if (app_state.selection_path.size() > 2) {
-        append_selection_path(cr);
-    }
-    cairo_fill(cr);
-    cairo_destroy(cr);
+    const SelectionPath& path = get_selection_shape_path();
+    app_state.floating_surface = extract_selection(app_state.document.surface, bounds.x, bounds.y, w, h, path);
+    fill_selection(app_state.document.surface, bounds.x, bounds.y, w, h, path, to_rgba_color(app_state.bg_color));
+    invalidate_canvas_area(bounds.x, bounds.y, w, h);
 
     app_state.selection_x1 = bounds.x;
     app_state.selection_y1 = bounds.y;
@@ -842,7 +1218,8 @@ void start_selection_drag() {
 
 // Copy selection to clipboard
 void copy_selection() {
-    if (!app_state.has_selection || !app_state.surface) return;
+    TraceSpan span("copy_selection");
+    if (!app_state.has_selection || !app_state.document.surface) return;
     
     SelectionPixelBounds bounds = get_selection_pixel_bounds();
     int w = bounds.width;
@@ -854,41 +1231,22 @@ void copy_selection() {
         cairo_surface_destroy(app_state.clipboard_surface);
     }
 
-    app_state.clipboard_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
-    app_state.clipboard_width = w;
-    app_state.clipboard_height = h;
-
-    cairo_t* cr = cairo_create(app_state.clipboard_surface);
-    configure_crisp_rendering(cr);
-
-    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-    cairo_set_source_rgba(cr, 0, 0, 0, 0);
-    cairo_paint(cr);
-    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-
     if (app_state.floating_selection_active && app_state.floating_surface) {
-        cairo_set_source_surface(cr, app_state.floating_surface, 0, 0);
-        cairo_paint(cr);
-    } else if (app_state.selection_is_rect) {
-        cairo_set_source_surface(cr, app_state.surface, -bounds.x, -bounds.y);
-        cairo_paint(cr);
-    } else if (app_state.selection_path.size() > 2) {
-        cairo_save(cr);
-        cairo_translate(cr, -bounds.x, -bounds.y);
-        append_selection_path(cr);
-        cairo_clip(cr);
-        cairo_set_source_surface(cr, app_state.surface, 0, 0);
-        cairo_paint(cr);
-        cairo_restore(cr);
+        app_state.clipboard_surface = extract_selection(app_state.floating_surface, 0, 0, w, h, SelectionPath());
+    } else {
+        app_state.clipboard_surface = extract_selection(app_state.document.surface,
+            bounds.x, bounds.y, w, h, get_selection_shape_path());
     }
+    app_state.clipboard_width = w;
+    app_state.clipboard_height = h;
 
-    cairo_destroy(cr);
     copy_surface_to_system_clipboard(app_state.clipboard_surface);
 }
 
 // Cut selection to clipboard
 void cut_selection() {
-    if (!app_state.has_selection || !app_state.surface) return;
+    TraceSpan span("cut_selection");
+    if (!app_state.has_selection || !app_state.document.surface) return;
 
     copy_selection();
 
@@ -897,63 +1255,20 @@ void cut_selection() {
         return;
     }
 
-    cairo_t* cr = cairo_create(app_state.surface);
-    configure_crisp_rendering(cr);
-    cairo_set_source_rgba(cr,
-        app_state.bg_color.red,
-        app_state.bg_color.green,
-        app_state.bg_color.blue,
-        app_state.bg_color.alpha
-    );
-
-    if (app_state.selection_is_rect) {
-        SelectionPixelBounds bounds = get_selection_pixel_bounds();
-
-        push_undo_state();
-
-        cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
-    } else if (app_state.selection_path.size() > 2) {
-        append_selection_path(cr);
-    }
-    cairo_fill(cr);
-    cairo_destroy(cr);
+    SelectionPixelBounds bounds = get_selection_pixel_bounds();
+    push_undo_state();
+    fill_selection(app_state.document.surface, bounds.x, bounds.y, bounds.width, bounds.height,
+        get_selection_shape_path(), to_rgba_color(app_state.bg_color));
 
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
+    invalidate_canvas();
 
     clear_selection();
 	app_state.drag_undo_snapshot_taken = false;
 }
 
-// Paste from clipboard
-void paste_selection() {
-    if (!app_state.surface) return;
-
-    int clipboard_width = 0;
-    int clipboard_height = 0;
-    cairo_surface_t* system_surface = get_surface_from_system_clipboard(clipboard_width, clipboard_height);
-
-    if (system_surface) {
-        if (app_state.clipboard_surface) {
-            cairo_surface_destroy(app_state.clipboard_surface);
-        }
-        app_state.clipboard_surface = system_surface;
-        app_state.clipboard_width = clipboard_width;
-        app_state.clipboard_height = clipboard_height;
-    }
-
-    if (!app_state.clipboard_surface) return;
-
-    bool exceeds_canvas = app_state.clipboard_width > app_state.canvas_width ||
-        app_state.clipboard_height > app_state.canvas_height;
-    if (exceeds_canvas &&
-        should_expand_canvas_for_paste(app_state.clipboard_width, app_state.clipboard_height)) {
-        resize_canvas_for_paste(
-            std::max(app_state.canvas_width, app_state.clipboard_width),
-            std::max(app_state.canvas_height, app_state.clipboard_height)
-        );
-    }
+// Install the internal clipboard surface as a floating selection
+void install_clipboard_selection() {
+    if (!app_state.document.surface || !app_state.clipboard_surface) return;
 
     clear_selection();
 
@@ -973,47 +1288,149 @@ void paste_selection() {
     app_state.selection_x2 = paste_x + app_state.clipboard_width;
     app_state.selection_y2 = paste_y + app_state.clipboard_height;
 
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
+    queue_overlay_redraw();
 }
-void copy_surface_to_system_clipboard(cairo_surface_t* surface) {
-    if (!surface || !app_state.window) return;
-
-    GtkClipboard* clipboard = gtk_widget_get_clipboard(app_state.window, GDK_SELECTION_CLIPBOARD);
-    if (!clipboard) return;
 
-    int width = cairo_image_surface_get_width(surface);
-    int height = cairo_image_surface_get_height(surface);
-    if (width <= 0 || height <= 0) return;
+void place_clipboard_selection() {
+    if (!app_state.document.surface || !app_state.clipboard_surface) return;
 
-    GdkPixbuf* pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0, width, height);
-    if (!pixbuf) return;
+    bool exceeds_canvas = app_state.clipboard_width > app_state.document.width ||
+        app_state.clipboard_height > app_state.document.height;
+    if (exceeds_canvas &&
+        should_expand_canvas_for_paste(app_state.clipboard_width, app_state.clipboard_height)) {
+        // The selection goes in once the expanded canvas is ready
+        bool expanding = start_canvas_resize_job(
+            std::max(app_state.document.width, app_state.clipboard_width),
+            std::max(app_state.document.height, app_state.clipboard_height),
+            false,
+            install_clipboard_selection
+        );
+        if (expanding) return;
+    }
 
-    gtk_clipboard_set_image(clipboard, pixbuf);
-    g_object_unref(pixbuf);
+    install_clipboard_selection();
 }
 
-cairo_surface_t* get_surface_from_system_clipboard(int& width, int& height) {
-    width = 0;
-    height = 0;
+// Finish a paste request; a null surface falls back to the internal clipboard
+void complete_paste(guint request_id, cairo_surface_t* system_surface) {
+    TraceSpan span("complete_paste");
+    if (request_id != app_state.paste_request_id) {
+        if (system_surface) cairo_surface_destroy(system_surface);
+        return;
+    }
 
-    if (!app_state.window) return nullptr;
+    if (system_surface) {
+        if (app_state.clipboard_surface) {
+            cairo_surface_destroy(app_state.clipboard_surface);
+        }
+        app_state.clipboard_surface = system_surface;
+        app_state.clipboard_width = cairo_image_surface_get_width(system_surface);
+        app_state.clipboard_height = cairo_image_surface_get_height(system_surface);
+    }
 
-    GtkClipboard* clipboard = gtk_widget_get_clipboard(app_state.window, GDK_SELECTION_CLIPBOARD);
-    if (!clipboard || !gtk_clipboard_wait_is_image_available(clipboard)) return nullptr;
+    place_clipboard_selection();
+}
 
-    GdkPixbuf* pixbuf = gtk_clipboard_wait_for_image(clipboard);
-    if (!pixbuf) return nullptr;
+void convert_clipboard_pixbuf_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+    TraceSpan span("create_surface_from_pixbuf");
+    cairo_surface_t* surface = create_surface_from_pixbuf(GDK_PIXBUF(task_data));
+    g_task_return_pointer(task, surface, (GDestroyNotify)cairo_surface_destroy);
+}
 
-    width = gdk_pixbuf_get_width(pixbuf);
-    height = gdk_pixbuf_get_height(pixbuf);
+void on_clipboard_pixbuf_converted(GObject* source_object, GAsyncResult* result, gpointer data) {
+    cairo_surface_t* surface = (cairo_surface_t*)g_task_propagate_pointer(G_TASK(result), NULL);
+    complete_paste(GPOINTER_TO_UINT(data), surface);
+}
 
-    cairo_surface_t* surface = gdk_cairo_surface_create_from_pixbuf(pixbuf, 0, nullptr);
-    g_object_unref(pixbuf);
+// Clipboard images at least this large are converted on a worker thread
+const gint64 threaded_paste_conversion_pixels = 1024 * 1024;
 
-    return surface;
-}
+void on_clipboard_image_received(GtkClipboard* clipboard, GdkPixbuf* pixbuf, gpointer data) {
+    guint request_id = GPOINTER_TO_UINT(data);
+    if (request_id != app_state.paste_request_id) return;
+
+    if (!pixbuf) {
+        complete_paste(request_id, nullptr);
+        return;
+    }
+
+    // Small images convert faster than a worker round trip
+    gint64 pixels = (gint64)gdk_pixbuf_get_width(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+    if (pixels < threaded_paste_conversion_pixels) {
+        complete_paste(request_id, create_surface_from_pixbuf(pixbuf));
+        return;
+    }
+
+    GTask* task = g_task_new(NULL, NULL, on_clipboard_pixbuf_converted, data);
+    g_task_set_task_data(task, g_object_ref(pixbuf), g_object_unref);
+    g_task_run_in_thread(task, convert_clipboard_pixbuf_thread);
+    g_object_unref(task);
+}
+
+// Paste from clipboard
+void paste_selection() {
+    TraceSpan span("paste_selection");
+    if (!app_state.document.surface) return;
+
+    // A newer request supersedes any paste still waiting on the clipboard
+    guint request_id = ++app_state.paste_request_id;
+
+    GtkClipboard* clipboard = app_state.window ?
+        gtk_widget_get_clipboard(app_state.window, GDK_SELECTION_CLIPBOARD) : nullptr;
+    // Our own copy is already in clipboard_surface; skip the round trip
+    if (!clipboard || app_state.clipboard_owned || app_state.replaying) {
+        complete_paste(request_id, nullptr);
+        return;
+    }
+
+    gtk_clipboard_request_image(clipboard, on_clipboard_image_received, GUINT_TO_POINTER(request_id));
+}
+
+// Render the published surface for another application's paste request
+void on_clipboard_get(GtkClipboard* clipboard, GtkSelectionData* selection_data, guint info, gpointer data) {
+    TraceSpan span("on_clipboard_get");
+    cairo_surface_t* surface = (cairo_surface_t*)data;
+
+    GdkPixbuf* pixbuf = create_pixbuf_from_surface(surface, true);
+    if (!pixbuf) return;
+
+    gtk_selection_data_set_pixbuf(selection_data, pixbuf);
+    g_object_unref(pixbuf);
+}
+
+void on_clipboard_clear(GtkClipboard* clipboard, gpointer data) {
+    cairo_surface_destroy((cairo_surface_t*)data);
+    app_state.clipboard_owned = false;
+}
+
+// Claim the clipboard; image targets are only rendered when requested
+void copy_surface_to_system_clipboard(cairo_surface_t* surface) {
+    TraceSpan span("copy_surface_to_system_clipboard");
+    if (!surface || !app_state.window || app_state.replaying) return;
+
+    GtkClipboard* clipboard = gtk_widget_get_clipboard(app_state.window, GDK_SELECTION_CLIPBOARD);
+    if (!clipboard) return;
+
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    if (width <= 0 || height <= 0) return;
+
+    GtkTargetList* target_list = gtk_target_list_new(NULL, 0);
+    gtk_target_list_add_image_targets(target_list, 0, TRUE);
+    int n_targets = 0;
+    GtkTargetEntry* targets = gtk_target_table_new_from_list(target_list, &n_targets);
+    gtk_target_list_unref(target_list);
+
+    cairo_surface_t* published = cairo_surface_reference(surface);
+    if (gtk_clipboard_set_with_data(clipboard, targets, n_targets,
+            on_clipboard_get, on_clipboard_clear, published)) {
+        gtk_clipboard_set_can_store(clipboard, NULL, 0);
+        app_state.clipboard_owned = true;
+    } else {
+        cairo_surface_destroy(published);
+    }
+    gtk_target_table_free(targets, n_targets);
+}
 
 bool should_expand_canvas_for_paste(int pasted_width, int pasted_height) {
     if (!app_state.window) return false;
@@ -1040,8 +1457,8 @@ bool should_expand_canvas_for_paste(int pasted_width, int pasted_height) {
         details,
         sizeof(details),
         _("Canvas: %d x %d    Pasted image: %d x %d"),
-        app_state.canvas_width,
-        app_state.canvas_height,
+        app_state.document.width,
+        app_state.document.height,
         pasted_width,
         pasted_height
     );
@@ -1056,40 +1473,6 @@ bool should_expand_canvas_for_paste(int pasted_width, int pasted_height) {
     return response == GTK_RESPONSE_ACCEPT;
 }
 
-void resize_canvas_for_paste(int new_width, int new_height) {
-    if (!app_state.surface) return;
-    if (new_width <= app_state.canvas_width && new_height <= app_state.canvas_height) return;
-
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* resized_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-
-    cairo_t* cr = cairo_create(resized_surface);
-    configure_crisp_rendering(cr);
-    cairo_set_source_rgba(
-        cr,
-        app_state.bg_color.red,
-        app_state.bg_color.green,
-        app_state.bg_color.blue,
-        app_state.bg_color.alpha
-    );
-    cairo_paint(cr);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = resized_surface;
-    app_state.canvas_width = new_width;
-    app_state.canvas_height = new_height;
-    cairo_surface_destroy(old_surface);
-
-    if (app_state.drawing_area) {
-        gtk_widget_set_size_request(app_state.drawing_area, new_width, new_height);
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
-}
-
 // Constrain line to horizontal or vertical when shift is pressed
 void constrain_line(double start_x, double start_y, double& end_x, double& end_y) {
     double dx = end_x - start_x;
@@ -1122,23 +1505,361 @@ void constrain_to_square(double start_x, double start_y, double& end_x, double&
     end_y = start_y + (dy >= 0 ? size : -size);
 }
 
+// Apply the Shift constraints of the shape tools to the current pointer position
+void get_constrained_preview_point(double& preview_x, double& preview_y) {
+    preview_x = app_state.current_x;
+    preview_y = app_state.current_y;
+
+    if (app_state.shift_pressed && !app_state.ellipse_center_mode) {
+        if (app_state.current_tool == TOOL_LINE) {
+            constrain_line(app_state.start_x, app_state.start_y, preview_x, preview_y);
+        } else if (app_state.current_tool == TOOL_ELLIPSE) {
+            constrain_to_circle(app_state.start_x, app_state.start_y, preview_x, preview_y);
+        } else if (app_state.current_tool == TOOL_RECTANGLE ||
+                   app_state.current_tool == TOOL_ROUNDED_RECT ||
+                   app_state.current_tool == TOOL_RECT_SELECT) {
+            constrain_to_square(app_state.start_x, app_state.start_y, preview_x, preview_y);
+        }
+    }
+}
+
+void include_overlay_point(OverlayBounds& bounds, double x, double y, double pad) {
+    if (bounds.empty) {
+        bounds.empty = false;
+        bounds.x1 = x - pad;
+        bounds.y1 = y - pad;
+        bounds.x2 = x + pad;
+        bounds.y2 = y + pad;
+        return;
+    }
+
+    bounds.x1 = fmin(bounds.x1, x - pad);
+    bounds.y1 = fmin(bounds.y1, y - pad);
+    bounds.x2 = fmax(bounds.x2, x + pad);
+    bounds.y2 = fmax(bounds.y2, y + pad);
+}
+
+void include_overlay_bounds(OverlayBounds& bounds, const OverlayBounds& other) {
+    if (other.empty) {
+        return;
+    }
+
+    include_overlay_point(bounds, other.x1, other.y1, 0.0);
+    include_overlay_point(bounds, other.x2, other.y2, 0.0);
+}
+
+// Padding around a vertex marker drawn by draw_black_outline_circle()
+const double vertex_marker_pad = 6.0;
+
+OverlayBounds get_selection_outline_bounds() {
+    OverlayBounds bounds;
+    if (!app_state.has_selection) {
+        return bounds;
+    }
+
+    if (app_state.selection_is_rect) {
+        include_overlay_point(bounds, app_state.selection_x1, app_state.selection_y1, 1.0);
+        include_overlay_point(bounds, app_state.selection_x2, app_state.selection_y2, 1.0);
+    } else {
+        for (const auto& point : app_state.selection_path) {
+            include_overlay_point(bounds, point.first, point.second, 1.0);
+        }
+    }
+    return bounds;
+}
+
+OverlayBounds get_text_box_bounds() {
+    OverlayBounds bounds;
+    if (!app_state.text_active) {
+        return bounds;
+    }
+
+    include_overlay_point(bounds, app_state.text_x, app_state.text_y, 1.0);
+    include_overlay_point(bounds,
+        app_state.text_x + app_state.text_box_width,
+        app_state.text_y + app_state.text_box_height,
+        1.0);
+    return bounds;
+}
+
+// Area covered by draw_preview() for the in-progress shape or selection
+OverlayBounds get_preview_bounds() {
+    OverlayBounds bounds;
+    if (!app_state.is_drawing || app_state.dragging_selection ||
+        !tool_needs_preview(app_state.current_tool)) {
+        return bounds;
+    }
+
+    double preview_x;
+    double preview_y;
+    get_constrained_preview_point(preview_x, preview_y);
+
+    switch (app_state.current_tool) {
+        case TOOL_CURVE:
+            if (app_state.curve_active) {
+                include_overlay_point(bounds, app_state.curve_start_x, app_state.curve_start_y, vertex_marker_pad);
+                if (app_state.curve_has_end) {
+                    include_overlay_point(bounds, app_state.curve_end_x, app_state.curve_end_y, vertex_marker_pad);
+                }
+                if (app_state.curve_has_control) {
+                    include_overlay_point(bounds, app_state.curve_control_x, app_state.curve_control_y, 1.0);
+                }
+            }
+            break;
+        case TOOL_LASSO_SELECT:
+            for (const auto& point : app_state.lasso_points) {
+                include_overlay_point(bounds, point.first, point.second, vertex_marker_pad);
+            }
+            if (app_state.lasso_polygon_mode) {
+                include_overlay_point(bounds, preview_x, preview_y, 1.0);
+            }
+            break;
+        case TOOL_POLYGON:
+            for (const auto& point : app_state.polygon_points) {
+                include_overlay_point(bounds, point.first, point.second, vertex_marker_pad);
+            }
+            if (!app_state.polygon_points.empty()) {
+                include_overlay_point(bounds, preview_x, preview_y, 1.0);
+            }
+            break;
+        case TOOL_ELLIPSE:
+            if (app_state.ellipse_center_mode) {
+                double radius = std::hypot(preview_x - app_state.start_x, preview_y - app_state.start_y);
+                include_overlay_point(bounds, app_state.start_x, app_state.start_y, radius + 1.0);
+                break;
+            }
+            include_overlay_point(bounds, app_state.start_x, app_state.start_y, 1.0);
+            include_overlay_point(bounds, preview_x, preview_y, 1.0);
+            break;
+        default:
+            include_overlay_point(bounds, app_state.start_x, app_state.start_y, vertex_marker_pad);
+            include_overlay_point(bounds, preview_x, preview_y, vertex_marker_pad);
+            break;
+    }
+    return bounds;
+}
+
+void queue_canvas_redraw_area(const OverlayBounds& bounds) {
+    if (!app_state.drawing_area || bounds.empty) {
+        return;
+    }
+
+    int x1 = static_cast<int>(std::floor(bounds.x1 * app_state.zoom_factor)) - 1;
+    int y1 = static_cast<int>(std::floor(bounds.y1 * app_state.zoom_factor)) - 1;
+    int x2 = static_cast<int>(std::ceil(bounds.x2 * app_state.zoom_factor)) + 1;
+    int y2 = static_cast<int>(std::ceil(bounds.y2 * app_state.zoom_factor)) + 1;
+    gtk_widget_queue_draw_area(app_state.drawing_area, x1, y1, x2 - x1, y2 - y1);
+}
+
+// A rectangular outline only needs its four edges repainted, not its interior
+void queue_rect_outline_redraw(const OverlayBounds& bounds) {
+    if (bounds.empty) {
+        return;
+    }
+
+    const double edge = 2.0;
+    OverlayBounds top = bounds;
+    top.y2 = fmin(bounds.y2, bounds.y1 + edge);
+    OverlayBounds bottom = bounds;
+    bottom.y1 = fmax(bounds.y1, bounds.y2 - edge);
+    OverlayBounds left = bounds;
+    left.x2 = fmin(bounds.x2, bounds.x1 + edge);
+    OverlayBounds right = bounds;
+    right.x1 = fmax(bounds.x1, bounds.x2 - edge);
+
+    queue_canvas_redraw_area(top);
+    queue_canvas_redraw_area(bottom);
+    queue_canvas_redraw_area(left);
+    queue_canvas_redraw_area(right);
+}
+
+double get_hover_outline_radius() {
+    if (app_state.current_tool == TOOL_ERASER) {
+        return app_state.line_width * 1.5;
+    }
+    if (app_state.current_tool == TOOL_AIRBRUSH) {
+        return app_state.line_width * 5.0;
+    }
+    return app_state.line_width;
+}
+
+OverlayBounds get_hover_indicator_bounds() {
+    OverlayBounds bounds;
+    if (!app_state.hover_in_canvas || app_state.is_drawing) {
+        return bounds;
+    }
+
+    if (tool_shows_brush_hover_outline(app_state.current_tool)) {
+        include_overlay_point(bounds, app_state.hover_x, app_state.hover_y, get_hover_outline_radius() + 1.0);
+    } else if (tool_shows_vertex_hover_markers(app_state.current_tool)) {
+        include_overlay_point(bounds, app_state.hover_x, app_state.hover_y, vertex_marker_pad);
+    }
+    return bounds;
+}
+
+// The floating selection is drawn in the overlay pass, so its pixels count
+// as part of the selection overlay.
+OverlayBounds get_selection_overlay_bounds() {
+    OverlayBounds bounds = get_selection_outline_bounds();
+    if (app_state.has_selection && app_state.floating_selection_active) {
+        include_overlay_point(bounds, app_state.selection_x1, app_state.selection_y1, 1.0);
+        include_overlay_point(bounds, app_state.selection_x2, app_state.selection_y2, 1.0);
+    }
+    return bounds;
+}
+
+// The text preview is clipped to its box
+OverlayBounds get_text_overlay_bounds() {
+    return get_text_box_bounds();
+}
+
+OverlayBounds get_overlay_bounds() {
+    OverlayBounds bounds = get_selection_overlay_bounds();
+    include_overlay_bounds(bounds, get_text_overlay_bounds());
+    include_overlay_bounds(bounds, get_preview_bounds());
+    include_overlay_bounds(bounds, get_hover_indicator_bounds());
+    return bounds;
+}
+
+// Repaint the union of the overlay area of the previous frame and the next
+// one; the base canvas composite underneath is reused from the cache.
+void queue_overlay_redraw() {
+    OverlayBounds bounds = get_overlay_bounds();
+    OverlayBounds damage = bounds;
+    include_overlay_bounds(damage, app_state.last_overlay_bounds);
+    app_state.last_overlay_bounds = bounds;
+    queue_canvas_redraw_area(damage);
+}
+
+void mark_composite_dirty(int x, int y, int width, int height) {
+    if (!app_state.composite_cache) {
+        return;
+    }
+
+    cairo_rectangle_int_t rect = {x, y, width, height};
+    cairo_region_union_rectangle(app_state.composite_dirty, &rect);
+}
+
+// Pixels of the canvas surface changed inside the given canvas-space rectangle
+void invalidate_canvas_area(double x, double y, double width, double height) {
+    document_mark_dirty(app_state.document,
+        static_cast<int>(std::floor(x)) - 1, static_cast<int>(std::floor(y)) - 1,
+        static_cast<int>(std::ceil(width)) + 2, static_cast<int>(std::ceil(height)) + 2);
+    int x1 = static_cast<int>(std::floor(x * app_state.zoom_factor)) - 1;
+    int y1 = static_cast<int>(std::floor(y * app_state.zoom_factor)) - 1;
+    int x2 = static_cast<int>(std::ceil((x + width) * app_state.zoom_factor)) + 1;
+    int y2 = static_cast<int>(std::ceil((y + height) * app_state.zoom_factor)) + 1;
+
+    mark_composite_dirty(x1, y1, x2 - x1, y2 - y1);
+    if (app_state.drawing_area) {
+        gtk_widget_queue_draw_area(app_state.drawing_area, x1, y1, x2 - x1, y2 - y1);
+    }
+    queue_overlay_redraw();
+}
+
+// The whole canvas changed: new surface, new size, zoom, transform or undo
+void invalidate_canvas() {
+    if (app_state.composite_cache) {
+        mark_composite_dirty(0, 0,
+            cairo_image_surface_get_width(app_state.composite_cache),
+            cairo_image_surface_get_height(app_state.composite_cache));
+    }
+    app_state.last_overlay_bounds = get_overlay_bounds();
+    if (app_state.drawing_area) {
+        gtk_widget_queue_draw(app_state.drawing_area);
+    }
+    update_canvas_dimensions_label();
+}
+
+// Canvas area touched by a freehand tool between the last pointer position and (x, y)
+OverlayBounds get_stroke_segment_bounds(double x, double y) {
+    OverlayBounds bounds;
+    double pad = 1.0;
+    switch (app_state.current_tool) {
+        case TOOL_AIRBRUSH:
+            include_overlay_point(bounds, x, y, app_state.line_width * 5.0 + 2.0);
+            return bounds;
+        case TOOL_PAINTBRUSH:
+            pad += app_state.line_width;
+            break;
+        case TOOL_ERASER:
+            pad += app_state.line_width * 1.5;
+            break;
+        default:
+            pad += 0.5;
+            break;
+    }
+
+    include_overlay_point(bounds, app_state.last_x, app_state.last_y, pad);
+    include_overlay_point(bounds, x, y, pad);
+    return bounds;
+}
+
+void invalidate_canvas_bounds(const OverlayBounds& bounds) {
+    if (bounds.empty) {
+        return;
+    }
+    invalidate_canvas_area(bounds.x1, bounds.y1, bounds.x2 - bounds.x1, bounds.y2 - bounds.y1);
+}
+
+// Save the canvas under bounds for undo before the current stroke paints it
+void capture_stroke_area(const OverlayBounds& bounds) {
+    if (bounds.empty) {
+        return;
+    }
+    int x = static_cast<int>(std::floor(bounds.x1));
+    int y = static_cast<int>(std::floor(bounds.y1));
+    document_capture_area(app_state.document, x, y,
+        static_cast<int>(std::ceil(bounds.x2)) - x, static_cast<int>(std::ceil(bounds.y2)) - y);
+}
+
+// A shape stroked through these points stays inside their box grown by
+// the widest miter join cairo draws at the default miter limit
+void capture_shape_area(const std::vector<std::pair<double, double>>& points) {
+    OverlayBounds bounds;
+    double pad = app_state.line_width * 5.0 + 2.0;
+    for (const auto& point : points) {
+        include_overlay_point(bounds, point.first, point.second, pad);
+    }
+    capture_stroke_area(bounds);
+}
+
 // Ant path timer callback
 gboolean ant_path_timer(gpointer data) {
     app_state.ant_offset += 1.0;
     if (app_state.ant_offset >= 8.0) {
         app_state.ant_offset = 0.0;
     }
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
+
+    if (app_state.has_selection && app_state.selection_is_rect) {
+        queue_rect_outline_redraw(get_selection_outline_bounds());
+    } else {
+        queue_canvas_redraw_area(get_selection_outline_bounds());
     }
+    queue_rect_outline_redraw(get_text_box_bounds());
+    queue_canvas_redraw_area(get_preview_bounds());
     return TRUE;
 }
 
 // Start ant path animation
 void start_ant_animation() {
-    if (app_state.ant_timer_id == 0) {
-        app_state.ant_timer_id = g_timeout_add(50, ant_path_timer, NULL);
-    }
+    app_state.ant_animation_requested = true;
+    update_ant_timer();
+}
+
+void on_window_active_changed(GObject* object, GParamSpec* pspec, gpointer data) {
+    update_ant_timer();
+}
+
+void on_window_map_changed(GtkWidget* widget, gpointer data) {
+    update_ant_timer();
+}
+
+gboolean on_window_state_event(GtkWidget* widget, GdkEventWindowState* event, gpointer data) {
+    app_state.window_iconified = (event->new_window_state &
+        (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN)) != 0;
+    update_ant_timer();
+    return FALSE;
 }
 
 // Draw ant path (marching ants)
@@ -1161,9 +1882,7 @@ void on_text_entry_changed(GtkTextBuffer* buffer, gpointer data) {
     // Update text box size when content changes
     update_text_box_size();
     
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
+    queue_overlay_redraw();
 }
 
 // Font selection callback
@@ -1179,9 +1898,7 @@ void on_font_selected(GtkFontButton* button, gpointer data) {
     // Update text box size when font changes
     update_text_box_size();
     
-    if (app_state.drawing_area) {
-        gtk_widget_queue_draw(app_state.drawing_area);
-    }
+    queue_overlay_redraw();
 }
 
 // Create text input window
@@ -1192,6 +1909,7 @@ void create_text_window(double x, double y) {
     
     app_state.text_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(app_state.text_window), _("Text Tool"));
+    g_signal_connect(app_state.text_window, "notify::is-active", G_CALLBACK(on_window_active_changed), NULL);
     gtk_window_set_default_size(GTK_WINDOW(app_state.text_window), 300, 200);
     gtk_window_set_transient_for(GTK_WINDOW(app_state.text_window), GTK_WINDOW(app_state.window));
     
@@ -1276,152 +1994,450 @@ void update_color_indicators() {
     }
 }
 
-cairo_surface_t* clone_surface(cairo_surface_t* source, int width, int height) {
-    if (!source || width <= 0 || height <= 0) {
-        return nullptr;
-    }
+void push_undo_state() {
+    TraceSpan span("push_undo_state");
+    document_push_undo(app_state.document);
+}
 
-    cairo_surface_t* copy = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cairo_t* cr = cairo_create(copy);
-    cairo_set_source_surface(cr, source, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-    return copy;
+// The floating selection as the document history sees it; the surface is
+// borrowed from app_state
+FloatingSelection get_floating_selection() {
+    FloatingSelection selection;
+    if (app_state.floating_selection_active) {
+        selection.surface = app_state.floating_surface;
+        selection.x1 = app_state.selection_x1;
+        selection.y1 = app_state.selection_y1;
+        selection.x2 = app_state.selection_x2;
+        selection.y2 = app_state.selection_y2;
+        selection.is_rect = app_state.selection_is_rect;
+        selection.path = app_state.selection_path;
+    }
+    return selection;
 }
 
-void push_undo_state() {
-    if (!app_state.surface) {
-        return;
-    }
+// Snapshot only the floating selection before transforming it
+void push_selection_undo_state() {
+    TraceSpan span("push_selection_undo_state");
+    document_push_selection_undo(app_state.document, get_floating_selection());
+}
+
+// Take ownership of a floating selection handed back by undo or redo
+void restore_floating_selection(const FloatingSelection& selection) {
+    queue_overlay_redraw();
+    invalidate_selection_outline_cache();
+
+    app_state.floating_surface = selection.surface;
+    app_state.floating_selection_active = selection.surface != nullptr;
+    app_state.has_selection = selection.surface != nullptr;
+    app_state.floating_drag_completed = false;
+    app_state.dragging_selection = false;
+    app_state.selection_x1 = selection.x1;
+    app_state.selection_y1 = selection.y1;
+    app_state.selection_x2 = selection.x2;
+    app_state.selection_y2 = selection.y2;
+    app_state.selection_is_rect = selection.is_rect;
+    app_state.selection_path = selection.path;
+
+    queue_overlay_redraw();
+}
+
+// Drop overlays tied to the old pixels after the history moved
+void on_history_restored(UndoKind kind, const FloatingSelection& selection) {
+    if (kind == UNDO_NONE) return;
 
-    cairo_surface_t* snapshot = clone_surface(app_state.surface, app_state.canvas_width, app_state.canvas_height);
-    if (!snapshot) {
+    if (kind == UNDO_SELECTION) {
+        restore_floating_selection(selection);
         return;
     }
 
-    UndoSnapshot undo_snapshot;
-    undo_snapshot.surface = snapshot;
-    undo_snapshot.width = app_state.canvas_width;
-    undo_snapshot.height = app_state.canvas_height;
-    app_state.undo_stack.push_back(undo_snapshot);
-    if (app_state.undo_stack.size() > AppState::max_undo_steps) {
-        cairo_surface_destroy(app_state.undo_stack.front().surface);
-        app_state.undo_stack.erase(app_state.undo_stack.begin());
+    clear_selection();
+    if (app_state.text_active) {
+        cancel_text();
     }
+    app_state.drag_undo_snapshot_taken = false;
 
-    for (UndoSnapshot& redo_snapshot : app_state.redo_stack) {
-        cairo_surface_destroy(redo_snapshot.surface);
+    if (app_state.drawing_area) {
+        gtk_widget_set_size_request(
+            app_state.drawing_area,
+            static_cast<int>(app_state.document.width * app_state.zoom_factor),
+            static_cast<int>(app_state.document.height * app_state.zoom_factor)
+        );
     }
-    app_state.redo_stack.clear();
+    invalidate_canvas();
 }
 
 void undo_last_operation() {
-    if (app_state.undo_stack.empty()) {
-        return;
+    FloatingSelection selection = get_floating_selection();
+    UndoKind kind = document_undo(app_state.document, selection);
+    on_history_restored(kind, selection);
+}
+
+void redo_last_operation() {
+    FloatingSelection selection = get_floating_selection();
+    UndoKind kind = document_redo(app_state.document, selection);
+    on_history_restored(kind, selection);
+}
+
+// Initialize drawing surface
+void init_surface(int width, int height) {
+    document_reset(app_state.document, width, height);
+}
+
+// Background jobs
+
+// A unit of work queued on the shared worker pool
+struct PoolTask {
+    std::function<void()> run;
+};
+
+void run_pool_task(gpointer data, gpointer user_data) {
+    PoolTask* task = static_cast<PoolTask*>(data);
+    task->run();
+    delete task;
+}
+
+void init_job_pool() {
+    app_state.job_pool = g_thread_pool_new(run_pool_task, NULL, (gint)g_get_num_processors(), FALSE, NULL);
+}
+
+void push_pool_task(std::function<void()> run) {
+    g_thread_pool_push(app_state.job_pool, new PoolTask{run}, NULL);
+}
+
+// Shared by a parallel_for_rows() caller and the helper tasks it queues
+struct ParallelRows {
+    std::function<void(int, int)> body;
+    int count = 0;
+    int chunk = 1;
+    gint next = 0;
+    gint remaining = 0;
+    GMutex mutex;
+    GCond cond;
+
+    ParallelRows() {
+        g_mutex_init(&mutex);
+        g_cond_init(&cond);
     }
 
-    cairo_surface_t* redo_surface = clone_surface(app_state.surface, app_state.canvas_width, app_state.canvas_height);
-    if (redo_surface) {
-        UndoSnapshot redo_snapshot;
-        redo_snapshot.surface = redo_surface;
-        redo_snapshot.width = app_state.canvas_width;
-        redo_snapshot.height = app_state.canvas_height;
-        app_state.redo_stack.push_back(redo_snapshot);
-        if (app_state.redo_stack.size() > AppState::max_undo_steps) {
-            cairo_surface_destroy(app_state.redo_stack.front().surface);
-            app_state.redo_stack.erase(app_state.redo_stack.begin());
+    ~ParallelRows() {
+        g_mutex_clear(&mutex);
+        g_cond_clear(&cond);
+    }
+};
+
+void process_parallel_rows(ParallelRows& rows) {
+    while (true) {
+        int begin = g_atomic_int_add(&rows.next, rows.chunk);
+        if (begin >= rows.count) return;
+
+        int end = std::min(rows.count, begin + rows.chunk);
+        rows.body(begin, end);
+
+        if (g_atomic_int_add(&rows.remaining, begin - end) == end - begin) {
+            g_mutex_lock(&rows.mutex);
+            g_cond_signal(&rows.cond);
+            g_mutex_unlock(&rows.mutex);
         }
     }
+}
+
+// Run body over [0, count) in chunks shared between the calling thread and
+// idle pool workers. The caller always takes part, so this is safe to use
+// from inside a job even when every worker is busy.
+void parallel_for_rows(int count, const std::function<void(int, int)>& body) {
+    if (count <= 0) return;
 
-    UndoSnapshot snapshot = app_state.undo_stack.back();
-    app_state.undo_stack.pop_back();
+    int workers = app_state.job_pool ? g_thread_pool_get_max_threads(app_state.job_pool) : 1;
+    std::shared_ptr<ParallelRows> rows = std::make_shared<ParallelRows>();
+    rows->body = body;
+    rows->count = count;
+    rows->chunk = std::max(1, count / (workers * 4));
+    rows->remaining = count;
 
-    if (app_state.surface) {
-        cairo_surface_destroy(app_state.surface);
+    int helpers = std::min(workers, (count + rows->chunk - 1) / rows->chunk) - 1;
+    for (int i = 0; i < helpers; i++) {
+        push_pool_task([rows]() { process_parallel_rows(*rows); });
     }
+    process_parallel_rows(*rows);
 
-    app_state.surface = snapshot.surface;
-    app_state.canvas_width = snapshot.width;
-    app_state.canvas_height = snapshot.height;
+    g_mutex_lock(&rows->mutex);
+    while (g_atomic_int_get(&rows->remaining) > 0) {
+        g_cond_wait(&rows->cond, &rows->mutex);
+    }
+    g_mutex_unlock(&rows->mutex);
+}
 
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
+// Long-running operation; run() executes on the worker pool and finish()
+// on the main loop afterwards, whether or not the job was cancelled
+struct CanvasJob {
+    std::string title;
+    GCancellable* cancellable = nullptr;
+    bool can_cancel = true;
+    bool modal = true;
+    gint progress = -1;   // per mille, -1 while unknown
+    gint64 start_time = 0;
+    cairo_surface_t* result_surface = nullptr;   // destroyed unless finish() takes it
+    std::function<void(CanvasJob&)> run;
+    std::function<void(CanvasJob&)> finish;
+};
+
+// Jobs finishing quicker than this never show the progress bar
+const gint64 job_progress_delay_us = 250 * 1000;
+
+bool job_cancelled(CanvasJob& job) {
+    return g_cancellable_is_cancelled(job.cancellable);
+}
+
+void set_job_progress(CanvasJob& job, int done, int total) {
+    if (total <= 0) return;
+    g_atomic_int_set(&job.progress, (gint)((gint64)done * 1000 / total));
+}
+
+// Non-modal jobs keep the canvas scrollable, so instead of a grab the
+// controls that could change the document are made insensitive
+void set_job_controls_locked(bool locked) {
+    GtkWidget* controls[] = {app_state.menubar, app_state.tool_column, app_state.palette_grid};
+    for (GtkWidget* widget : controls) {
+        if (widget) {
+            gtk_widget_set_sensitive(widget, !locked);
+        }
     }
-    app_state.drag_undo_snapshot_taken = false;
+}
 
-    if (app_state.drawing_area) {
-        gtk_widget_set_size_request(
-            app_state.drawing_area,
-            static_cast<int>(app_state.canvas_width * app_state.zoom_factor),
-            static_cast<int>(app_state.canvas_height * app_state.zoom_factor)
-        );
-        gtk_widget_queue_draw(app_state.drawing_area);
+void cancel_active_job() {
+    if (app_state.active_job && app_state.active_job->can_cancel) {
+        g_cancellable_cancel(app_state.active_job->cancellable);
     }
 }
 
-void redo_last_operation() {
-    if (app_state.redo_stack.empty()) {
-        return;
+void on_job_cancel_clicked(GtkButton* button, gpointer data) {
+    cancel_active_job();
+}
+
+gboolean update_job_progress(gpointer data) {
+    CanvasJob* job = app_state.active_job;
+    if (!job) {
+        app_state.job_progress_timer_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+    if (g_get_monotonic_time() - job->start_time < job_progress_delay_us) {
+        return G_SOURCE_CONTINUE;
     }
 
-    cairo_surface_t* undo_surface = clone_surface(app_state.surface, app_state.canvas_width, app_state.canvas_height);
-    if (undo_surface) {
-        UndoSnapshot undo_snapshot;
-        undo_snapshot.surface = undo_surface;
-        undo_snapshot.width = app_state.canvas_width;
-        undo_snapshot.height = app_state.canvas_height;
-        app_state.undo_stack.push_back(undo_snapshot);
-        if (app_state.undo_stack.size() > AppState::max_undo_steps) {
-            cairo_surface_destroy(app_state.undo_stack.front().surface);
-            app_state.undo_stack.erase(app_state.undo_stack.begin());
-        }
+    if (!gtk_widget_get_visible(app_state.job_box)) {
+        gtk_label_set_text(GTK_LABEL(app_state.job_label), job->title.c_str());
+        gtk_widget_set_visible(app_state.job_cancel_button, job->can_cancel);
+        gtk_widget_show(app_state.job_box);
+    }
+
+    int progress = g_atomic_int_get(&job->progress);
+    if (progress < 0) {
+        gtk_progress_bar_pulse(GTK_PROGRESS_BAR(app_state.job_progress_bar));
+    } else {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app_state.job_progress_bar), progress / 1000.0);
     }
+    return G_SOURCE_CONTINUE;
+}
 
-    UndoSnapshot snapshot = app_state.redo_stack.back();
-    app_state.redo_stack.pop_back();
+gboolean on_job_finished(gpointer data) {
+    CanvasJob* job = static_cast<CanvasJob*>(data);
 
-    if (app_state.surface) {
-        cairo_surface_destroy(app_state.surface);
+    if (app_state.job_progress_timer_id) {
+        g_source_remove(app_state.job_progress_timer_id);
+        app_state.job_progress_timer_id = 0;
+    }
+    if (job->modal) {
+        gtk_grab_remove(app_state.job_box);
+    } else {
+        set_job_controls_locked(false);
     }
+    gtk_widget_hide(app_state.job_box);
+    app_state.active_job = nullptr;
+    app_state.perf.last_job_title = job->title;
+    app_state.perf.last_job_ms = (g_get_monotonic_time() - job->start_time) / 1000.0;
 
-    app_state.surface = snapshot.surface;
-    app_state.canvas_width = snapshot.width;
-    app_state.canvas_height = snapshot.height;
+    if (job->finish) {
+        job->finish(*job);
+    }
+    if (job->result_surface) {
+        cairo_surface_destroy(job->result_surface);
+    }
+    g_object_unref(job->cancellable);
+    delete job;
 
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
+    if (app_state.close_after_job && !app_state.active_job) {
+        app_state.close_after_job = false;
+        if (confirm_close()) {
+            gtk_main_quit();
+        }
     }
-    app_state.drag_undo_snapshot_taken = false;
+    return G_SOURCE_REMOVE;
+}
 
-    if (app_state.drawing_area) {
-        gtk_widget_set_size_request(
-            app_state.drawing_area,
-            static_cast<int>(app_state.canvas_width * app_state.zoom_factor),
-            static_cast<int>(app_state.canvas_height * app_state.zoom_factor)
-        );
-        gtk_widget_queue_draw(app_state.drawing_area);
+// Start a job on the worker pool. Input to the rest of the window is held
+// off until finish() has run: by a grab on the progress box, or for a
+// non-modal job by locking the controls while the canvas stays scrollable.
+// Returns false if another job is still active.
+bool start_canvas_job(const char* title, bool can_cancel,
+    std::function<void(CanvasJob&)> run, std::function<void(CanvasJob&)> finish, bool modal = true) {
+    if (app_state.active_job || !app_state.job_pool) return false;
+
+    CanvasJob* job = new CanvasJob();
+    job->title = title;
+    job->cancellable = g_cancellable_new();
+    job->can_cancel = can_cancel;
+    job->modal = modal;
+    job->start_time = g_get_monotonic_time();
+    job->run = run;
+    job->finish = finish;
+
+    app_state.active_job = job;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app_state.job_progress_bar), 0.0);
+    if (modal) {
+        gtk_grab_add(app_state.job_box);
+    } else {
+        set_job_controls_locked(true);
     }
+    app_state.job_progress_timer_id = g_timeout_add(100, update_job_progress, NULL);
+
+    push_pool_task([job]() {
+        TraceSpan span("canvas_job");
+        job->run(*job);
+        g_idle_add(on_job_finished, job);
+    });
+    return true;
 }
 
-// Initialize drawing surface
-void init_surface(GtkWidget* widget) {
-    if (app_state.surface) {
-        cairo_surface_destroy(app_state.surface);
+// Cancel whatever is running and wait for the pool to drain
+void shutdown_job_pool() {
+    cancel_active_job();
+    if (app_state.job_pool) {
+        g_thread_pool_free(app_state.job_pool, FALSE, TRUE);
+        app_state.job_pool = nullptr;
     }
-    
-    app_state.surface = cairo_image_surface_create(
-        CAIRO_FORMAT_ARGB32, 
-        app_state.canvas_width, 
-        app_state.canvas_height
-    );
-    
-    cairo_t* cr = cairo_create(app_state.surface);
-    configure_crisp_rendering(cr);
-    cairo_set_source_rgb(cr, 1, 1, 1);
-    cairo_paint(cr);
-    cairo_destroy(cr);
+}
+
+// Largest width or height decoded by Open as Preview
+const int preview_max_size = 2048;
+
+// Only whole-image steps can be replayed at full size; any other edit,
+// undo or redo since the last recorded step rules the replay out
+bool preview_replayable() {
+    return app_state.preview_open && app_state.document.revision == app_state.preview_revision;
+}
+
+void record_preview_step(const PreviewStep& step, bool replayable) {
+    if (!replayable) return;
+
+    app_state.preview.steps.push_back(step);
+    app_state.preview_revision = app_state.document.revision;
+}
+
+// Swap in a new canvas surface produced by a job
+void replace_canvas_surface(cairo_surface_t* surface, bool reset_overlays) {
+    TraceSpan span("replace_canvas_surface");
+    push_undo_state();
+
+    document_set_surface(app_state.document, surface);
+
+    if (reset_overlays) {
+        clear_selection();
+        if (app_state.text_active) {
+            cancel_text();
+        }
+    }
+
+    gtk_widget_set_size_request(app_state.drawing_area,
+        static_cast<int>(app_state.document.width * app_state.zoom_factor),
+        static_cast<int>(app_state.document.height * app_state.zoom_factor));
+    invalidate_canvas();
+}
+
+// Transform the whole canvas on the worker pool
+void start_canvas_remap_job(const char* title, PixelRemap remap, int new_width, int new_height) {
+    if (!app_state.document.surface) return;
+
+    cairo_surface_t* result = create_pooled_surface_uninitialized(new_width, new_height);
+    if (cairo_surface_status(result) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(result);
+        return;
+    }
+
+    cairo_surface_t* source = cairo_surface_reference(app_state.document.surface);
+    cairo_surface_flush(source);
+    cairo_surface_flush(result);
+
+    SurfaceRemap r = make_surface_remap(remap, source, result);
+
+    bool started = start_canvas_job(title, true,
+        [r, result](CanvasJob& job) {
+            TraceSpan span("remap_pixel_rows");
+            gint rows_done = 0;
+            parallel_for_rows(r.dst_height, [&](int begin, int end) {
+                if (job_cancelled(job)) return;
+                remap_pixel_rows(r, begin, end);
+                int done = g_atomic_int_add(&rows_done, end - begin) + (end - begin);
+                set_job_progress(job, done, r.dst_height);
+            });
+            cairo_surface_mark_dirty(result);
+            job.result_surface = result;
+        },
+        [source, remap, new_width, new_height](CanvasJob& job) {
+            cairo_surface_destroy(source);
+            if (job_cancelled(job) || !job.result_surface) return;
+
+            bool replayable = preview_replayable();
+            replace_canvas_surface(job.result_surface, true);
+            job.result_surface = nullptr;
+
+            PreviewStep step;
+            step.remap = remap;
+            step.width = new_width;
+            step.height = new_height;
+            record_preview_step(step, replayable);
+        });
+
+    if (!started) {
+        cairo_surface_destroy(source);
+        cairo_surface_destroy(result);
+    }
+}
+
+// Grow or crop the canvas on the worker pool, filling new area with the
+// background colour. then() runs on the main loop once the new surface is
+// in place.
+bool start_canvas_resize_job(int new_width, int new_height, bool reset_overlays, std::function<void()> then) {
+    if (!app_state.document.surface) return false;
+
+    cairo_surface_t* source = cairo_surface_reference(app_state.document.surface);
+    RgbaColor bg_color = to_rgba_color(app_state.bg_color);
+
+    bool started = start_canvas_job(_("Resizing image"), true,
+        [source, bg_color, new_width, new_height](CanvasJob& job) {
+            TraceSpan span("resize_canvas");
+            job.result_surface = create_resized_surface(source, new_width, new_height, bg_color);
+        },
+        [source, bg_color, new_width, new_height, reset_overlays, then](CanvasJob& job) {
+            cairo_surface_destroy(source);
+            if (job_cancelled(job) || !job.result_surface) return;
+
+            bool replayable = preview_replayable();
+            replace_canvas_surface(job.result_surface, reset_overlays);
+            job.result_surface = nullptr;
+
+            PreviewStep step;
+            step.resize = true;
+            step.width = new_width;
+            step.height = new_height;
+            step.fill = bg_color;
+            record_preview_step(step, replayable);
+            if (then) then();
+        });
+
+    if (!started) {
+        cairo_surface_destroy(source);
+    }
+    return started;
 }
 
 // Get active color based on mouse button
@@ -1434,45 +2450,34 @@ bool is_transparent_color(const GdkRGBA& color) {
 }
 
 bool point_in_canvas(int x, int y) {
-    return x >= 0 && x < app_state.canvas_width && y >= 0 && y < app_state.canvas_height;
-}
-
-double clamp_color_channel(double channel) {
-    return fmax(0.0, fmin(1.0, channel));
+    return document_contains(app_state.document, x, y);
 }
 
 guint32 rgba_to_pixel(const GdkRGBA& color) {
-    guint8 r = static_cast<guint8>(std::round(clamp_color_channel(color.red) * 255.0));
-    guint8 g = static_cast<guint8>(std::round(clamp_color_channel(color.green) * 255.0));
-    guint8 b = static_cast<guint8>(std::round(clamp_color_channel(color.blue) * 255.0));
-    guint8 a = static_cast<guint8>(std::round(clamp_color_channel(color.alpha) * 255.0));
-    return (static_cast<guint32>(a) << 24) |
-           (static_cast<guint32>(r) << 16) |
-           (static_cast<guint32>(g) << 8) |
-            static_cast<guint32>(b);
+    return (channel_to_byte(color.alpha) << 24) |
+           (channel_to_byte(color.red) << 16) |
+           (channel_to_byte(color.green) << 8) |
+            channel_to_byte(color.blue);
 }
 
 GdkRGBA pixel_to_rgba(guint32 pixel) {
     GdkRGBA color;
-    color.alpha = ((pixel >> 24) & 0xFF) / 255.0;
-    color.red = ((pixel >> 16) & 0xFF) / 255.0;
-    color.green = ((pixel >> 8) & 0xFF) / 255.0;
-    color.blue = (pixel & 0xFF) / 255.0;
+    color.alpha = byte_to_channel((pixel >> 24) & 0xFF);
+    color.red = byte_to_channel((pixel >> 16) & 0xFF);
+    color.green = byte_to_channel((pixel >> 8) & 0xFF);
+    color.blue = byte_to_channel(pixel & 0xFF);
     return color;
 }
 
 guint32 read_pixel(int x, int y) {
-    unsigned char* data = cairo_image_surface_get_data(app_state.surface);
-    int stride = cairo_image_surface_get_stride(app_state.surface);
-    guint32* row = reinterpret_cast<guint32*>(data + y * stride);
-    return row[x];
+    return document_read_pixel(app_state.document, x, y);
 }
 
 
 void pick_color_at(int x, int y, bool set_background) {
     if (!point_in_canvas(x, y)) return;
 
-    cairo_surface_flush(app_state.surface);
+    cairo_surface_flush(app_state.document.surface);
     GdkRGBA sampled = pixel_to_rgba(read_pixel(x, y));
     if (set_background) {
         app_state.bg_color = sampled;
@@ -1482,40 +2487,56 @@ void pick_color_at(int x, int y, bool set_background) {
     update_color_indicators();
 }
 
+// Canvases smaller than this are filled on the main loop; the worker round
+// trip would cost more than the fill
+const gint64 threaded_flood_fill_pixels = 1024 * 1024;
+
+void apply_flood_fill(const FloodFillMask& mask, guint32 replacement) {
+    push_undo_state();
+
+    parallel_for_rows(mask.max_y - mask.min_y + 1, [&](int begin, int end) {
+        apply_flood_fill_rows(app_state.document.surface, mask, replacement, begin, end);
+    });
+
+    cairo_surface_mark_dirty(app_state.document.surface);
+    invalidate_canvas_area(mask.min_x, mask.min_y, mask.max_x - mask.min_x + 1, mask.max_y - mask.min_y + 1);
+}
+
 void flood_fill_at(int start_x, int start_y) {
-    if (!point_in_canvas(start_x, start_y)) return;
+    TraceSpan span("flood_fill_at");
+    if (!point_in_canvas(start_x, start_y) || app_state.active_job) return;
 
-    cairo_surface_flush(app_state.surface);
+    cairo_surface_flush(app_state.document.surface);
     guint32 target = read_pixel(start_x, start_y);
     guint32 replacement = rgba_to_pixel(get_active_color());
     if (target == replacement) return;
 
-    unsigned char* data = cairo_image_surface_get_data(app_state.surface);
-    int stride = cairo_image_surface_get_stride(app_state.surface);
-
-    std::queue<std::pair<int, int>> pixels;
-    pixels.push({start_x, start_y});
-
-    while (!pixels.empty()) {
-        std::pair<int, int> current = pixels.front();
-        pixels.pop();
+    if ((gint64)app_state.document.width * app_state.document.height < threaded_flood_fill_pixels) {
+        FloodFillMask mask;
+        compute_flood_fill(app_state.document.surface, start_x, start_y, target, mask, NULL);
+        apply_flood_fill(mask, replacement);
+        return;
+    }
 
-        int x = current.first;
-        int y = current.second;
+    cairo_surface_t* source = cairo_surface_reference(app_state.document.surface);
+    std::shared_ptr<FloodFillMask> mask = std::make_shared<FloodFillMask>();
 
-        if (!point_in_canvas(x, y)) continue;
+    bool started = start_canvas_job(_("Filling"), true,
+        [source, start_x, start_y, target, mask](CanvasJob& job) {
+            TraceSpan span("compute_flood_fill");
+            compute_flood_fill(source, start_x, start_y, target, *mask, job.cancellable);
+        },
+        [source, replacement, mask](CanvasJob& job) {
+            bool same_surface = source == app_state.document.surface;
+            cairo_surface_destroy(source);
+            if (job_cancelled(job) || !same_surface) return;
 
-        guint32* row = reinterpret_cast<guint32*>(data + y * stride);
-        if (row[x] != target) continue;
+            apply_flood_fill(*mask, replacement);
+        });
 
-        row[x] = replacement;
-        pixels.push({x - 1, y});
-        pixels.push({x + 1, y});
-        pixels.push({x, y - 1});
-        pixels.push({x, y + 1});
+    if (!started) {
+        cairo_surface_destroy(source);
     }
-
-    cairo_surface_mark_dirty(app_state.surface);
 }
 
 // Drawing functions for each tool
@@ -1528,54 +2549,57 @@ void draw_line(cairo_t* cr, double x1, double y1, double x2, double y2) {
     cairo_stroke(cr);
 }
 
+// The closed shapes skip cairo's path filler and paint spans straight into
+// the target surface in the active colour. With antialiasing off both
+// cover the same pixel centres.
+void paint_shape_outline(cairo_t* cr, const ShapeOutline& outline, FillRule rule) {
+    cairo_surface_t* surface = cairo_get_target(cr);
+    cairo_surface_flush(surface);
+    fill_spans(surface, rasterize_outline(outline, rule), rgba_to_pixel(get_active_color()));
+    cairo_surface_mark_dirty(surface);
+}
+
+// Rectangle outlines are the ring between the shape grown and shrunk by
+// half the line width, filled with even-odd
 void draw_rectangle(cairo_t* cr, double x1, double y1, double x2, double y2, bool filled) {
-    GdkRGBA color = get_active_color();
-    cairo_set_source_rgba(cr, color.red, color.green, color.blue, color.alpha);
-    
     double x = fmin(x1, x2);
     double y = fmin(y1, y2);
     double w = fabs(x2 - x1);
     double h = fabs(y2 - y1);
-    
-    cairo_rectangle(cr, x, y, w, h);
-    
+
+    ShapeOutline outline = create_surface_outline(cairo_get_target(cr));
     if (filled) {
-        cairo_fill(cr);
+        outline_add_rectangle(outline, x, y, w, h);
     } else {
-        cairo_set_line_width(cr, app_state.line_width);
-        cairo_stroke(cr);
+        // Square corners, as cairo's miter joins draw them
+        double half = app_state.line_width / 2.0;
+        outline_add_rectangle(outline, x - half, y - half, w + 2 * half, h + 2 * half);
+        outline_add_rectangle(outline, x + half, y + half, w - 2 * half, h - 2 * half);
     }
+    paint_shape_outline(cr, outline, FILL_RULE_EVEN_ODD);
 }
 
 void draw_ellipse(cairo_t* cr, double x1, double y1, double x2, double y2, bool filled) {
-    GdkRGBA color = get_active_color();
-    cairo_set_source_rgba(cr, color.red, color.green, color.blue, color.alpha);
-    
     double cx = (x1 + x2) / 2.0;
     double cy = (y1 + y2) / 2.0;
     double rx = fabs(x2 - x1) / 2.0;
     double ry = fabs(y2 - y1) / 2.0;
     
     if (rx < 0.1 || ry < 0.1) return;
-    
-    cairo_save(cr);
-    cairo_translate(cr, cx, cy);
-    cairo_scale(cr, rx, ry);
-    cairo_arc(cr, 0, 0, 1, 0, 2 * M_PI);
-    cairo_restore(cr);
-    
+
+    // The offset of an ellipse is no ellipse, so its outline is stroked
+    // along a flattened copy instead of filled as a ring
+    ShapeOutline outline = create_surface_outline(cairo_get_target(cr));
     if (filled) {
-        cairo_fill(cr);
+        outline_add_ellipse(outline, cx, cy, rx, ry);
+        paint_shape_outline(cr, outline, FILL_RULE_EVEN_ODD);
     } else {
-        cairo_set_line_width(cr, app_state.line_width);
-        cairo_stroke(cr);
+        outline_add_ellipse_stroke(outline, cx, cy, rx, ry, app_state.line_width);
+        paint_shape_outline(cr, outline, FILL_RULE_NONZERO);
     }
 }
 
 void draw_rounded_rectangle(cairo_t* cr, double x1, double y1, double x2, double y2, bool filled) {
-    GdkRGBA color = get_active_color();
-    cairo_set_source_rgba(cr, color.red, color.green, color.blue, color.alpha);
-    
     double x = fmin(x1, x2);
     double y = fmin(y1, y2);
     double w = fabs(x2 - x1);
@@ -1583,34 +2607,25 @@ void draw_rounded_rectangle(cairo_t* cr, double x1, double y1, double x2, double
     double r = fmin(w, h) * 0.1;
     
     if (w < 1 || h < 1) return;
-    
-    cairo_arc(cr, x + r, y + r, r, M_PI, 3 * M_PI / 2);
-    cairo_arc(cr, x + w - r, y + r, r, 3 * M_PI / 2, 0);
-    cairo_arc(cr, x + w - r, y + h - r, r, 0, M_PI / 2);
-    cairo_arc(cr, x + r, y + h - r, r, M_PI / 2, M_PI);
-    cairo_close_path(cr);
-    
+
+    ShapeOutline outline = create_surface_outline(cairo_get_target(cr));
     if (filled) {
-        cairo_fill(cr);
+        outline_add_rounded_rectangle(outline, x, y, w, h, r);
     } else {
-        cairo_set_line_width(cr, app_state.line_width);
-        cairo_stroke(cr);
+        // The corners stay concentric arcs on both sides of the line
+        double half = app_state.line_width / 2.0;
+        outline_add_rounded_rectangle(outline, x - half, y - half, w + 2 * half, h + 2 * half, r + half);
+        outline_add_rounded_rectangle(outline, x + half, y + half, w - 2 * half, h - 2 * half, r - half);
     }
+    paint_shape_outline(cr, outline, FILL_RULE_EVEN_ODD);
 }
 
 void draw_polygon(cairo_t* cr, const std::vector<std::pair<double, double>>& points) {
     if (points.size() < 2) return;
 
-    GdkRGBA color = get_active_color();
-    cairo_set_source_rgba(cr, color.red, color.green, color.blue, color.alpha);
-    cairo_set_line_width(cr, app_state.line_width);
-
-    cairo_move_to(cr, points[0].first, points[0].second);
-    for (size_t i = 1; i < points.size(); i++) {
-        cairo_line_to(cr, points[i].first, points[i].second);
-    }
-    cairo_close_path(cr);
-    cairo_stroke(cr);
+    ShapeOutline outline = create_surface_outline(cairo_get_target(cr));
+    outline_add_polygon_stroke(outline, points, app_state.line_width);
+    paint_shape_outline(cr, outline, FILL_RULE_NONZERO);
 }
 
 void draw_curve(cairo_t* cr, double start_x, double start_y, double control_x, double control_y, double end_x, double end_y) {
@@ -1625,26 +2640,18 @@ void draw_curve(cairo_t* cr, double start_x, double start_y, double control_x, d
 void draw_pencil(cairo_t* cr, double x, double y) {
     GdkRGBA color = get_active_color();
     cairo_set_source_rgba(cr, color.red, color.green, color.blue, color.alpha);
-    cairo_set_line_width(cr, 1.0);
-    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
     
     if (app_state.last_x != 0 && app_state.last_y != 0) {
-        cairo_move_to(cr, app_state.last_x, app_state.last_y);
-        cairo_line_to(cr, x, y);
-        cairo_stroke(cr);
+        stroke_segment(cr, app_state.last_x, app_state.last_y, x, y, 1.0);
     }
 }
 
 void draw_paintbrush(cairo_t* cr, double x, double y) {
     GdkRGBA color = get_active_color();
     cairo_set_source_rgba(cr, color.red, color.green, color.blue, color.alpha);
-    cairo_set_line_width(cr, app_state.line_width * 2);
-    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
     
     if (app_state.last_x != 0 && app_state.last_y != 0) {
-        cairo_move_to(cr, app_state.last_x, app_state.last_y);
-        cairo_line_to(cr, x, y);
-        cairo_stroke(cr);
+        stroke_segment(cr, app_state.last_x, app_state.last_y, x, y, app_state.line_width * 2);
     }
 }
 
@@ -1665,13 +2672,9 @@ void draw_airbrush(cairo_t* cr, double x, double y) {
 
 void draw_eraser(cairo_t* cr, double x, double y) {
     cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-    cairo_set_line_width(cr, app_state.line_width * 3);
-    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
 
     if (app_state.last_x != 0 && app_state.last_y != 0) {
-        cairo_move_to(cr, app_state.last_x, app_state.last_y);
-        cairo_line_to(cr, x, y);
-        cairo_stroke(cr);
+        stroke_segment(cr, app_state.last_x, app_state.last_y, x, y, app_state.line_width * 3);
     }
 
     cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
@@ -1687,96 +2690,78 @@ void draw_text_overlay(cairo_t* cr) {
                    app_state.text_box_width, app_state.text_box_height);
     cairo_stroke(cr);
     
-    // Draw text preview
+    // Draw text preview, clipped to the box. The glyphs are blended into a
+    // box-sized surface that is kept until the text, font, colour or box
+    // changes, so ant ticks and scrolling only repaint it.
     if (!app_state.text_content.empty()) {
-        cairo_select_font_face(cr, app_state.text_font_family.c_str(), 
-                              CAIRO_FONT_SLANT_NORMAL, 
-                              CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(cr, app_state.text_font_size);
-        cairo_set_source_rgba(cr, 
-            app_state.fg_color.red,
-            app_state.fg_color.green,
-            app_state.fg_color.blue,
-            app_state.fg_color.alpha
-        );
-        
-        // Simple preview (first line)
-        std::string text = app_state.text_content;
-        double y = app_state.text_y + app_state.text_font_size + 5;
-        double x = app_state.text_x + 5;
-        
-        cairo_text_extents_t extents;
-        std::string word;
-        std::string line;
-        
-        for (size_t i = 0; i <= text.length(); i++) {
-            if (i == text.length() || text[i] == ' ' || text[i] == '\n') {
-                if (!word.empty()) {
-                    std::string test_line = line.empty() ? word : line + " " + word;
-                    cairo_text_extents(cr, test_line.c_str(), &extents);
-                    
-                    if (extents.width > app_state.text_box_width - 10) {
-                        if (!line.empty()) {
-                            cairo_move_to(cr, x, y);
-                            cairo_show_text(cr, line.c_str());
-                            y += app_state.text_font_size + 2;
-                            line = word;
-                        } else {
-                            cairo_move_to(cr, x, y);
-                            cairo_show_text(cr, word.c_str());
-                            y += app_state.text_font_size + 2;
-                            line.clear();
-                        }
-                    } else {
-                        line = test_line;
-                    }
-                    word.clear();
-                }
-                
-                if (i < text.length() && text[i] == '\n') {
-                    if (!line.empty()) {
-                        cairo_move_to(cr, x, y);
-                        cairo_show_text(cr, line.c_str());
-                        y += app_state.text_font_size + 2;
-                        line.clear();
-                    }
-                }
-                
-                if (y > app_state.text_y + app_state.text_box_height) break;
-            } else {
-                word += text[i];
-            }
-        }
-        
-        if (!line.empty() && y <= app_state.text_y + app_state.text_box_height) {
-            cairo_move_to(cr, x, y);
-            cairo_show_text(cr, line.c_str());
+        PangoLayout* layout = get_text_layout();
+        TextPreviewKey key;
+        key.layout_serial = pango_layout_get_serial(layout);
+        key.color = rgba_to_pixel(app_state.fg_color);
+        key.x = app_state.text_x;
+        key.y = app_state.text_y;
+        key.width = static_cast<int>(std::ceil(app_state.text_box_width)) + 1;
+        key.height = static_cast<int>(std::ceil(app_state.text_box_height)) + 1;
+
+        double left = std::floor(app_state.text_x);
+        double top = std::floor(app_state.text_y);
+        const TextPreviewKey& cached = app_state.text_preview_key;
+        if (!app_state.text_preview_surface || cached.layout_serial != key.layout_serial ||
+            cached.color != key.color || cached.x != key.x || cached.y != key.y ||
+            cached.width != key.width || cached.height != key.height) {
+            invalidate_text_preview();
+            app_state.text_preview_surface = create_pooled_surface(key.width, key.height);
+            app_state.text_preview_key = key;
+            blit_text_layout(app_state.text_preview_surface, layout,
+                text_layout_origin_x() - left, text_layout_origin_y(layout) - top, key.color);
         }
+
+        cairo_save(cr);
+        cairo_rectangle(cr, app_state.text_x, app_state.text_y,
+                       app_state.text_box_width, app_state.text_box_height);
+        cairo_clip(cr);
+        cairo_set_source_surface(cr, app_state.text_preview_surface, left, top);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+        cairo_paint(cr);
+        cairo_restore(cr);
     }
 }
 
 // Draw selection overlay
 void draw_selection_overlay(cairo_t* cr) {
     if (!app_state.has_selection) return;
-    
+    if (!app_state.selection_is_rect && app_state.selection_path.size() <= 1) return;
+
     draw_ant_path(cr);
-    
-    if (app_state.selection_is_rect) {
-        double x1 = fmin(app_state.selection_x1, app_state.selection_x2);
-        double y1 = fmin(app_state.selection_y1, app_state.selection_y2);
-        double x2 = fmax(app_state.selection_x1, app_state.selection_x2);
-        double y2 = fmax(app_state.selection_y1, app_state.selection_y2);
-        
-        cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
-        cairo_stroke(cr);
-    } else if (app_state.selection_path.size() > 1) {
-        cairo_move_to(cr, app_state.selection_path[0].first, app_state.selection_path[0].second);
-        for (size_t i = 1; i < app_state.selection_path.size(); i++) {
-            cairo_line_to(cr, app_state.selection_path[i].first, app_state.selection_path[i].second);
+
+    // Only the dash offset changes between animation ticks, so the outline
+    // path is rebuilt only when the selection geometry changes.
+    SelectionOutlineKey key = get_selection_outline_key();
+    if (!app_state.selection_outline_path || !selection_outline_keys_equal(key, app_state.selection_outline_key)) {
+        invalidate_selection_outline_cache();
+
+        cairo_new_path(cr);
+        if (app_state.selection_is_rect) {
+            double x1 = fmin(app_state.selection_x1, app_state.selection_x2);
+            double y1 = fmin(app_state.selection_y1, app_state.selection_y2);
+            double x2 = fmax(app_state.selection_x1, app_state.selection_x2);
+            double y2 = fmax(app_state.selection_y1, app_state.selection_y2);
+
+            cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
+        } else {
+            cairo_move_to(cr, app_state.selection_path[0].first, app_state.selection_path[0].second);
+            for (size_t i = 1; i < app_state.selection_path.size(); i++) {
+                cairo_line_to(cr, app_state.selection_path[i].first, app_state.selection_path[i].second);
+            }
+            cairo_close_path(cr);
         }
-        cairo_close_path(cr);
-        cairo_stroke(cr);
+        app_state.selection_outline_path = cairo_copy_path(cr);
+        app_state.selection_outline_key = key;
+    } else {
+        cairo_new_path(cr);
+        cairo_append_path(cr, app_state.selection_outline_path);
     }
+    cairo_stroke(cr);
 }
 
 void draw_black_outline_circle(cairo_t* cr, double x, double y, double radius) {
@@ -1794,13 +2779,7 @@ void draw_hover_indicator(cairo_t* cr) {
     }
 
     if (tool_shows_brush_hover_outline(app_state.current_tool) && !app_state.is_drawing) {
-        double radius = app_state.line_width;
-        if (app_state.current_tool == TOOL_ERASER) {
-            radius = app_state.line_width * 1.5;
-        } else if (app_state.current_tool == TOOL_AIRBRUSH) {
-            radius = app_state.line_width * 5.0;
-        }
-        draw_black_outline_circle(cr, app_state.hover_x, app_state.hover_y, radius);
+        draw_black_outline_circle(cr, app_state.hover_x, app_state.hover_y, get_hover_outline_radius());
         return;
     }
 
@@ -1818,22 +2797,11 @@ void draw_preview(cairo_t* cr) {
     if (app_state.dragging_selection) return;
 
     cairo_save(cr);
-    
-    double preview_x = app_state.current_x;
-    double preview_y = app_state.current_y;
-    
-    if (app_state.shift_pressed && !app_state.ellipse_center_mode) {
-        if (app_state.current_tool == TOOL_LINE) {
-            constrain_line(app_state.start_x, app_state.start_y, preview_x, preview_y);
-        } else if (app_state.current_tool == TOOL_ELLIPSE) {
-            constrain_to_circle(app_state.start_x, app_state.start_y, preview_x, preview_y);
-        } else if (app_state.current_tool == TOOL_RECTANGLE ||
-                   app_state.current_tool == TOOL_ROUNDED_RECT ||
-                   app_state.current_tool == TOOL_RECT_SELECT) {
-            constrain_to_square(app_state.start_x, app_state.start_y, preview_x, preview_y);
-        }
-    }
-    
+
+    double preview_x;
+    double preview_y;
+    get_constrained_preview_point(preview_x, preview_y);
+
     switch (app_state.current_tool) {
         case TOOL_CURVE: {
             if (app_state.curve_active) {
@@ -2020,76 +2988,427 @@ void draw_canvas_grid_background(cairo_t* cr, double width, double height) {
         cairo_rectangle(pattern_cr, checker_size, checker_size, checker_size, checker_size);
         cairo_fill(pattern_cr);
 
-        cairo_destroy(pattern_cr);
+        cairo_destroy(pattern_cr);
+
+        checker_pattern = cairo_pattern_create_for_surface(pattern_surface);
+        cairo_pattern_set_extend(checker_pattern, CAIRO_EXTEND_REPEAT);
+        cairo_pattern_set_filter(checker_pattern, CAIRO_FILTER_NEAREST);
+        cairo_surface_destroy(pattern_surface);
+    }
+
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, 0, width, height);
+    cairo_set_source(cr, checker_pattern);
+    cairo_fill(cr);
+    cairo_restore(cr);
+}
+
+// Checkerboard and canvas pixels at the current zoom, without overlays
+void draw_canvas_composite(cairo_t* cr) {
+    draw_canvas_grid_background(
+        cr,
+        app_state.document.width * app_state.zoom_factor,
+        app_state.document.height * app_state.zoom_factor
+    );
+
+    cairo_save(cr);
+    cairo_scale(cr, app_state.zoom_factor, app_state.zoom_factor);
+    cairo_set_source_surface(cr, app_state.document.surface, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+    cairo_paint(cr);
+    cairo_restore(cr);
+}
+
+// Zoomed canvases larger than this many device pixels are composited
+// directly instead of being kept in the composite cache
+const double max_composite_cache_pixels = 16.0 * 1024.0 * 1024.0;
+
+void release_composite_cache() {
+    if (app_state.composite_cache) {
+        cairo_surface_destroy(app_state.composite_cache);
+        app_state.composite_cache = nullptr;
+    }
+    if (app_state.composite_dirty) {
+        cairo_region_destroy(app_state.composite_dirty);
+        app_state.composite_dirty = nullptr;
+    }
+}
+
+// Paint the base canvas layer, recompositing only the parts of the cache
+// whose pixels changed since the last frame.
+void paint_canvas_composite(cairo_t* cr) {
+    int width = static_cast<int>(std::ceil(app_state.document.width * app_state.zoom_factor));
+    int height = static_cast<int>(std::ceil(app_state.document.height * app_state.zoom_factor));
+
+    if (static_cast<double>(width) * height > max_composite_cache_pixels) {
+        release_composite_cache();
+        draw_canvas_composite(cr);
+        return;
+    }
+
+    if (!app_state.composite_cache ||
+        cairo_image_surface_get_width(app_state.composite_cache) != width ||
+        cairo_image_surface_get_height(app_state.composite_cache) != height) {
+        release_composite_cache();
+        // The checkerboard is opaque, so the composite never needs alpha.
+        app_state.composite_cache = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+        cairo_rectangle_int_t full = {0, 0, width, height};
+        app_state.composite_dirty = cairo_region_create_rectangle(&full);
+    }
+
+    if (!cairo_region_is_empty(app_state.composite_dirty)) {
+        cairo_t* cache_cr = cairo_create(app_state.composite_cache);
+        configure_crisp_rendering(cache_cr);
+        gdk_cairo_region(cache_cr, app_state.composite_dirty);
+        cairo_clip(cache_cr);
+        draw_canvas_composite(cache_cr);
+        cairo_destroy(cache_cr);
+
+        cairo_region_destroy(app_state.composite_dirty);
+        app_state.composite_dirty = cairo_region_create();
+    }
+
+    cairo_set_source_surface(cr, app_state.composite_cache, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+    cairo_paint(cr);
+}
+
+// Floating selection, marching ants, text, shape previews and hover markers
+void draw_canvas_overlays(cairo_t* cr) {
+    if (app_state.floating_selection_active && app_state.floating_surface) {
+        double x = std::round(fmin(app_state.selection_x1, app_state.selection_x2));
+        double y = std::round(fmin(app_state.selection_y1, app_state.selection_y2));
+
+        cairo_set_source_surface(cr, app_state.floating_surface, x, y);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+        cairo_paint(cr);
+    }
+
+    // Draw active selection
+    if (app_state.has_selection) {
+        draw_selection_overlay(cr);
+    }
+
+    // Draw text overlay
+    if (app_state.text_active) {
+        draw_text_overlay(cr);
+    }
+
+    // Draw preview if needed
+    if (tool_needs_preview(app_state.current_tool)) {
+        draw_preview(cr);
+    }
+    draw_hover_indicator(cr);
+}
+
+// Performance HUD
+
+const size_t perf_sample_capacity = 120;
+
+void record_perf_sample(PerfSamples& samples, double value) {
+    if (samples.values.size() < perf_sample_capacity) {
+        samples.values.push_back(value);
+    } else {
+        samples.values[samples.next] = value;
+    }
+    samples.next = (samples.next + 1) % perf_sample_capacity;
+}
+
+double perf_sample_percentile(const PerfSamples& samples, double percentile) {
+    if (samples.values.empty()) return 0;
+
+    std::vector<double> sorted(samples.values);
+    size_t index = std::min(sorted.size() - 1, (size_t)(percentile * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+}
+
+size_t surface_byte_size(cairo_surface_t* surface) {
+    if (!surface) return 0;
+    return (size_t)cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+}
+
+size_t snapshot_stack_byte_size(const std::vector<UndoSnapshot>& stack) {
+    size_t total = 0;
+    for (const UndoSnapshot& snapshot : stack) {
+        total += undo_snapshot_byte_size(snapshot);
+    }
+    return total;
+}
+
+// Keep the HUD pinned to the top-left corner of the visible canvas
+GdkRectangle get_perf_hud_area() {
+    GdkRectangle area = {0, 0, 300, 116};
+    if (app_state.scrolled_window) {
+        GtkScrolledWindow* scrolled = GTK_SCROLLED_WINDOW(app_state.scrolled_window);
+        area.x = (int)gtk_adjustment_get_value(gtk_scrolled_window_get_hadjustment(scrolled));
+        area.y = (int)gtk_adjustment_get_value(gtk_scrolled_window_get_vadjustment(scrolled));
+    }
+    return area;
+}
 
-        checker_pattern = cairo_pattern_create_for_surface(pattern_surface);
-        cairo_pattern_set_extend(checker_pattern, CAIRO_EXTEND_REPEAT);
-        cairo_pattern_set_filter(checker_pattern, CAIRO_FILTER_NEAREST);
-        cairo_surface_destroy(pattern_surface);
+void draw_perf_hud(cairo_t* cr) {
+    GdkRectangle area = get_perf_hud_area();
+    app_state.perf_hud_area = area;
+
+    const PerfStats& perf = app_state.perf;
+    double mb = 1024.0 * 1024.0;
+    char lines[6][96];
+    std::snprintf(lines[0], sizeof(lines[0]), "frame ms  p50 %.2f  p95 %.2f  p99 %.2f",
+        perf_sample_percentile(perf.frame_ms, 0.50),
+        perf_sample_percentile(perf.frame_ms, 0.95),
+        perf_sample_percentile(perf.frame_ms, 0.99));
+    std::snprintf(lines[1], sizeof(lines[1]), "input->draw ms  p50 %.2f  p95 %.2f",
+        perf_sample_percentile(perf.input_latency_ms, 0.50),
+        perf_sample_percentile(perf.input_latency_ms, 0.95));
+    std::snprintf(lines[2], sizeof(lines[2]), "composite ms  %.2f", perf.composite_ms);
+    std::snprintf(lines[3], sizeof(lines[3]), "undo %.1f MB  redo %.1f MB  pool %.1f MB",
+        snapshot_stack_byte_size(app_state.document.undo_stack) / mb,
+        snapshot_stack_byte_size(app_state.document.redo_stack) / mb,
+        surface_pool_idle_bytes() / mb);
+    std::snprintf(lines[4], sizeof(lines[4]), "clipboard %.1f MB  floating %.1f MB",
+        surface_byte_size(app_state.clipboard_surface) / mb,
+        surface_byte_size(app_state.floating_surface) / mb);
+    if (perf.last_job_title.empty()) {
+        std::snprintf(lines[5], sizeof(lines[5]), "last operation  -");
+    } else {
+        std::snprintf(lines[5], sizeof(lines[5]), "last operation  %s %.0f ms",
+            perf.last_job_title.c_str(), perf.last_job_ms);
     }
 
     cairo_save(cr);
-    cairo_rectangle(cr, 0, 0, width, height);
-    cairo_set_source(cr, checker_pattern);
+    cairo_rectangle(cr, area.x, area.y, area.width, area.height);
+    cairo_set_source_rgba(cr, 0, 0, 0, 0.7);
     cairo_fill(cr);
+
+    cairo_select_font_face(cr, "Monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 11);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    for (int i = 0; i < 6; i++) {
+        cairo_move_to(cr, area.x + 8, area.y + 18 + i * 17);
+        cairo_show_text(cr, lines[i]);
+    }
     cairo_restore(cr);
 }
 
+// Refresh the HUD figures a few times a second without repainting the canvas
+gboolean perf_hud_tick(gpointer data) {
+    if (!app_state.perf_hud_visible || !app_state.drawing_area) {
+        app_state.perf_hud_timer_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    GdkRectangle area = get_perf_hud_area();
+    gtk_widget_queue_draw_area(app_state.drawing_area, area.x, area.y, area.width, area.height);
+    return G_SOURCE_CONTINUE;
+}
+
+void toggle_perf_hud() {
+    app_state.perf_hud_visible = !app_state.perf_hud_visible;
+    if (app_state.perf_hud_visible && !app_state.perf_hud_timer_id) {
+        app_state.perf_hud_timer_id = g_timeout_add(250, perf_hud_tick, NULL);
+    }
+    app_state.perf.pending_input_time = 0;
+
+    GdkRectangle area = app_state.perf_hud_visible ? get_perf_hud_area() : app_state.perf_hud_area;
+    if (app_state.drawing_area) {
+        gtk_widget_queue_draw_area(app_state.drawing_area, area.x, area.y, area.width, area.height);
+    }
+}
+
+// Scrolling moves the HUD, so repaint the whole view while it is shown
+void on_canvas_scrolled(GtkAdjustment* adjustment, gpointer data) {
+    if (app_state.perf_hud_visible && app_state.drawing_area) {
+        gtk_widget_queue_draw(app_state.drawing_area);
+    }
+}
+
 // Canvas draw callback
 gboolean on_draw(GtkWidget* widget, cairo_t* cr, gpointer data) {
-    if (app_state.surface) {
-        configure_crisp_rendering(cr);
+    TraceSpan span("on_draw");
+    gint64 frame_start = g_get_monotonic_time();
 
-        draw_canvas_grid_background(
-            cr,
-            app_state.canvas_width * app_state.zoom_factor,
-            app_state.canvas_height * app_state.zoom_factor
-        );
+    if (app_state.document.surface) {
+        configure_crisp_rendering(cr);
+        paint_canvas_composite(cr);
+        gint64 composite_end = g_get_monotonic_time();
 
         cairo_save(cr);
         cairo_scale(cr, app_state.zoom_factor, app_state.zoom_factor);
+        draw_canvas_overlays(cr);
+        cairo_restore(cr);
 
-//        draw_canvas_grid_background(cr);
-
-        cairo_set_source_surface(cr, app_state.surface, 0, 0);
-        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
-        cairo_paint(cr);
+        if (app_state.perf_hud_visible) {
+            gint64 frame_end = g_get_monotonic_time();
 
-        if (app_state.floating_selection_active && app_state.floating_surface) {
-		    double x = std::round(fmin(app_state.selection_x1, app_state.selection_x2));
-		    double y = std::round(fmin(app_state.selection_y1, app_state.selection_y2));
+            // Frames that only refresh the HUD itself would skew the figures
+            GdkRectangle hud = get_perf_hud_area();
+            double clip_x1, clip_y1, clip_x2, clip_y2;
+            cairo_clip_extents(cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+            bool hud_only = clip_x1 >= hud.x && clip_y1 >= hud.y &&
+                clip_x2 <= hud.x + hud.width && clip_y2 <= hud.y + hud.height;
 
-            cairo_set_source_surface(cr, app_state.floating_surface, x, y);
-            cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
-            cairo_paint(cr);
-        }
-        
-        // Draw active selection
-        if (app_state.has_selection) {
-            draw_selection_overlay(cr);
-        }
-        
-        // Draw text overlay
-        if (app_state.text_active) {
-            draw_text_overlay(cr);
-        }
-        
-        // Draw preview if needed
-        if (tool_needs_preview(app_state.current_tool)) {
-            draw_preview(cr);
+            if (!hud_only) {
+                app_state.perf.composite_ms = (composite_end - frame_start) / 1000.0;
+                record_perf_sample(app_state.perf.frame_ms, (frame_end - frame_start) / 1000.0);
+            }
+            if (app_state.perf.pending_input_time) {
+                record_perf_sample(app_state.perf.input_latency_ms,
+                    (frame_end - app_state.perf.pending_input_time) / 1000.0);
+                app_state.perf.pending_input_time = 0;
+            }
+            draw_perf_hud(cr);
         }
-        draw_hover_indicator(cr);
-        cairo_restore(cr);
     }
+    trace_first_frame();
     return FALSE;
 }
 
+// Input recording, for replaying stroke-handling problems with --replay
+
+// On-disk record, stored little-endian; state records capture the tool,
+// thickness, zoom and colours before the event that follows them
+struct InputRecord {
+    guint8 type;
+    guint8 button;      // mouse button, or the tool for state records
+    guint8 reserved[2];
+    guint32 state;      // modifier mask, or thickness | zoom index << 8
+    gint64 time_us;     // since the first recorded event
+    gint32 x;           // widget coordinates in 1/256 px
+    gint32 y;
+    guint32 keyval;     // key, or foreground colour
+    guint32 extra;      // background colour for state records
+};
+static_assert(sizeof(InputRecord) == 32, "input records are written as-is");
+
+enum InputRecordType {
+    INPUT_BUTTON_PRESS = 1,
+    INPUT_BUTTON_RELEASE,
+    INPUT_MOTION,
+    INPUT_KEY_PRESS,
+    INPUT_KEY_RELEASE,
+    INPUT_STATE
+};
+
+const char input_trace_magic[8] = {'M', 'P', 'I', 'N', 'P', 'U', 'T', '1'};
+
+// Header: magic, then canvas and viewport size as four little-endian int32
+struct InputRecorder {
+    FILE* file = nullptr;
+    bool header_written = false;
+    gint64 start_time = 0;
+    InputRecord last_state = {};
+};
+
+InputRecorder input_recorder;
+
+void input_record_to_le(InputRecord& record) {
+    record.state = GUINT32_TO_LE(record.state);
+    record.time_us = GINT64_TO_LE(record.time_us);
+    record.x = GINT32_TO_LE(record.x);
+    record.y = GINT32_TO_LE(record.y);
+    record.keyval = GUINT32_TO_LE(record.keyval);
+    record.extra = GUINT32_TO_LE(record.extra);
+}
+
+void input_record_from_le(InputRecord& record) {
+    record.state = GUINT32_FROM_LE(record.state);
+    record.time_us = GINT64_FROM_LE(record.time_us);
+    record.x = GINT32_FROM_LE(record.x);
+    record.y = GINT32_FROM_LE(record.y);
+    record.keyval = GUINT32_FROM_LE(record.keyval);
+    record.extra = GUINT32_FROM_LE(record.extra);
+}
+
+bool start_input_recording(const char* path) {
+    input_recorder.file = g_fopen(path, "wb");
+    if (!input_recorder.file) {
+        g_printerr(_("Could not write input recording %s\n"), path);
+        return false;
+    }
+    return true;
+}
+
+void stop_input_recording() {
+    if (input_recorder.file) {
+        std::fclose(input_recorder.file);
+        input_recorder.file = nullptr;
+    }
+}
+
+void write_input_record(InputRecord record) {
+    input_record_to_le(record);
+    std::fwrite(&record, sizeof(record), 1, input_recorder.file);
+}
+
+void record_input_event(guint8 type, double x, double y, guint button, guint modifiers, guint keyval) {
+    if (!input_recorder.file) return;
+
+    if (!input_recorder.header_written) {
+        GtkAllocation viewport = {0, 0, 0, 0};
+        if (app_state.scrolled_window) {
+            gtk_widget_get_allocation(app_state.scrolled_window, &viewport);
+        }
+        gint32 sizes[4] = {
+            GINT32_TO_LE(app_state.document.width),
+            GINT32_TO_LE(app_state.document.height),
+            GINT32_TO_LE(viewport.width),
+            GINT32_TO_LE(viewport.height)
+        };
+        std::fwrite(input_trace_magic, sizeof(input_trace_magic), 1, input_recorder.file);
+        std::fwrite(sizes, sizeof(sizes), 1, input_recorder.file);
+        input_recorder.start_time = g_get_monotonic_time();
+        input_recorder.header_written = true;
+    }
+
+    gint64 now = g_get_monotonic_time() - input_recorder.start_time;
+
+    // Tool and colour changes are not events, so snapshot them when they differ
+    InputRecord state = {};
+    state.type = INPUT_STATE;
+    state.button = (guint8)app_state.current_tool;
+    state.state = (guint32)app_state.active_line_thickness_index | ((guint32)app_state.active_zoom_index << 8);
+    state.keyval = rgba_to_pixel(app_state.fg_color);
+    state.extra = rgba_to_pixel(app_state.bg_color);
+    const InputRecord& last = input_recorder.last_state;
+    if (last.type != INPUT_STATE || last.button != state.button || last.state != state.state ||
+        last.keyval != state.keyval || last.extra != state.extra) {
+        state.time_us = now;
+        write_input_record(state);
+        input_recorder.last_state = state;
+    }
+
+    InputRecord record = {};
+    record.type = type;
+    record.button = (guint8)button;
+    record.state = modifiers;
+    record.time_us = now;
+    record.x = (gint32)std::lround(x * 256.0);
+    record.y = (gint32)std::lround(y * 256.0);
+    record.keyval = keyval;
+    write_input_record(record);
+}
+
 // Key press event
 gboolean on_key_press(GtkWidget* widget, GdkEventKey* event, gpointer data) {
-    if (event->keyval == GDK_KEY_Shift_L || event->keyval == GDK_KEY_Shift_R) {
+    // Keyboard shortcuts stay off while a background job owns the canvas
+    if (app_state.active_job) {
+        if (event->keyval == GDK_KEY_Escape) {
+            cancel_active_job();
+        }
+        return TRUE;
+    }
+
+    record_input_event(INPUT_KEY_PRESS, 0, 0, 0, event->state, event->keyval);
+
+    if (event->keyval == GDK_KEY_F12) {
+        toggle_perf_hud();
+    } else if ((event->state & GDK_CONTROL_MASK) && (event->state & GDK_SHIFT_MASK) && event->keyval == GDK_KEY_T) {
+        write_trace_file();
+    } else if (event->keyval == GDK_KEY_Shift_L || event->keyval == GDK_KEY_Shift_R) {
         app_state.shift_pressed = true;
         if (app_state.is_drawing && app_state.drawing_area) {
-            gtk_widget_queue_draw(app_state.drawing_area);
+            queue_overlay_redraw();
         }
     } else if ((event->state & GDK_CONTROL_MASK) && event->keyval == GDK_KEY_c) {
         copy_selection();
@@ -2109,10 +3428,12 @@ gboolean on_key_press(GtkWidget* widget, GdkEventKey* event, gpointer data) {
 
 // Key release event
 gboolean on_key_release(GtkWidget* widget, GdkEventKey* event, gpointer data) {
+    record_input_event(INPUT_KEY_RELEASE, 0, 0, 0, event->state, event->keyval);
+
     if (event->keyval == GDK_KEY_Shift_L || event->keyval == GDK_KEY_Shift_R) {
         app_state.shift_pressed = false;
         if (app_state.is_drawing && app_state.drawing_area) {
-            gtk_widget_queue_draw(app_state.drawing_area);
+            queue_overlay_redraw();
         }
     }
     return FALSE;
@@ -2120,7 +3441,12 @@ gboolean on_key_release(GtkWidget* widget, GdkEventKey* event, gpointer data) {
 
 // Mouse button press
 gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data) {
-    if ((event->button == 1 || event->button == 3) && app_state.surface) {
+    // The canvas can be scrolled but not edited while an image streams in
+    if (app_state.active_job) return TRUE;
+
+    record_input_event(INPUT_BUTTON_PRESS, event->x, event->y, event->button, event->state, 0);
+
+    if ((event->button == 1 || event->button == 3) && app_state.document.surface) {
         double canvas_x = to_canvas_coordinate(event->x);
         double canvas_y = to_canvas_coordinate(event->y);
 
@@ -2173,7 +3499,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                     
                     create_text_window(canvas_x, canvas_y);
                     start_ant_animation();
-                    gtk_widget_queue_draw(widget);
+                    queue_overlay_redraw();
                 }
                 return TRUE;
             }
@@ -2211,9 +3537,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
         }
 
         if (app_state.current_tool == TOOL_FILL) {
-            push_undo_state();
             flood_fill_at(static_cast<int>(canvas_x), static_cast<int>(canvas_y));
-            gtk_widget_queue_draw(widget);
             return TRUE;
         }
 
@@ -2224,7 +3548,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                     app_state.current_x = canvas_x;
                     app_state.current_y = canvas_y;
                     app_state.is_drawing = true;
-                    gtk_widget_queue_draw(widget);
+                    queue_overlay_redraw();
                     return TRUE;
                 }
 
@@ -2235,13 +3559,13 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                 app_state.current_x = canvas_x;
                 app_state.current_y = canvas_y;
                 start_ant_animation();
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
                 return TRUE;
             }
 
             if (event->button == 3 && app_state.lasso_polygon_mode) {
                 finalize_lasso_selection();
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
                 return TRUE;
             }
         }
@@ -2249,18 +3573,20 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
         if (app_state.current_tool == TOOL_POLYGON) {
             if (event->button == 1) {
                 if (app_state.polygon_finished) {
-                    push_undo_state();
+                    document_begin_stroke(app_state.document);
+                    capture_shape_area(app_state.polygon_points);
                     app_state.is_right_button = false;
-                    cairo_t* cr = cairo_create(app_state.surface);
+                    cairo_t* cr = cairo_create(app_state.document.surface);
                     configure_crisp_rendering(cr);
                     draw_polygon(cr, app_state.polygon_points);
                     cairo_destroy(cr);
+                    document_end_stroke(app_state.document);
 
                     app_state.polygon_points.clear();
                     app_state.polygon_finished = false;
                     app_state.is_drawing = false;
                     stop_ant_animation();
-                    gtk_widget_queue_draw(widget);
+                    invalidate_canvas();
                     return TRUE;
                 }
 
@@ -2269,7 +3595,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                 app_state.current_x = canvas_x;
                 app_state.current_y = canvas_y;
                 start_ant_animation();
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
                 return TRUE;
             }
 
@@ -2278,40 +3604,43 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                     app_state.polygon_finished = true;
                     app_state.is_drawing = true;
                 } else if (app_state.polygon_finished) {
-                    push_undo_state();
-                    cairo_t* cr = cairo_create(app_state.surface);
+                    document_begin_stroke(app_state.document);
+                    capture_shape_area(app_state.polygon_points);
+                    cairo_t* cr = cairo_create(app_state.document.surface);
                     configure_crisp_rendering(cr);
                     draw_polygon(cr, app_state.polygon_points);
                     cairo_destroy(cr);
+                    document_end_stroke(app_state.document);
                     app_state.polygon_points.clear();
                     app_state.polygon_finished = false;
                     app_state.is_drawing = false;
                     stop_ant_animation();
                 }
 
-                gtk_widget_queue_draw(widget);
+                invalidate_canvas();
                 return TRUE;
             }
         }
 
         if (app_state.current_tool == TOOL_ELLIPSE && app_state.ellipse_center_mode && event->button == 1) {
-            push_undo_state();
-
             double radius = std::hypot(canvas_x - app_state.start_x, canvas_y - app_state.start_y);
             double x1 = app_state.start_x - radius;
             double y1 = app_state.start_y - radius;
             double x2 = app_state.start_x + radius;
             double y2 = app_state.start_y + radius;
 
-            cairo_t* cr = cairo_create(app_state.surface);
+            document_begin_stroke(app_state.document);
+            capture_shape_area({{x1, y1}, {x2, y2}});
+            cairo_t* cr = cairo_create(app_state.document.surface);
             configure_crisp_rendering(cr);
             draw_ellipse(cr, x1, y1, x2, y2, false);
             cairo_destroy(cr);
+            document_end_stroke(app_state.document);
 
             app_state.ellipse_center_mode = false;
             app_state.is_drawing = false;
             stop_ant_animation();
-            gtk_widget_queue_draw(widget);
+            invalidate_canvas();
             return TRUE;
         }
 
@@ -2325,7 +3654,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
             app_state.current_x = canvas_x;
             app_state.current_y = canvas_y;
             start_ant_animation();
-            gtk_widget_queue_draw(widget);
+            queue_overlay_redraw();
             return TRUE;
         }
         
@@ -2341,14 +3670,25 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                 app_state.current_x = canvas_x;
                 app_state.current_y = canvas_y;
                 start_ant_animation();
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
                 return TRUE;
             }
 
             bool used_primary_button = ((event->button == 3) == app_state.curve_primary_right_button);
             if (!used_primary_button) {
                 if (app_state.curve_has_end) {
-                    cairo_t* cr = cairo_create(app_state.surface);
+                    // The curve stays inside the box of its start, end and control point
+                    std::vector<std::pair<double, double>> curve_points = {
+                        {app_state.curve_start_x, app_state.curve_start_y},
+                        {app_state.curve_end_x, app_state.curve_end_y}
+                    };
+                    if (app_state.curve_has_control) {
+                        curve_points.push_back({app_state.curve_control_x, app_state.curve_control_y});
+                    }
+                    document_begin_stroke(app_state.document);
+                    capture_shape_area(curve_points);
+
+                    cairo_t* cr = cairo_create(app_state.document.surface);
                     configure_crisp_rendering(cr);
 
                     app_state.is_right_button = app_state.curve_primary_right_button;
@@ -2373,6 +3713,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                     }
 
                     cairo_destroy(cr);
+                    document_end_stroke(app_state.document);
                 }
 
                 app_state.curve_active = false;
@@ -2381,7 +3722,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                 app_state.is_drawing = false;
                 app_state.is_right_button = false;
                 stop_ant_animation();
-                gtk_widget_queue_draw(widget);
+                invalidate_canvas();
                 return TRUE;
             }
 
@@ -2390,7 +3731,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                 app_state.curve_start_y = canvas_y;
                 app_state.current_x = canvas_x;
                 app_state.current_y = canvas_y;
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
                 return TRUE;
             }
 
@@ -2399,7 +3740,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
                 app_state.curve_end_y = canvas_y;
                 app_state.current_x = canvas_x;
                 app_state.current_y = canvas_y;
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
                 return TRUE;
             }
 
@@ -2416,7 +3757,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
             app_state.is_drawing = true;
             app_state.current_x = canvas_x;
             app_state.current_y = canvas_y;
-            gtk_widget_queue_draw(widget);
+            queue_overlay_redraw();
             return TRUE;
         }
 
@@ -2426,7 +3767,7 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
             app_state.current_tool == TOOL_LINE || app_state.current_tool == TOOL_CURVE ||
 			app_state.current_tool == TOOL_RECTANGLE || app_state.current_tool == TOOL_ELLIPSE ||
             app_state.current_tool == TOOL_ROUNDED_RECT) {
-            push_undo_state();
+            document_begin_stroke(app_state.document);
         }
         app_state.last_x = canvas_x;
         app_state.last_y = canvas_y;
@@ -2436,23 +3777,34 @@ gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data
         app_state.current_y = canvas_y;
         
         if (app_state.current_tool == TOOL_AIRBRUSH) {
-            cairo_t* cr = cairo_create(app_state.surface);
+            OverlayBounds spray_bounds = get_stroke_segment_bounds(canvas_x, canvas_y);
+            capture_stroke_area(spray_bounds);
+            cairo_t* cr = cairo_create(app_state.document.surface);
             configure_crisp_rendering(cr);
             draw_airbrush(cr, canvas_x, canvas_y);
             cairo_destroy(cr);
-            gtk_widget_queue_draw(widget);
+            invalidate_canvas_bounds(spray_bounds);
         }
         
         if (tool_needs_preview(app_state.current_tool)) {
             start_ant_animation();
         }
+        queue_overlay_redraw();
     }
     return TRUE;
 }
 
 // Mouse motion
 gboolean on_motion_notify(GtkWidget* widget, GdkEventMotion* event, gpointer data) {
-    if (app_state.surface) {
+    if (app_state.active_job) return TRUE;
+
+    TraceSpan span("on_motion_notify");
+    record_input_event(INPUT_MOTION, event->x, event->y, 0, event->state, 0);
+    if (app_state.perf_hud_visible && !app_state.perf.pending_input_time) {
+        app_state.perf.pending_input_time = g_get_monotonic_time();
+    }
+
+    if (app_state.document.surface) {
         double canvas_x = to_canvas_coordinate(event->x);
         double canvas_y = to_canvas_coordinate(event->y);
         app_state.hover_in_canvas = true;
@@ -2463,7 +3815,7 @@ gboolean on_motion_notify(GtkWidget* widget, GdkEventMotion* event, gpointer dat
         if (!app_state.is_drawing) {
             if (tool_shows_brush_hover_outline(app_state.current_tool) ||
                 tool_shows_vertex_hover_markers(app_state.current_tool)) {
-                gtk_widget_queue_draw(widget);
+                queue_overlay_redraw();
             }
             return TRUE;
         }
@@ -2494,14 +3846,17 @@ gboolean on_motion_notify(GtkWidget* widget, GdkEventMotion* event, gpointer dat
                 }
             }
 
-            gtk_widget_queue_draw(widget);
+            queue_overlay_redraw();
         } else if (app_state.current_tool == TOOL_LASSO_SELECT && !app_state.lasso_polygon_mode) {
             app_state.lasso_points.push_back({canvas_x, canvas_y});
-            gtk_widget_queue_draw(widget);
+            queue_overlay_redraw();
         } else if (tool_needs_preview(app_state.current_tool)) {
-            gtk_widget_queue_draw(widget);
+            queue_overlay_redraw();
         } else {
-            cairo_t* cr = cairo_create(app_state.surface);
+            OverlayBounds stroke_bounds = get_stroke_segment_bounds(canvas_x, canvas_y);
+            capture_stroke_area(stroke_bounds);
+
+            cairo_t* cr = cairo_create(app_state.document.surface);
             configure_crisp_rendering(cr);
             switch (app_state.current_tool) {
                 case TOOL_PENCIL:
@@ -2521,7 +3876,7 @@ gboolean on_motion_notify(GtkWidget* widget, GdkEventMotion* event, gpointer dat
             cairo_destroy(cr);
             app_state.last_x = canvas_x;
             app_state.last_y = canvas_y;
-            gtk_widget_queue_draw(widget);
+            invalidate_canvas_bounds(stroke_bounds);
         }
     }
     return TRUE;
@@ -2531,14 +3886,18 @@ gboolean on_leave_notify(GtkWidget* widget, GdkEventCrossing* event, gpointer da
     if (app_state.hover_in_canvas) {
         app_state.hover_in_canvas = false;
         update_cursor_position_label(0.0, 0.0, false);
-        gtk_widget_queue_draw(widget);
+        queue_overlay_redraw();
     }
     return TRUE;
 }
 
 // Mouse button release
 gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpointer data) {
-    if ((event->button == 1 || event->button == 3) && app_state.surface && app_state.is_drawing) {
+    if (app_state.active_job) return TRUE;
+
+    record_input_event(INPUT_BUTTON_RELEASE, event->x, event->y, event->button, event->state, 0);
+
+    if ((event->button == 1 || event->button == 3) && app_state.document.surface && app_state.is_drawing) {
         if (app_state.current_tool == TOOL_ELLIPSE && app_state.ellipse_center_mode) {
             return TRUE;
         }
@@ -2560,7 +3919,7 @@ gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpointer da
             app_state.is_drawing = false;
             app_state.floating_drag_completed = true;
             commit_floating_selection(false);
-            gtk_widget_queue_draw(widget);
+            queue_overlay_redraw();
             return TRUE;
         }
 
@@ -2579,24 +3938,33 @@ gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpointer da
             }
         }
         
-        cairo_t* cr = cairo_create(app_state.surface);
+        bool canvas_changed = false;
+        cairo_t* cr = cairo_create(app_state.document.surface);
         configure_crisp_rendering(cr);        
         switch (app_state.current_tool) {
             case TOOL_LINE:
+                capture_shape_area({{app_state.start_x, app_state.start_y}, {end_x, end_y}});
                 draw_line(cr, app_state.start_x, app_state.start_y, end_x, end_y);
                 stop_ant_animation();
+                canvas_changed = true;
                 break;
             case TOOL_RECTANGLE:
+                capture_shape_area({{app_state.start_x, app_state.start_y}, {end_x, end_y}});
                 draw_rectangle(cr, app_state.start_x, app_state.start_y, end_x, end_y, false);
                 stop_ant_animation();
+                canvas_changed = true;
                 break;
             case TOOL_ELLIPSE:
+                capture_shape_area({{app_state.start_x, app_state.start_y}, {end_x, end_y}});
                 draw_ellipse(cr, app_state.start_x, app_state.start_y, end_x, end_y, false);
                 stop_ant_animation();
+                canvas_changed = true;
                 break;
             case TOOL_ROUNDED_RECT:
+                capture_shape_area({{app_state.start_x, app_state.start_y}, {end_x, end_y}});
                 draw_rounded_rectangle(cr, app_state.start_x, app_state.start_y, end_x, end_y, false);
                 stop_ant_animation();
+                canvas_changed = true;
                 break;
             case TOOL_RECT_SELECT:
                 app_state.has_selection = true;
@@ -2613,12 +3981,17 @@ gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpointer da
         }
         
         cairo_destroy(cr);
+        document_end_stroke(app_state.document);
         app_state.is_drawing = false;
         app_state.is_right_button = false;
         app_state.ellipse_center_mode = false;
         app_state.last_x = 0;
         app_state.last_y = 0;
-        gtk_widget_queue_draw(widget);
+        if (canvas_changed) {
+            invalidate_canvas();
+        } else {
+            queue_overlay_redraw();
+        }
     }
     return TRUE;
 }
@@ -2657,6 +4030,24 @@ void save_image_dialog(GtkWidget* parent) {
     gtk_file_filter_add_pattern(filter_xpm, "*.xpm");
     gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter_xpm);
 
+    // Uncompressed, or nearly so: much faster to write than PNG
+    GtkFileFilter* filter_qoi = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter_qoi, _("QOI Images"));
+    gtk_file_filter_add_pattern(filter_qoi, "*.qoi");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter_qoi);
+
+    GtkFileFilter* filter_bmp = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter_bmp, _("BMP Images"));
+    gtk_file_filter_add_pattern(filter_bmp, "*.bmp");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter_bmp);
+
+    GtkFileFilter* filter_pam = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter_pam, _("Netpbm Images (PAM, PNM)"));
+    gtk_file_filter_add_pattern(filter_pam, "*.pam");
+    gtk_file_filter_add_pattern(filter_pam, "*.pnm");
+    gtk_file_filter_add_pattern(filter_pam, "*.ppm");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter_pam);
+
     if (!app_state.current_filename.empty()) {
         gtk_file_chooser_set_filename(GTK_FILE_CHOOSER(dialog), app_state.current_filename.c_str());
     } else {
@@ -2668,15 +4059,12 @@ void save_image_dialog(GtkWidget* parent) {
 
         if (filename) {
             std::string fname(filename);
-            size_t dot_pos = fname.find_last_of('.');
-            std::string extension = (dot_pos == std::string::npos) ? "" : fname.substr(dot_pos + 1);
-            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
-            if (extension != "png") {
+            if (!is_save_format(get_file_extension_lowercase(fname))) {
                 fname += ".png";
             }
 
             app_state.current_filename = fname;
-            cairo_surface_write_to_png(app_state.surface, fname.c_str());
+            start_save_job(fname);
 
             g_free(filename);
         }
@@ -2685,62 +4073,516 @@ void save_image_dialog(GtkWidget* parent) {
     gtk_widget_destroy(dialog);
 }
 
-std::string get_file_extension_lowercase(const std::string& filename) {
-    size_t dot_pos = filename.find_last_of('.');
-    if (dot_pos == std::string::npos || dot_pos + 1 >= filename.size()) {
-        return "";
+// Remember the current canvas as the saved state of filename, which is
+// empty for a canvas that has never been written
+void mark_document_saved(const std::string& filename) {
+    app_state.saved_hash = document_content_hash(app_state.document);
+    app_state.saved_filename = filename;
+}
+
+// Only tiles changed since the last call are hashed, so this is cheap
+// enough to run on every save and quit
+bool document_modified() {
+    return document_content_hash(app_state.document) != app_state.saved_hash;
+}
+
+// Once edits rule out replaying a preview's steps on the full-size file,
+// saving writes the reduced canvas; ask before doing that
+bool confirm_preview_save(const std::string& filename) {
+    if (!app_state.preview_open || preview_replayable()) return true;
+
+    GtkWidget* dialog = gtk_message_dialog_new(
+        GTK_WINDOW(app_state.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_WARNING,
+        GTK_BUTTONS_NONE,
+        "%s", _("Save the reduced-size preview?")
+    );
+    gchar* details = g_strdup_printf(
+        _("The image was opened as a preview of a %dx%d original. Edits other than Rotate, Flip, "
+          "Scale Image and Resize Image cannot be applied at full size, so it will be saved at %dx%d."),
+        app_state.preview.source_width, app_state.preview.source_height,
+        app_state.document.width, app_state.document.height);
+    if (filename == app_state.preview.path) {
+        gchar* replaced = g_strconcat(details, " ", _("This replaces the full-size original."), NULL);
+        g_free(details);
+        details = replaced;
+    }
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), "%s", details);
+    g_free(details);
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog),
+        _("_Cancel"), GTK_RESPONSE_CANCEL,
+        _("Save _Reduced Image"), GTK_RESPONSE_ACCEPT,
+        NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_CANCEL);
+    int response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    return response == GTK_RESPONSE_ACCEPT;
+}
+
+// Encode a snapshot of the canvas on the worker pool. A preview canvas
+// whose steps can still be replayed is saved from the full-size file.
+void start_save_job(const std::string& filename) {
+    if (!app_state.document.surface || app_state.replaying || !confirm_preview_save(filename)) return;
+
+    cairo_surface_t* surface = cairo_surface_reference(app_state.document.surface);
+    cairo_surface_flush(surface);
+    bool full_size = preview_replayable();
+    PreviewRecipe recipe = app_state.preview;
+    guint64 hash = document_content_hash(app_state.document);
+    std::shared_ptr<bool> saved = std::make_shared<bool>(false);
+
+    bool started = start_canvas_job(_("Saving"), false,
+        [surface, filename, full_size, recipe, saved](CanvasJob& job) {
+            if (full_size) {
+                TraceSpan span("render_preview_recipe");
+                job.result_surface = render_preview_recipe(recipe, job.cancellable);
+            }
+            TraceSpan span("save_surface_to_file");
+            *saved = save_surface_to_file(job.result_surface ? job.result_surface : surface, filename,
+                parallel_for_rows);
+        },
+        [surface, filename, hash, saved](CanvasJob& job) {
+            cairo_surface_destroy(surface);
+            if (!*saved) {
+                g_printerr(_("Could not save %s\n"), filename.c_str());
+                app_state.quit_after_save = false;
+                return;
+            }
+
+            app_state.saved_hash = hash;
+            app_state.saved_filename = filename;
+            reset_autosave_journal();
+            if (app_state.quit_after_save) {
+                gtk_main_quit();
+            }
+        });
+
+    if (!started) {
+        cairo_surface_destroy(surface);
+    }
+}
+
+// An image being decoded on the worker pool. The canvas switches to its
+// surface as soon as the size is known and shows bands of rows as they
+// arrive, so large files can be looked at before decoding finishes.
+struct ImageStream {
+    cairo_surface_t* surface = nullptr;
+    int source_width = 0;     // full size, read from the file header
+    int source_height = 0;
+    bool installed = false;   // main loop only
+    GMutex mutex;
+    int dirty_y1 = 0;         // rows decoded since the last redraw
+    int dirty_y2 = 0;
+    bool redraw_queued = false;
+
+    ImageStream() {
+        g_mutex_init(&mutex);
+    }
+
+    ~ImageStream() {
+        g_mutex_clear(&mutex);
+        if (surface) {
+            cairo_surface_destroy(surface);
+        }
     }
+};
 
-    std::string extension = filename.substr(dot_pos + 1);
-    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) {
-        return static_cast<char>(std::tolower(ch));
-    });
-    return extension;
+gboolean install_image_stream(gpointer data) {
+    std::unique_ptr<std::shared_ptr<ImageStream>> stream(static_cast<std::shared_ptr<ImageStream>*>(data));
+    if (!app_state.active_job) return G_SOURCE_REMOVE;
+
+    replace_canvas_surface(cairo_surface_reference((*stream)->surface), false);
+    (*stream)->installed = true;
+    return G_SOURCE_REMOVE;
 }
 
-bool save_surface_to_file(cairo_surface_t* surface, const std::string& filename) {
-    if (!surface || filename.empty()) {
-        return false;
+gboolean redraw_image_stream_rows(gpointer data) {
+    std::unique_ptr<std::shared_ptr<ImageStream>> holder(static_cast<std::shared_ptr<ImageStream>*>(data));
+    ImageStream& stream = **holder;
+
+    g_mutex_lock(&stream.mutex);
+    int y1 = stream.dirty_y1;
+    int y2 = stream.dirty_y2;
+    stream.redraw_queued = false;
+    g_mutex_unlock(&stream.mutex);
+
+    if (stream.installed && app_state.document.surface == stream.surface && y1 < y2) {
+        cairo_surface_mark_dirty_rectangle(stream.surface, 0, y1, app_state.document.width, y2 - y1);
+        invalidate_canvas_area(0, y1, app_state.document.width, y2 - y1);
     }
+    return G_SOURCE_REMOVE;
+}
 
-    std::string extension = get_file_extension_lowercase(filename);
-    if (extension == "jpg" || extension == "jpeg" || extension == "xpm") {
-        cairo_surface_t* rgb_surface = cairo_image_surface_create(
-            CAIRO_FORMAT_RGB24,
-            app_state.canvas_width,
-            app_state.canvas_height
-        );
-        cairo_t* cr = cairo_create(rgb_surface);
-        configure_crisp_rendering(cr);
-        cairo_set_source_surface(cr, surface, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+// Decode an image on the worker pool and make it the canvas. With
+// max_size set, large images open as a scaled-down preview.
+void start_load_job(const std::string& filename, int max_size) {
+    std::shared_ptr<ImageStream> stream = std::make_shared<ImageStream>();
 
-        std::string temp_png = filename + ".temp.png";
-        cairo_surface_write_to_png(rgb_surface, temp_png.c_str());
-        cairo_surface_destroy(rgb_surface);
+    start_canvas_job(_("Opening"), true,
+        [filename, max_size, stream](CanvasJob& job) {
+            TraceSpan span("load_image");
+            if (max_size > 0) {
+                gdk_pixbuf_get_file_info(filename.c_str(), &stream->source_width, &stream->source_height);
+            }
 
-        GError* error = NULL;
-        GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(temp_png.c_str(), &error);
-        bool save_success = false;
-        if (pixbuf) {
-            if (extension == "xpm") {
-                save_success = gdk_pixbuf_save(pixbuf, filename.c_str(), "xpm", &error, NULL);
-            } else {
-                save_success = gdk_pixbuf_save(pixbuf, filename.c_str(), "jpeg", &error, "quality", "95", NULL);
+            ImageStreamSink sink;
+            sink.started = [stream](cairo_surface_t* surface) {
+                stream->surface = cairo_surface_reference(surface);
+                g_idle_add(install_image_stream, new std::shared_ptr<ImageStream>(stream));
+            };
+            sink.rows = [stream](int y, int height) {
+                g_mutex_lock(&stream->mutex);
+                if (stream->redraw_queued) {
+                    stream->dirty_y1 = std::min(stream->dirty_y1, y);
+                    stream->dirty_y2 = std::max(stream->dirty_y2, y + height);
+                } else {
+                    stream->dirty_y1 = y;
+                    stream->dirty_y2 = y + height;
+                    stream->redraw_queued = true;
+                    g_idle_add(redraw_image_stream_rows, new std::shared_ptr<ImageStream>(stream));
+                }
+                g_mutex_unlock(&stream->mutex);
+            };
+            sink.progress = [&job](goffset bytes_read, goffset file_size) {
+                if (file_size > 0) {
+                    set_job_progress(job, (int)(bytes_read * 1000 / file_size), 1000);
+                }
+            };
+            job.result_surface = stream_surface_from_file(filename, sink, job.cancellable, max_size);
+        },
+        [filename, stream](CanvasJob& job) {
+            if (job_cancelled(job) || !job.result_surface) {
+                // Put back the canvas a partly decoded image replaced
+                if (stream->installed && app_state.document.surface == stream->surface) {
+                    document_revert(app_state.document);
+                    on_history_restored(UNDO_CANVAS, FloatingSelection());
+                }
+                return;
+            }
+
+            if (!stream->installed || app_state.document.surface != job.result_surface) {
+                replace_canvas_surface(job.result_surface, false);
+                job.result_surface = nullptr;
+            }
+
+            app_state.preview_open = stream->source_width > app_state.document.width ||
+                stream->source_height > app_state.document.height;
+            // The name only changes once the image has decoded. A preview
+            // gets none: saving over the original would lose its full-size
+            // pixels once edits rule out the replay, so ask for a new name.
+            app_state.current_filename = app_state.preview_open ? std::string() : filename;
+            if (app_state.preview_open) {
+                app_state.preview = PreviewRecipe();
+                app_state.preview.path = filename;
+                app_state.preview.source_width = stream->source_width;
+                app_state.preview.source_height = stream->source_height;
+                app_state.preview.preview_width = app_state.document.width;
+                app_state.preview.preview_height = app_state.document.height;
+                app_state.preview_revision = app_state.document.revision;
             }
-            g_object_unref(pixbuf);
+            mark_document_saved(app_state.preview_open ? std::string() : filename);
+            invalidate_canvas();
+        }, false);
+}
+
+// Decode of the file named on the command line. It is started on the
+// worker pool before the window is built, and the window waits for it just
+// before it is first shown, so the first paint already has the image.
+struct StartupImage {
+    std::string filename;
+    cairo_surface_t* surface = nullptr;
+    bool done = false;
+    GMutex mutex;
+    GCond cond;
+
+    StartupImage() {
+        g_mutex_init(&mutex);
+        g_cond_init(&cond);
+    }
+
+    ~StartupImage() {
+        g_mutex_clear(&mutex);
+        g_cond_clear(&cond);
+        if (surface) {
+            cairo_surface_destroy(surface);
+        }
+    }
+};
+
+std::shared_ptr<StartupImage> start_startup_image_load(const std::string& filename) {
+    std::shared_ptr<StartupImage> image = std::make_shared<StartupImage>();
+    image->filename = filename;
+
+    push_pool_task([image]() {
+        TraceSpan span("startup_image_load");
+        cairo_surface_t* surface = load_surface_from_file(image->filename);
+
+        g_mutex_lock(&image->mutex);
+        image->surface = surface;
+        image->done = true;
+        g_cond_signal(&image->cond);
+        g_mutex_unlock(&image->mutex);
+    });
+    return image;
+}
+
+// Wait for the startup decode and make it the initial canvas
+void finish_startup_image_load(StartupImage& image) {
+    TraceSpan span("finish_startup_image_load");
+    g_mutex_lock(&image.mutex);
+    while (!image.done) {
+        g_cond_wait(&image.cond, &image.mutex);
+    }
+    g_mutex_unlock(&image.mutex);
+
+    if (!image.surface) {
+        g_printerr(_("Could not open %s\n"), image.filename.c_str());
+        return;
+    }
+
+    document_set_surface(app_state.document, image.surface);
+    image.surface = nullptr;
+    app_state.current_filename = image.filename;
+    mark_document_saved(image.filename);
+    gtk_widget_set_size_request(app_state.drawing_area,
+        static_cast<int>(app_state.document.width * app_state.zoom_factor),
+        static_cast<int>(app_state.document.height * app_state.zoom_factor));
+    invalidate_canvas();
+}
+
+// Autosave. Every few seconds the tiles changed since the last record are
+// copied off the canvas and appended to a journal in the user cache
+// directory by a pool worker. At most autosave_max_tiles are taken per
+// tick, which bounds both the copy on the main loop and the write rate.
+// A new journal is started on the first change, after a size change, once
+// the old one outgrows the canvas, and after a save. Its full frame is
+// written to a ".tmp" file beside the old journal a part per tick, and
+// only replaces it once the frame is complete. The journal is removed on
+// a clean exit; one left behind by a process that is no longer running is
+// offered for recovery at startup.
+const guint autosave_interval_seconds = 5;
+const size_t autosave_max_tiles = 256;   // 4 MB of 64x64 tiles
+const size_t autosave_frame_max_tiles = 1024;   // 16 MB while writing a full frame
+const gint64 autosave_min_compact_bytes = 64 * 1024 * 1024;
+
+std::string get_autosave_dir() {
+    gchar* dir = g_build_filename(g_get_user_cache_dir(), "mate-paint", NULL);
+    std::string result = dir;
+    g_free(dir);
+    return result;
+}
+
+std::string get_autosave_frame_path(const std::string& journal_path) {
+    return journal_path + ".tmp";
+}
+
+void release_recovered_journal() {
+    if (app_state.autosave_recovered_path.empty()) return;
+    g_remove(app_state.autosave_recovered_path.c_str());
+    g_remove(get_autosave_frame_path(app_state.autosave_recovered_path).c_str());
+    app_state.autosave_recovered_path.clear();
+}
+
+gboolean on_autosave_written(gpointer data) {
+    bool ok = GPOINTER_TO_INT(data) != 0;
+    app_state.autosave_writing = false;
+    if (ok) {
+        app_state.autosave_journal_bytes += app_state.autosave_pending_bytes;
+        if (app_state.autosave_frame_pending) {
+            release_recovered_journal();
+        }
+    } else {
+        // The tiles in the failed record are no longer marked dirty
+        app_state.autosave_needs_full = true;
+    }
+    if (app_state.autosave_reset_pending) {
+        reset_autosave_journal();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+gboolean autosave_tick(gpointer data) {
+    const Document& doc = app_state.document;
+    if (app_state.active_job || app_state.autosave_writing || !doc.surface ||
+        (document_journal_clean(doc) && !app_state.autosave_needs_full)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    TraceSpan span("autosave_tick");
+    gint64 canvas_bytes = (gint64)doc.width * doc.height * sizeof(guint32);
+    bool restart = app_state.autosave_needs_full || (!app_state.autosave_rebuilding &&
+        (app_state.autosave_restart ||
+         app_state.autosave_journal_bytes > std::max(autosave_min_compact_bytes, 2 * canvas_bytes)));
+    size_t max_tiles = restart || app_state.autosave_rebuilding ? autosave_frame_max_tiles : autosave_max_tiles;
+    std::shared_ptr<JournalRecord> record = std::make_shared<JournalRecord>(
+        document_take_journal_record(app_state.document, max_tiles, restart));
+    if (record->tiles.empty()) return G_SOURCE_CONTINUE;
+
+    gint64 bytes = 0;
+    for (const UndoTile& tile : record->tiles) {
+        bytes += tile.pixels.size() * sizeof(guint32);
+    }
+    if (record->full) {
+        app_state.autosave_journal_bytes = 0;
+        app_state.autosave_rebuilding = true;
+    }
+    bool rebuilding = app_state.autosave_rebuilding;
+    if (record->complete) {
+        app_state.autosave_rebuilding = false;
+    }
+    app_state.autosave_pending_bytes = bytes;
+    app_state.autosave_frame_pending = rebuilding && record->complete;
+    app_state.autosave_needs_full = false;
+    app_state.autosave_restart = false;
+    app_state.autosave_writing = true;
+
+    std::string path = app_state.autosave_path;
+    push_pool_task([record, path, rebuilding]() {
+        TraceSpan span("write_journal_record");
+        std::string frame_path = get_autosave_frame_path(path);
+        bool ok = write_journal_record(rebuilding ? frame_path : path, *record, record->full);
+        if (ok && rebuilding && record->complete) {
+            ok = g_rename(frame_path.c_str(), path.c_str()) == 0;
+        }
+        g_idle_add(on_autosave_written, GINT_TO_POINTER(ok ? 1 : 0));
+    });
+    return G_SOURCE_CONTINUE;
+}
+
+void start_autosave() {
+    std::string dir = get_autosave_dir();
+    if (g_mkdir_with_parents(dir.c_str(), 0700) != 0) return;
+
+    gchar* name = g_strdup_printf("autosave-%d.journal", (int)getpid());
+    gchar* path = g_build_filename(dir.c_str(), name, NULL);
+    app_state.autosave_path = path;
+    g_free(path);
+    g_free(name);
+
+    app_state.autosave_timer_id = g_timeout_add_seconds(autosave_interval_seconds, autosave_tick, NULL);
+}
+
+// Call once the pool has drained, so no write is still in flight
+void stop_autosave() {
+    if (app_state.autosave_timer_id) {
+        g_source_remove(app_state.autosave_timer_id);
+        app_state.autosave_timer_id = 0;
+    }
+    if (!app_state.autosave_path.empty()) {
+        g_remove(app_state.autosave_path.c_str());
+        g_remove(get_autosave_frame_path(app_state.autosave_path).c_str());
+        app_state.autosave_path.clear();
+    }
+    release_recovered_journal();
+}
+
+// After a successful save the journal only repeats what is on disk, so it
+// is dropped and a new one starts at the next change. Waits for a write
+// in flight, and keeps the journal if the canvas changed since the save.
+void reset_autosave_journal() {
+    if (app_state.autosave_path.empty()) return;
+    if (app_state.autosave_writing) {
+        app_state.autosave_reset_pending = true;
+        return;
+    }
+    app_state.autosave_reset_pending = false;
+    if (document_modified()) return;
+
+    release_recovered_journal();
+    g_remove(app_state.autosave_path.c_str());
+    g_remove(get_autosave_frame_path(app_state.autosave_path).c_str());
+    document_reset_journal(app_state.document);
+    app_state.autosave_rebuilding = false;
+    app_state.autosave_needs_full = false;
+    app_state.autosave_restart = true;
+    app_state.autosave_journal_bytes = 0;
+}
+
+// Newest journal whose process is gone, or an empty string. Only one
+// session can be recovered, so the journals of older ones are deleted.
+std::string find_orphaned_journal() {
+    std::string dir = get_autosave_dir();
+    GDir* handle = g_dir_open(dir.c_str(), 0, NULL);
+    if (!handle) return std::string();
+
+    std::string newest;
+    time_t newest_mtime = 0;
+    std::vector<std::string> orphans;
+    while (const gchar* name = g_dir_read_name(handle)) {
+        int pid = 0;
+        char suffix[16] = "";
+        if (sscanf(name, "autosave-%d.%15s", &pid, suffix) != 2) continue;
+        bool frame = strcmp(suffix, "journal.tmp") == 0;
+        if (!frame && strcmp(suffix, "journal") != 0) continue;
+        if (pid == (int)getpid() || kill(pid, 0) == 0 || errno == EPERM) continue;
+
+        gchar* path = g_build_filename(dir.c_str(), name, NULL);
+        GStatBuf info;
+        if (!frame && g_stat(path, &info) == 0 && (newest.empty() || info.st_mtime > newest_mtime)) {
+            newest = path;
+            newest_mtime = info.st_mtime;
+        }
+        orphans.push_back(path);
+        g_free(path);
+    }
+    g_dir_close(handle);
+
+    for (const std::string& path : orphans) {
+        if (path != newest && path != get_autosave_frame_path(newest)) {
+            g_remove(path.c_str());
         }
-        remove(temp_png.c_str());
-        return save_success;
     }
+    return newest;
+}
+
+// Ask whether to restore the canvas from a crashed session's journal, and
+// the part of a new full frame written beside it. Once recovered they are
+// kept until this session's journal can stand in for them; otherwise
+// they are removed.
+void offer_journal_recovery(const std::string& journal_path) {
+    GtkWidget* dialog = gtk_message_dialog_new(
+        GTK_WINDOW(app_state.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_QUESTION,
+        GTK_BUTTONS_NONE,
+        "%s", _("Mate-Paint did not close properly last time. Recover the unsaved image?")
+    );
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog),
+        _("_Discard"), GTK_RESPONSE_REJECT,
+        _("_Recover"), GTK_RESPONSE_ACCEPT,
+        NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
+    bool recover = gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT;
+    gtk_widget_destroy(dialog);
 
-    return cairo_surface_write_to_png(surface, filename.c_str()) == CAIRO_STATUS_SUCCESS;
+    if (recover) {
+        TraceSpan span("replay_journal");
+        cairo_surface_t* surface = replay_journal(journal_path);
+        if (surface) {
+            surface = replay_journal(get_autosave_frame_path(journal_path), surface);
+        }
+        if (surface) {
+            document_set_surface(app_state.document, surface);
+            app_state.current_filename.clear();
+            app_state.preview_open = false;
+            gtk_widget_set_size_request(app_state.drawing_area,
+                static_cast<int>(app_state.document.width * app_state.zoom_factor),
+                static_cast<int>(app_state.document.height * app_state.zoom_factor));
+            invalidate_canvas();
+            app_state.autosave_recovered_path = journal_path;
+            return;
+        }
+        g_printerr(_("Could not recover %s\n"), journal_path.c_str());
+    }
+    g_remove(journal_path.c_str());
+    g_remove(get_autosave_frame_path(journal_path).c_str());
 }
 
-void open_image_dialog(GtkWidget* parent) {
+void open_image_dialog(GtkWidget* parent, bool as_preview) {
+    TraceSpan span("open_image_dialog");
     GtkWidget* dialog = gtk_file_chooser_dialog_new(
-        _("Open Image"),
+        as_preview ? _("Open Image as Preview") : _("Open Image"),
         GTK_WINDOW(parent),
         GTK_FILE_CHOOSER_ACTION_OPEN,
         _("_Cancel"), GTK_RESPONSE_CANCEL,
@@ -2749,42 +4591,17 @@ void open_image_dialog(GtkWidget* parent) {
     );
 
     GtkFileFilter* filter_images = gtk_file_filter_new();
-    gtk_file_filter_set_name(filter_images, _("PNG Images"));
-    gtk_file_filter_add_pattern(filter_images, "*.png");
-    gtk_file_filter_add_pattern(filter_images, "*.PNG");
-    gtk_file_filter_add_pattern(filter_images, "*.xpm");
+    gtk_file_filter_set_name(filter_images, _("Images"));
+    gtk_file_filter_add_pixbuf_formats(filter_images);
+    gtk_file_filter_add_pattern(filter_images, "*.qoi");
+    gtk_file_filter_add_pattern(filter_images, "*.pam");
     gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter_images);
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char* filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
 
         if (filename) {
-            app_state.current_filename = filename;
-
-            cairo_surface_t* loaded_surface = cairo_image_surface_create_from_png(filename);
-            if (cairo_surface_status(loaded_surface) == CAIRO_STATUS_SUCCESS) {
-                int width = cairo_image_surface_get_width(loaded_surface);
-                int height = cairo_image_surface_get_height(loaded_surface);
-
-                push_undo_state();
-
-                app_state.canvas_width = width;
-                app_state.canvas_height = height;
-
-                if (app_state.surface) {
-                    cairo_surface_destroy(app_state.surface);
-                }
-
-                app_state.surface = loaded_surface;
-
-                gtk_widget_set_size_request(app_state.drawing_area,
-                    static_cast<int>(width * app_state.zoom_factor),
-                    static_cast<int>(height * app_state.zoom_factor));
-                gtk_widget_queue_draw(app_state.drawing_area);
-            } else {
-                cairo_surface_destroy(loaded_surface);
-            }
-
+            start_load_job(filename, as_preview ? preview_max_size : 0);
             g_free(filename);
         }
     }
@@ -2890,48 +4707,145 @@ void on_file_new(GtkMenuItem* item, gpointer data) {
     g_free(selected);
     gtk_widget_destroy(dialog);
 
-    if (app_state.surface) {
+    if (app_state.document.surface) {
         push_undo_state();
     }
 
-    app_state.canvas_width = new_width;
-    app_state.canvas_height = new_height;
+    init_surface(new_width, new_height);
     gtk_widget_set_size_request(app_state.drawing_area, new_width, new_height);
-    init_surface(app_state.drawing_area);
     app_state.current_filename.clear();
+    app_state.preview_open = false;
     clear_selection();
     if (app_state.text_active) {
         cancel_text();
     }
-    gtk_widget_queue_draw(app_state.drawing_area);
-}
+    mark_document_saved(std::string());
+    invalidate_canvas();
+}
+
+void on_file_open(GtkMenuItem* item, gpointer data) {
+    open_image_dialog(app_state.window, false);
+}
+
+void on_file_open_preview(GtkMenuItem* item, gpointer data) {
+    open_image_dialog(app_state.window, true);
+}
+
+void on_file_save(GtkMenuItem* item, gpointer data) {
+    if (!app_state.current_filename.empty()) {
+        std::string filename = app_state.current_filename;
+        if (!is_save_format(get_file_extension_lowercase(filename))) {
+            filename += ".png";
+            app_state.current_filename = filename;
+        }
+        // Nothing to write when the file already holds this canvas
+        if (!app_state.active_job && filename == app_state.saved_filename && !document_modified()) {
+            return;
+        }
+        start_save_job(app_state.current_filename);
+    } else {
+        save_image_dialog(app_state.window);
+    }
+}
+
+void on_file_save_as(GtkMenuItem* item, gpointer data) {
+    save_image_dialog(app_state.window);
+}
+
+// A job still running when the window is closed is either waited for or
+// cancelled; confirm_close() runs again once it has finished.
+void confirm_close_during_job() {
+    // Save from the close dialog already quits when it is done
+    if (app_state.quit_after_save || app_state.close_after_job) return;
+
+    CanvasJob* job = app_state.active_job;
+    GtkWidget* dialog = gtk_message_dialog_new(
+        GTK_WINDOW(app_state.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_QUESTION,
+        GTK_BUTTONS_NONE,
+        _("\"%s\" is still running."), job->title.c_str()
+    );
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+        "%s", _("The window will close when it has finished."));
+    gtk_dialog_add_button(GTK_DIALOG(dialog), _("_Cancel"), GTK_RESPONSE_CANCEL);
+    if (job->can_cancel) {
+        gtk_dialog_add_button(GTK_DIALOG(dialog), _("_Stop and Close"), GTK_RESPONSE_REJECT);
+    }
+    gtk_dialog_add_button(GTK_DIALOG(dialog), _("Close When _Finished"), GTK_RESPONSE_ACCEPT);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
+    int response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+
+    // The job may have finished while the dialog was up
+    if (response == GTK_RESPONSE_REJECT || response == GTK_RESPONSE_ACCEPT) {
+        if (!app_state.active_job) {
+            if (confirm_close()) {
+                gtk_main_quit();
+            }
+            return;
+        }
+        app_state.close_after_job = true;
+        if (response == GTK_RESPONSE_REJECT) {
+            cancel_active_job();
+        }
+    }
+}
+
+// Ask before closing a canvas with unsaved changes. Returns true when the
+// window may close now; Save closes it once the save job has succeeded.
+// Uncommitted pastes and text count as changes.
+bool confirm_close() {
+    if (app_state.active_job) {
+        confirm_close_during_job();
+        return false;
+    }
+    bool pending = app_state.floating_selection_active ||
+        (app_state.text_active && !app_state.text_content.empty());
+    if (!pending && !document_modified()) return true;
 
-void on_file_open(GtkMenuItem* item, gpointer data) {
-    open_image_dialog(app_state.window);
-}
+    GtkWidget* dialog = gtk_message_dialog_new(
+        GTK_WINDOW(app_state.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_WARNING,
+        GTK_BUTTONS_NONE,
+        "%s", _("Save changes to the image before closing?")
+    );
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+        "%s", _("If you don't save, your changes will be lost."));
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog),
+        _("Close _without Saving"), GTK_RESPONSE_CLOSE,
+        _("_Cancel"), GTK_RESPONSE_CANCEL,
+        _("_Save"), GTK_RESPONSE_ACCEPT,
+        NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
+    int response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
 
-void on_file_save(GtkMenuItem* item, gpointer data) {
-    if (!app_state.current_filename.empty()) {
-        std::string filename = app_state.current_filename;
-        size_t dot_pos = filename.find_last_of('.');
-        std::string extension = (dot_pos == std::string::npos) ? "" : filename.substr(dot_pos + 1);
-        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
-        if (extension != "png") {
-            filename += ".png";
-            app_state.current_filename = filename;
+    if (response == GTK_RESPONSE_CLOSE) return true;
+    if (response == GTK_RESPONSE_ACCEPT) {
+        finalize_text();
+        commit_floating_selection(true);
+        app_state.quit_after_save = true;
+        on_file_save(NULL, NULL);
+        if (!app_state.active_job) {
+            app_state.quit_after_save = false;
+            // Nothing needed writing, e.g. a paste dropped back in place;
+            // otherwise the file chooser was cancelled
+            return !document_modified();
         }
-        save_surface_to_file(app_state.surface, app_state.current_filename);
-    } else {
-        save_image_dialog(app_state.window);
     }
+    return false;
 }
 
-void on_file_save_as(GtkMenuItem* item, gpointer data) {
-    save_image_dialog(app_state.window);
+void on_file_quit(GtkMenuItem* item, gpointer data) {
+    if (confirm_close()) {
+        gtk_main_quit();
+    }
 }
 
-void on_file_quit(GtkMenuItem* item, gpointer data) {
-    gtk_main_quit();
+gboolean on_window_delete(GtkWidget* widget, GdkEvent* event, gpointer data) {
+    return !confirm_close();
 }
 
 void on_edit_copy(GtkMenuItem* item, gpointer data) {
@@ -2955,7 +4869,8 @@ void on_edit_redo(GtkMenuItem* item, gpointer data) {
 }
 
 void on_image_scale(GtkMenuItem* item, gpointer data) {
-    if (!app_state.surface) return;
+    TraceSpan span("on_image_scale");
+    if (!app_state.document.surface) return;
 
     GtkWidget* dialog = gtk_dialog_new_with_buttons(
         _("Scale Image"),
@@ -2989,38 +4904,15 @@ void on_image_scale(GtkMenuItem* item, gpointer data) {
     double scale = gtk_spin_button_get_value(GTK_SPIN_BUTTON(percent_spin)) / 100.0;
     gtk_widget_destroy(dialog);
 
-    int new_width = std::max(1, (int)std::lround(app_state.canvas_width * scale));
-    int new_height = std::max(1, (int)std::lround(app_state.canvas_height * scale));
-
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* scaled_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-
-    cairo_t* cr = cairo_create(scaled_surface);
-    configure_crisp_rendering(cr);
-    cairo_scale(cr, (double)new_width / app_state.canvas_width, (double)new_height / app_state.canvas_height);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = scaled_surface;
-    app_state.canvas_width = new_width;
-    app_state.canvas_height = new_height;
-    cairo_surface_destroy(old_surface);
+    int new_width = std::max(1, (int)std::lround(app_state.document.width * scale));
+    int new_height = std::max(1, (int)std::lround(app_state.document.height * scale));
 
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
-    }
-
-    gtk_widget_set_size_request(app_state.drawing_area, new_width, new_height);
-    gtk_widget_queue_draw(app_state.drawing_area);
+    start_canvas_remap_job(_("Scaling image"), REMAP_SCALE_NEAREST, new_width, new_height);
 }
 
 void on_image_resize_canvas(GtkMenuItem* item, gpointer data) {
-    if (!app_state.surface) return;
+    TraceSpan span("on_image_resize_canvas");
+    if (!app_state.document.surface) return;
 
     GtkWidget* dialog = gtk_dialog_new_with_buttons(
         _("Resize Image"),
@@ -3039,14 +4931,14 @@ void on_image_resize_canvas(GtkMenuItem* item, gpointer data) {
     GtkWidget* width_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
     GtkWidget* width_label = gtk_label_new(_("Width:"));
     GtkWidget* width_spin = gtk_spin_button_new_with_range(1, 10000, 1);
-    gtk_spin_button_set_value(GTK_SPIN_BUTTON(width_spin), app_state.canvas_width);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(width_spin), app_state.document.width);
     gtk_box_pack_start(GTK_BOX(width_row), width_label, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(width_row), width_spin, FALSE, FALSE, 0);
 
     GtkWidget* height_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
     GtkWidget* height_label = gtk_label_new(_("Height:"));
     GtkWidget* height_spin = gtk_spin_button_new_with_range(1, 10000, 1);
-    gtk_spin_button_set_value(GTK_SPIN_BUTTON(height_spin), app_state.canvas_height);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(height_spin), app_state.document.height);
     gtk_box_pack_start(GTK_BOX(height_row), height_label, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(height_row), height_spin, FALSE, FALSE, 0);
 
@@ -3065,41 +4957,12 @@ void on_image_resize_canvas(GtkMenuItem* item, gpointer data) {
     int new_height = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(height_spin));
     gtk_widget_destroy(dialog);
 
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* resized_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-
-    cairo_t* cr = cairo_create(resized_surface);
-    configure_crisp_rendering(cr);
-    cairo_set_source_rgba(
-        cr,
-        app_state.bg_color.red,
-        app_state.bg_color.green,
-        app_state.bg_color.blue,
-        app_state.bg_color.alpha
-    );
-    cairo_paint(cr);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = resized_surface;
-    app_state.canvas_width = new_width;
-    app_state.canvas_height = new_height;
-    cairo_surface_destroy(old_surface);
-
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
-    }
-
-    gtk_widget_set_size_request(app_state.drawing_area, new_width, new_height);
-    gtk_widget_queue_draw(app_state.drawing_area);
+    start_canvas_resize_job(new_width, new_height, true, nullptr);
 }
 
 void on_image_rotate_clockwise(GtkMenuItem* item, gpointer data) {
-    if (!app_state.surface) return;
+    TraceSpan span("on_image_rotate_clockwise");
+    if (!app_state.document.surface) return;
 
     if (app_state.has_selection) {
         if (!app_state.floating_selection_active) {
@@ -3109,22 +4972,16 @@ void on_image_rotate_clockwise(GtkMenuItem* item, gpointer data) {
             return;
         }
 
-        push_undo_state();
+        push_selection_undo_state();
 
         SelectionPixelBounds bounds = get_selection_pixel_bounds();
-        const int new_width = bounds.height;
-        const int new_height = bounds.width;
-
         cairo_surface_t* old_floating_surface = app_state.floating_surface;
-        cairo_surface_t* rotated_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-        cairo_t* cr = cairo_create(rotated_surface);
-        configure_crisp_rendering(cr);
+        const int new_width = cairo_image_surface_get_height(old_floating_surface);
+        const int new_height = cairo_image_surface_get_width(old_floating_surface);
 
-        cairo_translate(cr, new_width, 0);
-        cairo_rotate(cr, M_PI / 2.0);
-        cairo_set_source_surface(cr, old_floating_surface, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+        cairo_surface_t* rotated_surface = create_remapped_surface(old_floating_surface,
+            REMAP_ROTATE_CLOCKWISE, new_width, new_height);
+        if (!rotated_surface) return;
 
         app_state.floating_surface = rotated_surface;
         cairo_surface_destroy(old_floating_surface);
@@ -3136,44 +4993,16 @@ void on_image_rotate_clockwise(GtkMenuItem* item, gpointer data) {
         app_state.selection_x2 = bounds.x + new_width;
         app_state.selection_y2 = bounds.y + new_height;
 
-        gtk_widget_queue_draw(app_state.drawing_area);
+        queue_overlay_redraw();
         return;
     }
 
-    const int old_width = app_state.canvas_width;
-    const int old_height = app_state.canvas_height;
-    const int new_width = old_height;
-    const int new_height = old_width;
-
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* rotated_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-    cairo_t* cr = cairo_create(rotated_surface);
-    configure_crisp_rendering(cr);
-
-    cairo_translate(cr, new_width, 0);
-    cairo_rotate(cr, M_PI / 2.0);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = rotated_surface;
-    app_state.canvas_width = new_width;
-    app_state.canvas_height = new_height;
-    cairo_surface_destroy(old_surface);
-
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
-    }
-
-    gtk_widget_set_size_request(app_state.drawing_area, new_width, new_height);
-    gtk_widget_queue_draw(app_state.drawing_area);
+    start_canvas_remap_job(_("Rotating image"), REMAP_ROTATE_CLOCKWISE, app_state.document.height, app_state.document.width);
 }
 
 void on_image_rotate_counter_clockwise(GtkMenuItem* item, gpointer data) {
-    if (!app_state.surface) return;
+    TraceSpan span("on_image_rotate_counter_clockwise");
+    if (!app_state.document.surface) return;
 
     if (app_state.has_selection) {
         if (!app_state.floating_selection_active) {
@@ -3183,22 +5012,16 @@ void on_image_rotate_counter_clockwise(GtkMenuItem* item, gpointer data) {
             return;
         }
 
-        push_undo_state();
+        push_selection_undo_state();
 
         SelectionPixelBounds bounds = get_selection_pixel_bounds();
-        const int new_width = bounds.height;
-        const int new_height = bounds.width;
-
         cairo_surface_t* old_floating_surface = app_state.floating_surface;
-        cairo_surface_t* rotated_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-        cairo_t* cr = cairo_create(rotated_surface);
-        configure_crisp_rendering(cr);
+        const int new_width = cairo_image_surface_get_height(old_floating_surface);
+        const int new_height = cairo_image_surface_get_width(old_floating_surface);
 
-        cairo_translate(cr, 0, new_height);
-        cairo_rotate(cr, -M_PI / 2.0);
-        cairo_set_source_surface(cr, old_floating_surface, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+        cairo_surface_t* rotated_surface = create_remapped_surface(old_floating_surface,
+            REMAP_ROTATE_COUNTER_CLOCKWISE, new_width, new_height);
+        if (!rotated_surface) return;
 
         app_state.floating_surface = rotated_surface;
         cairo_surface_destroy(old_floating_surface);
@@ -3210,44 +5033,16 @@ void on_image_rotate_counter_clockwise(GtkMenuItem* item, gpointer data) {
         app_state.selection_x2 = bounds.x + new_width;
         app_state.selection_y2 = bounds.y + new_height;
 
-        gtk_widget_queue_draw(app_state.drawing_area);
+        queue_overlay_redraw();
         return;
     }
 
-    const int old_width = app_state.canvas_width;
-    const int old_height = app_state.canvas_height;
-    const int new_width = old_height;
-    const int new_height = old_width;
-
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* rotated_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-    cairo_t* cr = cairo_create(rotated_surface);
-    configure_crisp_rendering(cr);
-
-    cairo_translate(cr, 0, new_height);
-    cairo_rotate(cr, -M_PI / 2.0);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = rotated_surface;
-    app_state.canvas_width = new_width;
-    app_state.canvas_height = new_height;
-    cairo_surface_destroy(old_surface);
-
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
-    }
-
-    gtk_widget_set_size_request(app_state.drawing_area, new_width, new_height);
-    gtk_widget_queue_draw(app_state.drawing_area);
+    start_canvas_remap_job(_("Rotating image"), REMAP_ROTATE_COUNTER_CLOCKWISE, app_state.document.height, app_state.document.width);
 }
 
 void on_image_flip_horizontal(GtkMenuItem* item, gpointer data) {
-    if (!app_state.surface) return;
+    TraceSpan span("on_image_flip_horizontal");
+    if (!app_state.document.surface) return;
 
     if (app_state.has_selection) {
         if (!app_state.floating_selection_active) {
@@ -3257,20 +5052,13 @@ void on_image_flip_horizontal(GtkMenuItem* item, gpointer data) {
             return;
         }
 
-        push_undo_state();
-
-        SelectionPixelBounds bounds = get_selection_pixel_bounds();
+        push_selection_undo_state();
 
         cairo_surface_t* old_floating_surface = app_state.floating_surface;
-        cairo_surface_t* flipped_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, bounds.width, bounds.height);
-        cairo_t* cr = cairo_create(flipped_surface);
-        configure_crisp_rendering(cr);
-
-        cairo_translate(cr, bounds.width, 0);
-        cairo_scale(cr, -1, 1);
-        cairo_set_source_surface(cr, old_floating_surface, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+        cairo_surface_t* flipped_surface = create_remapped_surface(old_floating_surface, REMAP_FLIP_HORIZONTAL,
+            cairo_image_surface_get_width(old_floating_surface),
+            cairo_image_surface_get_height(old_floating_surface));
+        if (!flipped_surface) return;
 
         app_state.floating_surface = flipped_surface;
         cairo_surface_destroy(old_floating_surface);
@@ -3278,39 +5066,16 @@ void on_image_flip_horizontal(GtkMenuItem* item, gpointer data) {
         app_state.selection_is_rect = true;
         app_state.selection_path.clear();
 
-        gtk_widget_queue_draw(app_state.drawing_area);
+        queue_overlay_redraw();
         return;
     }
 
-    const int width = app_state.canvas_width;
-    const int height = app_state.canvas_height;
-
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* flipped_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cairo_t* cr = cairo_create(flipped_surface);
-    configure_crisp_rendering(cr);
-
-    cairo_translate(cr, width, 0);
-    cairo_scale(cr, -1, 1);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = flipped_surface;
-    cairo_surface_destroy(old_surface);
-
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
-    }
-
-    gtk_widget_queue_draw(app_state.drawing_area);
+    start_canvas_remap_job(_("Flipping image"), REMAP_FLIP_HORIZONTAL, app_state.document.width, app_state.document.height);
 }
 
 void on_image_flip_vertical(GtkMenuItem* item, gpointer data) {
-    if (!app_state.surface) return;
+    TraceSpan span("on_image_flip_vertical");
+    if (!app_state.document.surface) return;
 
     if (app_state.has_selection) {
         if (!app_state.floating_selection_active) {
@@ -3320,20 +5085,13 @@ void on_image_flip_vertical(GtkMenuItem* item, gpointer data) {
             return;
         }
 
-        push_undo_state();
-
-        SelectionPixelBounds bounds = get_selection_pixel_bounds();
+        push_selection_undo_state();
 
         cairo_surface_t* old_floating_surface = app_state.floating_surface;
-        cairo_surface_t* flipped_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, bounds.width, bounds.height);
-        cairo_t* cr = cairo_create(flipped_surface);
-        configure_crisp_rendering(cr);
-
-        cairo_translate(cr, 0, bounds.height);
-        cairo_scale(cr, 1, -1);
-        cairo_set_source_surface(cr, old_floating_surface, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+        cairo_surface_t* flipped_surface = create_remapped_surface(old_floating_surface, REMAP_FLIP_VERTICAL,
+            cairo_image_surface_get_width(old_floating_surface),
+            cairo_image_surface_get_height(old_floating_surface));
+        if (!flipped_surface) return;
 
         app_state.floating_surface = flipped_surface;
         cairo_surface_destroy(old_floating_surface);
@@ -3341,35 +5099,11 @@ void on_image_flip_vertical(GtkMenuItem* item, gpointer data) {
         app_state.selection_is_rect = true;
         app_state.selection_path.clear();
 
-        gtk_widget_queue_draw(app_state.drawing_area);
+        queue_overlay_redraw();
         return;
     }
 
-    const int width = app_state.canvas_width;
-    const int height = app_state.canvas_height;
-
-    push_undo_state();
-
-    cairo_surface_t* old_surface = app_state.surface;
-    cairo_surface_t* flipped_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cairo_t* cr = cairo_create(flipped_surface);
-    configure_crisp_rendering(cr);
-
-    cairo_translate(cr, 0, height);
-    cairo_scale(cr, 1, -1);
-    cairo_set_source_surface(cr, old_surface, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-
-    app_state.surface = flipped_surface;
-    cairo_surface_destroy(old_surface);
-
-    clear_selection();
-    if (app_state.text_active) {
-        cancel_text();
-    }
-
-    gtk_widget_queue_draw(app_state.drawing_area);
+    start_canvas_remap_job(_("Flipping image"), REMAP_FLIP_VERTICAL, app_state.document.width, app_state.document.height);
 }
 
 void on_help_manual(GtkMenuItem* item, gpointer data) {
@@ -3492,52 +5226,8 @@ GtkWidget* create_line_thickness_button(int index) {
     gtk_widget_set_tooltip_text(button, _("Line thickness"));
     gtk_button_set_relief(GTK_BUTTON(button), GTK_RELIEF_NONE);
 
-    GtkCssProvider* provider = gtk_css_provider_new();
-    gtk_css_provider_load_from_data(provider,
-        "togglebutton {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "border: 1px solid #888;"
-        "border-radius: 0;"
-        "padding: 0;"
-        "box-shadow: none;"
-        "}"
-        "togglebutton:checked {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "border: 1px solid #333;"
-        "}"
-        "togglebutton:hover {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "}",
-        -1,
-        NULL
-    );
-    gtk_style_context_add_provider(
-        gtk_widget_get_style_context(button),
-        GTK_STYLE_PROVIDER(provider),
-        GTK_STYLE_PROVIDER_PRIORITY_USER
-    );
-    g_object_unref(provider);
-
     GtkWidget* preview = gtk_drawing_area_new();
     gtk_widget_set_size_request(preview, 58, 16);
-    GtkCssProvider* preview_provider = gtk_css_provider_new();
-    gtk_css_provider_load_from_data(preview_provider,
-        "drawingarea {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "}",
-        -1,
-        NULL
-    );
-    gtk_style_context_add_provider(
-        gtk_widget_get_style_context(preview),
-        GTK_STYLE_PROVIDER(preview_provider),
-        GTK_STYLE_PROVIDER_PRIORITY_USER
-    );
-    g_object_unref(preview_provider);
 
     g_signal_connect(preview, "draw", G_CALLBACK(on_line_thickness_button_draw), GINT_TO_POINTER(index));
     gtk_container_add(GTK_CONTAINER(button), preview);
@@ -3593,35 +5283,6 @@ GtkWidget* create_zoom_button(int index) {
     gtk_widget_set_tooltip_text(button, _("Zoom level"));
     gtk_button_set_relief(GTK_BUTTON(button), GTK_RELIEF_NONE);
 
-    GtkCssProvider* provider = gtk_css_provider_new();
-    gtk_css_provider_load_from_data(provider,
-        "togglebutton {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "border: 1px solid #888;"
-        "border-radius: 0;"
-        "padding: 0;"
-        "box-shadow: none;"
-        "}"
-        "togglebutton:checked {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "border: 1px solid #333;"
-        "}"
-        "togglebutton:hover {"
-        "background: #ffffff;"
-        "background-image: none;"
-        "}",
-        -1,
-        NULL
-    );
-    gtk_style_context_add_provider(
-        gtk_widget_get_style_context(button),
-        GTK_STYLE_PROVIDER(provider),
-        GTK_STYLE_PROVIDER_PRIORITY_USER
-    );
-    g_object_unref(provider);
-
     g_signal_connect(button, "toggled", G_CALLBACK(on_zoom_toggled), GINT_TO_POINTER(index));
     return button;
 }
@@ -3638,43 +5299,46 @@ void update_zoom_visibility() {
     }
 }
 
-void apply_color_button_style(GtkWidget* button, const GdkRGBA& color, bool is_custom_slot) {
-    double brightness = (color.red * 0.299) + (color.green * 0.587) + (color.blue * 0.114);
-    const char* text_color = brightness > 0.5 ? "#111" : "#fff";
-
-    gchar* css = g_strdup_printf(
-        "button { "
-        "background-color: rgb(%d,%d,%d); "
-        "color: %s; "
-        "background-image: none; "
-        "border: 1px solid #555; "
-        "min-width: 18px; "
-        "min-height: 18px; "
-        "font-weight: bold; "
-        "padding: 0; "
-        "margin: 0; "
-        "}"
-        "button:hover { "
-        "border: 1px solid #000; "
-        "}",
-        (int)(color.red * 255),
-        (int)(color.green * 255),
-        (int)(color.blue * 255),
-        (is_custom_slot || is_transparent_color(color)) ? text_color : "transparent"
-    );
-
+// Load the shared stylesheet once for the whole screen
+void load_app_stylesheet() {
+    TraceSpan span("load_app_stylesheet");
     GtkCssProvider* provider = gtk_css_provider_new();
-    gtk_css_provider_load_from_data(provider, css, -1, NULL);
-    gtk_style_context_add_provider(
-        gtk_widget_get_style_context(button),
+    gtk_css_provider_load_from_resource(provider, "/org/mate/paint/mate-paint.css");
+    gtk_style_context_add_provider_for_screen(
+        gdk_screen_get_default(),
         GTK_STYLE_PROVIDER(provider),
-        GTK_STYLE_PROVIDER_PRIORITY_USER
+        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION
     );
-
-    g_free(css);
     g_object_unref(provider);
 }
 
+// Palette swatches get their border and label from the stylesheet; the
+// colour is painted here, before the default handler draws over it
+gboolean on_palette_button_draw(GtkWidget* widget, cairo_t* cr, gpointer data) {
+    int index = GPOINTER_TO_INT(data);
+    if (index < 0 || index >= (int)app_state.palette_button_colors.size()) {
+        return FALSE;
+    }
+
+    const GdkRGBA& color = app_state.palette_button_colors[index];
+    cairo_set_source_rgb(cr, color.red, color.green, color.blue);
+    cairo_paint(cr);
+    return FALSE;
+}
+
+// Pick the label colour class for a swatch; plain swatches have no label
+void apply_color_button_style(GtkWidget* button, const GdkRGBA& color, bool is_custom_slot) {
+    GtkStyleContext* context = gtk_widget_get_style_context(button);
+    gtk_style_context_remove_class(context, "on-light");
+    gtk_style_context_remove_class(context, "on-dark");
+
+    if (is_custom_slot || is_transparent_color(color)) {
+        double brightness = (color.red * 0.299) + (color.green * 0.587) + (color.blue * 0.114);
+        gtk_style_context_add_class(context, brightness > 0.5 ? "on-light" : "on-dark");
+    }
+    gtk_widget_queue_draw(button);
+}
+
 void show_custom_color_dialog(int index) {
     if (index < 0 || index >= (int)app_state.palette_button_colors.size()) {
         return;
@@ -3761,22 +5425,10 @@ GtkWidget* create_tool_icon(Tool tool) {
         return gtk_image_new();
     }
 
-    const char* icon_roots[] = {
-        "/usr/share/mate-paint",
-        "."
-    };
-
-    for (gsize i = 0; i < G_N_ELEMENTS(icon_roots); i++) {
-        gchar* icon_path = g_build_filename(icon_roots[i], "data", "icons", "16x16", "actions", icon_file, NULL);
-        if (g_file_test(icon_path, G_FILE_TEST_EXISTS)) {
-            GtkWidget* icon = gtk_image_new_from_file(icon_path);
-            g_free(icon_path);
-            return icon;
-        }
-        g_free(icon_path);
-    }
-
-    return gtk_image_new();
+    gchar* resource_path = g_strconcat("/org/mate/paint/icons/16x16/actions/", icon_file, NULL);
+    GtkWidget* icon = gtk_image_new_from_resource(resource_path);
+    g_free(resource_path);
+    return icon;
 }
 
 // Create tool button with tooltip
@@ -3800,7 +5452,9 @@ GtkWidget* create_color_button(GdkRGBA color, int index, bool is_custom_slot) {
     GtkWidget* button = gtk_button_new_with_label(get_palette_button_label(index, is_custom_slot));
     gtk_widget_set_size_request(button, 18, 18);
 
+    gtk_style_context_add_class(gtk_widget_get_style_context(button), "palette-swatch");
     apply_color_button_style(button, color, is_custom_slot);
+    g_signal_connect(button, "draw", G_CALLBACK(on_palette_button_draw), GINT_TO_POINTER(index));
 
     gtk_widget_add_events(button, GDK_BUTTON_PRESS_MASK);
     g_signal_connect(button, "button-press-event", G_CALLBACK(on_color_button_press), GINT_TO_POINTER(index));
@@ -3808,43 +5462,289 @@ GtkWidget* create_color_button(GdkRGBA color, int index, bool is_custom_slot) {
     return button;
 }
 
+// Headless replay of an input recording
+
+bool read_input_recording(const char* path, gint32 sizes[4], std::vector<InputRecord>& records) {
+    gchar* contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, NULL)) {
+        return false;
+    }
+
+    const gsize header_size = sizeof(input_trace_magic) + 4 * sizeof(gint32);
+    bool valid = length >= header_size &&
+        std::memcmp(contents, input_trace_magic, sizeof(input_trace_magic)) == 0 &&
+        (length - header_size) % sizeof(InputRecord) == 0;
+
+    if (valid) {
+        std::memcpy(sizes, contents + sizeof(input_trace_magic), 4 * sizeof(gint32));
+        for (int i = 0; i < 4; i++) {
+            sizes[i] = GINT32_FROM_LE(sizes[i]);
+        }
+
+        records.resize((length - header_size) / sizeof(InputRecord));
+        if (!records.empty()) {
+            std::memcpy(records.data(), contents + header_size, records.size() * sizeof(InputRecord));
+        }
+        for (InputRecord& record : records) {
+            input_record_from_le(record);
+        }
+    }
+
+    g_free(contents);
+    return valid;
+}
+
+const char* input_record_type_name(guint8 type) {
+    switch (type) {
+        case INPUT_BUTTON_PRESS: return "button_press";
+        case INPUT_BUTTON_RELEASE: return "button_release";
+        case INPUT_MOTION: return "motion";
+        case INPUT_KEY_PRESS: return "key_press";
+        case INPUT_KEY_RELEASE: return "key_release";
+        default: return "state";
+    }
+}
+
+void apply_replay_state(const InputRecord& record) {
+    if (record.button < TOOL_COUNT && (Tool)record.button != app_state.current_tool) {
+        on_tool_clicked(NULL, GINT_TO_POINTER((int)record.button));
+    }
+
+    guint32 thickness_index = record.state & 0xFF;
+    guint32 zoom_index = (record.state >> 8) & 0xFF;
+    if (thickness_index < app_state.line_thickness_buttons.size()) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app_state.line_thickness_buttons[thickness_index]), TRUE);
+    }
+    if (zoom_index < app_state.zoom_buttons.size()) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app_state.zoom_buttons[zoom_index]), TRUE);
+    }
+
+    app_state.fg_color = pixel_to_rgba(record.keyval);
+    app_state.bg_color = pixel_to_rgba(record.extra);
+}
+
+void dispatch_replay_event(const InputRecord& record) {
+    double x = record.x / 256.0;
+    double y = record.y / 256.0;
+
+    switch (record.type) {
+        case INPUT_BUTTON_PRESS:
+        case INPUT_BUTTON_RELEASE: {
+            GdkEventButton event = GdkEventButton();
+            event.type = record.type == INPUT_BUTTON_PRESS ? GDK_BUTTON_PRESS : GDK_BUTTON_RELEASE;
+            event.x = x;
+            event.y = y;
+            event.button = record.button;
+            event.state = record.state;
+            if (record.type == INPUT_BUTTON_PRESS) {
+                on_button_press(app_state.drawing_area, &event, NULL);
+            } else {
+                on_button_release(app_state.drawing_area, &event, NULL);
+            }
+            break;
+        }
+        case INPUT_MOTION: {
+            GdkEventMotion event = GdkEventMotion();
+            event.type = GDK_MOTION_NOTIFY;
+            event.x = x;
+            event.y = y;
+            event.state = record.state;
+            on_motion_notify(app_state.drawing_area, &event, NULL);
+            break;
+        }
+        case INPUT_KEY_PRESS:
+        case INPUT_KEY_RELEASE: {
+            GdkEventKey event = GdkEventKey();
+            event.type = record.type == INPUT_KEY_PRESS ? GDK_KEY_PRESS : GDK_KEY_RELEASE;
+            event.keyval = record.keyval;
+            event.state = record.state;
+            if (record.type == INPUT_KEY_PRESS) {
+                on_key_press(app_state.window, &event, NULL);
+            } else {
+                on_key_release(app_state.window, &event, NULL);
+            }
+            break;
+        }
+        case INPUT_STATE:
+            apply_replay_state(record);
+            break;
+    }
+}
+
+// Let background jobs and idle callbacks started by an event finish
+void drain_replay_main_loop() {
+    while (app_state.active_job || g_main_context_pending(NULL)) {
+        g_main_context_iteration(NULL, app_state.active_job != nullptr);
+    }
+}
+
+// Feed a recording through the canvas handlers without showing the window.
+// Each event is followed by a frame rendered into an offscreen viewport.
+// Prints one JSON line per event and a summary with a canvas checksum.
+int run_input_replay(const char* path, bool max_speed) {
+    gint32 sizes[4];
+    std::vector<InputRecord> records;
+    if (!read_input_recording(path, sizes, records) || sizes[0] <= 0 || sizes[1] <= 0) {
+        g_printerr(_("%s is not a valid input recording\n"), path);
+        return 1;
+    }
+
+    app_state.replaying = true;
+    init_surface(sizes[0], sizes[1]);
+    gtk_widget_set_size_request(app_state.drawing_area, app_state.document.width, app_state.document.height);
+    invalidate_canvas();
+
+    int viewport_width = sizes[2] > 0 ? sizes[2] : app_state.document.width;
+    int viewport_height = sizes[3] > 0 ? sizes[3] : app_state.document.height;
+    cairo_surface_t* viewport = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, viewport_width, viewport_height);
+
+    std::vector<gint64> latencies;
+    gint64 replay_start = g_get_monotonic_time();
+    for (size_t i = 0; i < records.size(); i++) {
+        const InputRecord& record = records[i];
+        if (!max_speed) {
+            gint64 wait = replay_start + record.time_us - g_get_monotonic_time();
+            if (wait > 0) {
+                g_usleep(wait);
+            }
+        }
+
+        gint64 begin = g_get_monotonic_time();
+        dispatch_replay_event(record);
+        drain_replay_main_loop();
+        if (record.type == INPUT_STATE) continue;
+
+        cairo_t* cr = cairo_create(viewport);
+        on_draw(app_state.drawing_area, cr, NULL);
+        cairo_destroy(cr);
+
+        gint64 latency = g_get_monotonic_time() - begin;
+        latencies.push_back(latency);
+        std::printf("{\"index\":%u,\"type\":\"%s\",\"time_us\":%" G_GINT64_FORMAT ",\"latency_us\":%" G_GINT64_FORMAT "}\n",
+            (unsigned)i, input_record_type_name(record.type), record.time_us, latency);
+    }
+    gint64 elapsed = g_get_monotonic_time() - replay_start;
+    cairo_surface_destroy(viewport);
+
+    cairo_surface_flush(app_state.document.surface);
+    const guchar* data = cairo_image_surface_get_data(app_state.document.surface);
+    int stride = cairo_image_surface_get_stride(app_state.document.surface);
+    GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    for (int y = 0; y < app_state.document.height; y++) {
+        g_checksum_update(checksum, data + (size_t)y * stride, (gssize)app_state.document.width * 4);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) -> gint64 {
+        if (latencies.empty()) return 0;
+        return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+    std::printf("{\"events\":%u,\"elapsed_us\":%" G_GINT64_FORMAT ",\"latency_p50_us\":%" G_GINT64_FORMAT
+        ",\"latency_p95_us\":%" G_GINT64_FORMAT ",\"latency_p99_us\":%" G_GINT64_FORMAT
+        ",\"latency_max_us\":%" G_GINT64_FORMAT ",\"canvas_width\":%d,\"canvas_height\":%d,\"checksum\":\"%s\"}\n",
+        (unsigned)latencies.size(), elapsed, percentile(0.50), percentile(0.95), percentile(0.99),
+        latencies.empty() ? (gint64)0 : latencies.back(),
+        app_state.document.width, app_state.document.height, g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
+    trace_main_start_us = g_get_monotonic_time();
     setlocale(LC_ALL, "");
     bindtextdomain(GETTEXT_PACKAGE, LOCALEDIR);
     bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
     textdomain(GETTEXT_PACKAGE);
 
-    gtk_init(&argc, &argv);
+    gchar* record_path = NULL;
+    gchar* replay_path = NULL;
+    gboolean replay_max_speed = FALSE;
+    gchar** file_args = NULL;
+    GOptionEntry option_entries[] = {
+        {"record", 0, 0, G_OPTION_ARG_FILENAME, &record_path,
+            N_("Record canvas input events to FILE"), N_("FILE")},
+        {"replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_path,
+            N_("Replay recorded input without showing the window and report latencies"), N_("FILE")},
+        {"max-speed", 0, 0, G_OPTION_ARG_NONE, &replay_max_speed,
+            N_("Replay events back to back instead of at recorded times"), NULL},
+        {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &file_args,
+            NULL, N_("[FILE]")},
+        {NULL}
+    };
+
+    GError* error = NULL;
+    if (!gtk_init_with_args(&argc, &argv, NULL, option_entries, GETTEXT_PACKAGE, &error)) {
+        g_printerr("%s\n", error ? error->message : _("Could not open a display"));
+        g_clear_error(&error);
+        return 1;
+    }
+    if (record_path && !start_input_recording(record_path)) {
+        return 1;
+    }
+    init_tracing();
+    init_surface(800, 600);
+    mark_document_saved(std::string());
+    init_job_pool();
+
+    // The desktop file's %f passes a local path, which the desktop makes
+    // for remote files; file:// URIs from a terminal work too. Only the
+    // first file is opened.
+    std::shared_ptr<StartupImage> startup_image;
+    if (file_args && file_args[0] && !replay_path) {
+        GFile* file = g_file_new_for_commandline_arg(file_args[0]);
+        gchar* path = g_file_get_path(file);
+        if (path) {
+            startup_image = start_startup_image_load(path);
+        } else {
+            g_printerr(_("Could not open %s\n"), file_args[0]);
+        }
+        g_free(path);
+        g_object_unref(file);
+    }
+
+    // Window construction, the part of startup_to_first_frame spent here
+    std::unique_ptr<TraceSpan> build_span(new TraceSpan("build_window"));
+    load_app_stylesheet();
 
     app_state.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(app_state.window), _("Mate-Paint"));
     gtk_window_set_default_size(GTK_WINDOW(app_state.window), 900, 700);
+    g_signal_connect(app_state.window, "delete-event", G_CALLBACK(on_window_delete), NULL);
     g_signal_connect(app_state.window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
     g_signal_connect(app_state.window, "key-press-event", G_CALLBACK(on_key_press), NULL);
     g_signal_connect(app_state.window, "key-release-event", G_CALLBACK(on_key_release), NULL);
+    g_signal_connect(app_state.window, "notify::is-active", G_CALLBACK(on_window_active_changed), NULL);
+    g_signal_connect(app_state.window, "window-state-event", G_CALLBACK(on_window_state_event), NULL);
+    g_signal_connect_after(app_state.window, "map", G_CALLBACK(on_window_map_changed), NULL);
+    g_signal_connect_after(app_state.window, "unmap", G_CALLBACK(on_window_map_changed), NULL);
 
     GtkWidget* main_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     gtk_container_add(GTK_CONTAINER(app_state.window), main_box);
     
     GtkWidget* menubar = gtk_menu_bar_new();
+    app_state.menubar = menubar;
     
     GtkWidget* file_menu = gtk_menu_new();
     GtkWidget* file_menu_item = gtk_menu_item_new_with_label(_("File"));
     
     GtkWidget* file_new = gtk_menu_item_new_with_label(_("New"));
     GtkWidget* file_open = gtk_menu_item_new_with_label(_("Open..."));
+    GtkWidget* file_open_preview = gtk_menu_item_new_with_label(_("Open as Preview..."));
     GtkWidget* file_save = gtk_menu_item_new_with_label(_("Save"));
     GtkWidget* file_save_as = gtk_menu_item_new_with_label(_("Save As..."));
     GtkWidget* file_quit = gtk_menu_item_new_with_label(_("Quit"));
     
     g_signal_connect(file_new, "activate", G_CALLBACK(on_file_new), NULL);
     g_signal_connect(file_open, "activate", G_CALLBACK(on_file_open), NULL);
+    g_signal_connect(file_open_preview, "activate", G_CALLBACK(on_file_open_preview), NULL);
     g_signal_connect(file_save, "activate", G_CALLBACK(on_file_save), NULL);
     g_signal_connect(file_save_as, "activate", G_CALLBACK(on_file_save_as), NULL);
     g_signal_connect(file_quit, "activate", G_CALLBACK(on_file_quit), NULL);
     
     gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), file_new);
     gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), file_open);
+    gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), file_open_preview);
     gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), file_save);
     gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), file_save_as);
     gtk_menu_shell_append(GTK_MENU_SHELL(file_menu), gtk_separator_menu_item_new());
@@ -3922,6 +5822,7 @@ int main(int argc, char* argv[]) {
     gtk_box_pack_start(GTK_BOX(main_box), content_box, TRUE, TRUE, 0);
 
     GtkWidget* tool_column = gtk_box_new(GTK_ORIENTATION_VERTICAL, 8);
+    app_state.tool_column = tool_column;
     gtk_widget_set_margin_start(tool_column, 5);
     gtk_widget_set_margin_end(tool_column, 5);
     gtk_widget_set_margin_top(tool_column, 5);
@@ -4048,8 +5949,8 @@ int main(int argc, char* argv[]) {
     
     app_state.drawing_area = gtk_drawing_area_new();
     gtk_widget_set_size_request(app_state.drawing_area,
-        static_cast<int>(app_state.canvas_width * app_state.zoom_factor),
-        static_cast<int>(app_state.canvas_height * app_state.zoom_factor));
+        static_cast<int>(app_state.document.width * app_state.zoom_factor),
+        static_cast<int>(app_state.document.height * app_state.zoom_factor));
     
     g_signal_connect(app_state.drawing_area, "draw", G_CALLBACK(on_draw), NULL);
     g_signal_connect(app_state.drawing_area, "button-press-event", G_CALLBACK(on_button_press), NULL);
@@ -4065,6 +5966,10 @@ int main(int argc, char* argv[]) {
     );
     
     gtk_container_add(GTK_CONTAINER(scrolled), app_state.drawing_area);
+    g_signal_connect(gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(scrolled)),
+        "value-changed", G_CALLBACK(on_canvas_scrolled), NULL);
+    g_signal_connect(gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scrolled)),
+        "value-changed", G_CALLBACK(on_canvas_scrolled), NULL);
     gtk_box_pack_start(GTK_BOX(content_box), scrolled, TRUE, TRUE, 0);
     
     GtkWidget* bottom_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
@@ -4086,6 +5991,7 @@ int main(int argc, char* argv[]) {
     gtk_box_pack_start(GTK_BOX(bottom_box), app_state.bg_button, FALSE, FALSE, 0);
     
     GtkWidget* palette_grid = gtk_grid_new();
+    app_state.palette_grid = palette_grid;
     gtk_grid_set_column_spacing(GTK_GRID(palette_grid), 2);
     gtk_grid_set_row_spacing(GTK_GRID(palette_grid), 2);
 
@@ -4137,22 +6043,53 @@ int main(int argc, char* argv[]) {
     gtk_box_pack_start(GTK_BOX(status_box), app_state.cursor_position_label, FALSE, FALSE, 0);
 
     gtk_box_pack_end(GTK_BOX(bottom_box), status_box, FALSE, FALSE, 0);
+
+    app_state.job_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_widget_set_valign(app_state.job_box, GTK_ALIGN_CENTER);
+    app_state.job_label = gtk_label_new("");
+    app_state.job_progress_bar = gtk_progress_bar_new();
+    gtk_widget_set_valign(app_state.job_progress_bar, GTK_ALIGN_CENTER);
+    app_state.job_cancel_button = gtk_button_new_with_label(_("Cancel"));
+    g_signal_connect(app_state.job_cancel_button, "clicked", G_CALLBACK(on_job_cancel_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(app_state.job_box), app_state.job_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(app_state.job_box), app_state.job_progress_bar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(app_state.job_box), app_state.job_cancel_button, FALSE, FALSE, 0);
+    gtk_widget_show(app_state.job_label);
+    gtk_widget_show(app_state.job_progress_bar);
+    // Only shown while a long job is running
+    gtk_widget_set_no_show_all(app_state.job_box, TRUE);
+    gtk_box_pack_end(GTK_BOX(bottom_box), app_state.job_box, FALSE, FALSE, 10);
     
     gtk_box_pack_end(GTK_BOX(main_box), bottom_box, FALSE, FALSE, 0);
+    build_span.reset();
     
-    init_surface(app_state.drawing_area);
-    
-    start_ant_animation();
-    
-    gtk_widget_show_all(app_state.window);
-    update_line_thickness_visibility();
-    update_zoom_visibility();
-    gtk_main();
+    int exit_status = 0;
+    if (replay_path) {
+        exit_status = run_input_replay(replay_path, replay_max_speed);
+    } else {
+        if (startup_image) {
+            finish_startup_image_load(*startup_image);
+            startup_image.reset();
+        }
+        std::string orphaned_journal = find_orphaned_journal();
+        if (!orphaned_journal.empty()) {
+            offer_journal_recovery(orphaned_journal);
+        }
+        start_autosave();
+        start_ant_animation();
+
+        gtk_widget_show_all(app_state.window);
+        update_line_thickness_visibility();
+        update_zoom_visibility();
+        gtk_main();
+    }
     
+    shutdown_job_pool();
+    stop_autosave();
+    write_trace_file();
     stop_ant_animation();
-    if (app_state.surface) {
-        cairo_surface_destroy(app_state.surface);
-    }
+    invalidate_selection_outline_cache();
+    release_composite_cache();
     if (app_state.clipboard_surface) {
         cairo_surface_destroy(app_state.clipboard_surface);
     }
@@ -4160,7 +6097,20 @@ int main(int argc, char* argv[]) {
         cairo_surface_destroy(app_state.floating_surface);
     }
 
-    save_custom_palette_colors();
+    if (!app_state.replaying) {
+        save_custom_palette_colors();
+    }
+    stop_input_recording();
+    invalidate_text_preview();
+    clear_glyph_cache();
+    if (app_state.text_layout) {
+        g_object_unref(app_state.text_layout);
+    }
+    document_free(app_state.document);
+    trim_surface_pool(0);
+    g_free(record_path);
+    g_free(replay_path);
+    g_strfreev(file_args);
     
-    return 0;
+    return exit_status;
 }
@@ -0,0 +1,349 @@
+#include "pixel-convert.h"
+
+#include <algorithm>
+#include <cstring>
+
+// The vector bodies read ARGB32 as bytes B, G, R, A, so they need a
+// little-endian target. SSE2 is part of x86-64 and NEON of AArch64, so
+// neither needs a build flag or a runtime check.
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__))
+#include <emmintrin.h>
+#define PIXEL_CONVERT_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define PIXEL_CONVERT_NEON 1
+#endif
+
+namespace {
+
+// x / 255, rounded, for x in [0, 255 * 255]
+inline guint32 div255(guint32 x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// floor(65536 / a), clamped to 16 bits. n * reciprocal[a] >> 16 is then
+// floor(n / a) or one less for any 16-bit n, and one correction step
+// makes it exact without a division.
+struct ReciprocalTable {
+    guint16 values[256];
+
+    ReciprocalTable() {
+        values[0] = 0;
+        for (guint32 a = 1; a < 256; a++) {
+            values[a] = (guint16)std::min<guint32>(65535, 65536 / a);
+        }
+    }
+};
+
+const ReciprocalTable reciprocal;
+
+// round(c * 255 / a), with c clamped to a
+inline guint32 unpremultiply_channel(guint32 c, guint32 a) {
+    c = std::min(c, a);
+    guint32 n = c * 255 + a / 2;
+    guint32 q = (n * reciprocal.values[a]) >> 16;
+    return n - q * a >= a ? q + 1 : q;
+}
+
+// Portable bodies, from pixel begin on. Channel offsets are template
+// arguments so each byte order gets its own loop.
+template <int R, int B>
+void unpremultiply_pixels(const guint32* src, guchar* dst, int begin, int width) {
+    for (int x = begin; x < width; x++) {
+        guint32 p = src[x];
+        guint32 a = p >> 24;
+        guint32 r = (p >> 16) & 0xFF;
+        guint32 g = (p >> 8) & 0xFF;
+        guint32 b = p & 0xFF;
+        if (a == 0) {
+            r = g = b = 0;
+        } else if (a != 255) {
+            r = unpremultiply_channel(r, a);
+            g = unpremultiply_channel(g, a);
+            b = unpremultiply_channel(b, a);
+        }
+        guchar* out = dst + (size_t)x * 4;
+        out[R] = (guchar)r;
+        out[1] = (guchar)g;
+        out[B] = (guchar)b;
+        out[3] = (guchar)a;
+    }
+}
+
+template <int R, int B, int Channels>
+void premultiply_pixels(const guchar* src, guint32* dst, int begin, int width) {
+    for (int x = begin; x < width; x++) {
+        const guchar* in = src + (size_t)x * Channels;
+        guint32 a = Channels == 4 ? in[3] : 255;
+        guint32 r = in[R];
+        guint32 g = in[1];
+        guint32 b = in[B];
+        if (a != 255) {
+            r = div255(r * a);
+            g = div255(g * a);
+            b = div255(b * a);
+        }
+        dst[x] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+}
+
+void pack_rgb_pixels(const guint32* src, guchar* dst, int begin, int width) {
+    for (int x = begin; x < width; x++) {
+        guint32 p = src[x];
+        guchar* out = dst + (size_t)x * 3;
+        out[0] = (guchar)(p >> 16);
+        out[1] = (guchar)(p >> 8);
+        out[2] = (guchar)p;
+    }
+}
+
+#if defined(PIXEL_CONVERT_SSE2)
+
+// Swap the first and third 16-bit channel of each pixel: BGRA <-> RGBA
+inline __m128i swap_red_blue_16(__m128i v) {
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 0, 1, 2));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+// Same on whole 32-bit pixels
+inline __m128i swap_red_blue_32(__m128i v) {
+    __m128i low = _mm_set1_epi32(0x000000FF);
+    __m128i ga = _mm_and_si128(v, _mm_set1_epi32((int)0xFF00FF00));
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+    return _mm_or_si128(ga, _mm_or_si128(r, b));
+}
+
+// Two pixels widened to 16-bit channels B, G, R, A
+inline __m128i unpremultiply_pair(__m128i v, guint32 alpha0, guint32 alpha1) {
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    short m0 = (short)reciprocal.values[alpha0];
+    short m1 = (short)reciprocal.values[alpha1];
+    __m128i m = _mm_set_epi16(m1, m1, m1, m1, m0, m0, m0, m0);
+
+    __m128i c = _mm_min_epi16(v, a);
+    __m128i n = _mm_add_epi16(_mm_sub_epi16(_mm_slli_epi16(c, 8), c), _mm_srli_epi16(a, 1));
+    __m128i q = _mm_mulhi_epu16(n, m);
+    __m128i rest = _mm_sub_epi16(n, _mm_mullo_epi16(q, a));
+    q = _mm_sub_epi16(q, _mm_cmpgt_epi16(rest, _mm_sub_epi16(a, _mm_set1_epi16(1))));
+    q = _mm_andnot_si128(_mm_cmpeq_epi16(a, _mm_setzero_si128()), q);
+    return _mm_or_si128(_mm_andnot_si128(alpha_lanes, q), _mm_and_si128(alpha_lanes, v));
+}
+
+int unpremultiply_vector(const guint32* src, guchar* dst, int width, ChannelOrder order) {
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i out;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alpha_mask), alpha_mask)) == 0xFFFF) {
+            out = order == CHANNELS_RGBA ? swap_red_blue_32(v) : v;
+        } else {
+            __m128i low = unpremultiply_pair(_mm_unpacklo_epi8(v, zero), src[x] >> 24, src[x + 1] >> 24);
+            __m128i high = unpremultiply_pair(_mm_unpackhi_epi8(v, zero), src[x + 2] >> 24, src[x + 3] >> 24);
+            if (order == CHANNELS_RGBA) {
+                low = swap_red_blue_16(low);
+                high = swap_red_blue_16(high);
+            }
+            out = _mm_packus_epi16(low, high);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (size_t)x * 4), out);
+    }
+    return x;
+}
+
+inline __m128i premultiply_pair(__m128i v) {
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(128));
+    __m128i q = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    return _mm_or_si128(_mm_andnot_si128(alpha_lanes, q), _mm_and_si128(alpha_lanes, v));
+}
+
+// Four-channel input only; without SSSE3 shuffles three-byte pixels are
+// left to the portable loop
+int premultiply_vector(const guchar* src, guint32* dst, int width, int channels, ChannelOrder order) {
+    if (channels != 4) return 0;
+
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (size_t)x * 4));
+        __m128i out;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alpha_mask), alpha_mask)) == 0xFFFF) {
+            out = v;
+        } else {
+            out = _mm_packus_epi16(premultiply_pair(_mm_unpacklo_epi8(v, zero)),
+                premultiply_pair(_mm_unpackhi_epi8(v, zero)));
+        }
+        if (order == CHANNELS_RGBA) {
+            out = swap_red_blue_32(out);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), out);
+    }
+    return x;
+}
+
+int pack_rgb_vector(const guint32* src, guchar* dst, int width) {
+    const __m128i low_half = _mm_set_epi32(0, 0, -1, -1);
+    const __m128i low_pixel = _mm_set_epi32(0, -1, 0, -1);
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        // 0x00BBGGRR per pixel, so its low three bytes are R, G, B
+        __m128i v = swap_red_blue_32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)));
+        v = _mm_and_si128(v, _mm_set1_epi32(0x00FFFFFF));
+        // Close the gap inside each 64-bit half, then between the halves
+        v = _mm_or_si128(_mm_and_si128(v, low_pixel), _mm_srli_epi64(_mm_andnot_si128(low_pixel, v), 8));
+        v = _mm_or_si128(_mm_and_si128(v, low_half), _mm_srli_si128(_mm_andnot_si128(low_half, v), 2));
+
+        guchar* out = dst + (size_t)x * 3;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), v);
+        guint32 tail = (guint32)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        std::memcpy(out + 8, &tail, 4);
+    }
+    return x;
+}
+
+#elif defined(PIXEL_CONVERT_NEON)
+
+inline uint8x8_t div255_neon(uint8x8_t c, uint8x8_t a) {
+    uint16x8_t t = vaddq_u16(vmull_u8(c, a), vdupq_n_u16(128));
+    return vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+}
+
+inline uint8x8_t unpremultiply_neon(uint8x8_t c, uint8x8_t a, uint16x8_t a16, uint16x8_t m) {
+    uint16x8_t n = vaddq_u16(vmull_u8(vmin_u8(c, a), vdup_n_u8(255)), vshrq_n_u16(a16, 1));
+    uint16x8_t q = vcombine_u16(
+        vshrn_n_u32(vmull_u16(vget_low_u16(n), vget_low_u16(m)), 16),
+        vshrn_n_u32(vmull_u16(vget_high_u16(n), vget_high_u16(m)), 16));
+    uint16x8_t rest = vsubq_u16(n, vmulq_u16(q, a16));
+    q = vsubq_u16(q, vcgeq_u16(rest, a16));
+    return vand_u8(vmovn_u16(q), vtst_u8(a, a));
+}
+
+int unpremultiply_vector(const guint32* src, guchar* dst, int width, ChannelOrder order) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8x4_t p = vld4_u8(reinterpret_cast<const uint8_t*>(src + x));
+        uint8x8_t a = p.val[3];
+        uint8x8_t b = p.val[0];
+        uint8x8_t g = p.val[1];
+        uint8x8_t r = p.val[2];
+        if (vminv_u8(a) != 255) {
+            guchar alphas[8];
+            guint16 factors[8];
+            vst1_u8(alphas, a);
+            for (int i = 0; i < 8; i++) {
+                factors[i] = reciprocal.values[alphas[i]];
+            }
+            uint16x8_t a16 = vmovl_u8(a);
+            uint16x8_t m = vld1q_u16(factors);
+            b = unpremultiply_neon(b, a, a16, m);
+            g = unpremultiply_neon(g, a, a16, m);
+            r = unpremultiply_neon(r, a, a16, m);
+        }
+
+        uint8x8x4_t out;
+        out.val[0] = order == CHANNELS_RGBA ? r : b;
+        out.val[1] = g;
+        out.val[2] = order == CHANNELS_RGBA ? b : r;
+        out.val[3] = a;
+        vst4_u8(dst + (size_t)x * 4, out);
+    }
+    return x;
+}
+
+int premultiply_vector(const guchar* src, guint32* dst, int width, int channels, ChannelOrder order) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8_t first, g, third, a;
+        if (channels == 4) {
+            uint8x8x4_t p = vld4_u8(src + (size_t)x * 4);
+            a = p.val[3];
+            first = div255_neon(p.val[0], a);
+            g = div255_neon(p.val[1], a);
+            third = div255_neon(p.val[2], a);
+        } else {
+            uint8x8x3_t p = vld3_u8(src + (size_t)x * 3);
+            a = vdup_n_u8(255);
+            first = p.val[0];
+            g = p.val[1];
+            third = p.val[2];
+        }
+
+        uint8x8x4_t out;
+        out.val[0] = order == CHANNELS_RGBA ? third : first;
+        out.val[1] = g;
+        out.val[2] = order == CHANNELS_RGBA ? first : third;
+        out.val[3] = a;
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + x), out);
+    }
+    return x;
+}
+
+int pack_rgb_vector(const guint32* src, guchar* dst, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8x4_t p = vld4_u8(reinterpret_cast<const uint8_t*>(src + x));
+        uint8x8x3_t out;
+        out.val[0] = p.val[2];
+        out.val[1] = p.val[1];
+        out.val[2] = p.val[0];
+        vst3_u8(dst + (size_t)x * 3, out);
+    }
+    return x;
+}
+
+#else
+
+int unpremultiply_vector(const guint32*, guchar*, int, ChannelOrder) {
+    return 0;
+}
+
+int premultiply_vector(const guchar*, guint32*, int, int, ChannelOrder) {
+    return 0;
+}
+
+int pack_rgb_vector(const guint32*, guchar*, int) {
+    return 0;
+}
+
+#endif
+
+}
+
+void unpremultiply_row(const guint32* src, guchar* dst, int width, ChannelOrder order) {
+    int x = unpremultiply_vector(src, dst, width, order);
+    if (order == CHANNELS_RGBA) {
+        unpremultiply_pixels<0, 2>(src, dst, x, width);
+    } else {
+        unpremultiply_pixels<2, 0>(src, dst, x, width);
+    }
+}
+
+void premultiply_row(const guchar* src, guint32* dst, int width, int channels, ChannelOrder order) {
+    int x = premultiply_vector(src, dst, width, channels, order);
+    if (order == CHANNELS_RGBA) {
+        if (channels == 4) {
+            premultiply_pixels<0, 2, 4>(src, dst, x, width);
+        } else {
+            premultiply_pixels<0, 2, 3>(src, dst, x, width);
+        }
+    } else {
+        if (channels == 4) {
+            premultiply_pixels<2, 0, 4>(src, dst, x, width);
+        } else {
+            premultiply_pixels<2, 0, 3>(src, dst, x, width);
+        }
+    }
+}
+
+void pack_rgb_row(const guint32* src, guchar* dst, int width) {
+    int x = pack_rgb_vector(src, dst, width);
+    pack_rgb_pixels(src, dst, x, width);
+}
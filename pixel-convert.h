@@ -0,0 +1,35 @@
+// Conversions between cairo's premultiplied ARGB32 and the straight 8-bit
+// pixels of image files, pixbufs and the clipboard. Every row function has
+// an SSE2 (x86-64) or NEON (AArch64) body chosen at compile time and a
+// portable one for the remaining pixels, and all of them give identical
+// results. Safe on any thread.
+#ifndef MATE_PAINT_PIXEL_CONVERT_H
+#define MATE_PAINT_PIXEL_CONVERT_H
+
+#include <glib.h>
+
+// Byte order of straight (non-premultiplied) 8-bit pixels
+enum ChannelOrder {
+    CHANNELS_RGBA,
+    CHANNELS_BGRA
+};
+
+// Premultiplied ARGB32 to straight 4-byte pixels, rounding to nearest
+void unpremultiply_row(const guint32* src, guchar* dst, int width, ChannelOrder order);
+// Straight pixels to premultiplied ARGB32. channels is 3 (no alpha, read
+// as opaque) or 4.
+void premultiply_row(const guchar* src, guint32* dst, int width, int channels, ChannelOrder order);
+// ARGB32 to packed RGB bytes. The colour stays premultiplied, which is the
+// image flattened onto black.
+void pack_rgb_row(const guint32* src, guchar* dst, int width);
+
+// A 0..1 colour channel to 8 bits, rounded to nearest, and back
+inline guint32 channel_to_byte(double channel) {
+    return channel <= 0.0 ? 0 : channel >= 1.0 ? 255 : (guint32)(channel * 255.0 + 0.5);
+}
+
+inline double byte_to_channel(guint32 byte) {
+    return byte * (1.0 / 255.0);
+}
+
+#endif
@@ -0,0 +1,324 @@
+#include "pixel-kernels.h"
+#include "surface-pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+// The vector mask blend reads ARGB32 as bytes B, G, R, A, as pixel-convert
+// does, so it needs a little-endian target
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__))
+#include <emmintrin.h>
+#define PIXEL_KERNELS_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define PIXEL_KERNELS_NEON 1
+#endif
+
+SurfaceRemap make_surface_remap(PixelRemap remap, cairo_surface_t* source, cairo_surface_t* result) {
+    SurfaceRemap r;
+    r.remap = remap;
+    r.src_data = cairo_image_surface_get_data(source);
+    r.src_stride = cairo_image_surface_get_stride(source);
+    r.src_width = cairo_image_surface_get_width(source);
+    r.src_height = cairo_image_surface_get_height(source);
+    r.dst_data = cairo_image_surface_get_data(result);
+    r.dst_stride = cairo_image_surface_get_stride(result);
+    r.dst_width = cairo_image_surface_get_width(result);
+    r.dst_height = cairo_image_surface_get_height(result);
+    return r;
+}
+
+// Fill destination rows [begin, end) from the source pixel each maps to
+void remap_pixel_rows(const SurfaceRemap& r, int begin, int end) {
+    for (int y = begin; y < end; y++) {
+        guint32* dst = reinterpret_cast<guint32*>(r.dst_data + (size_t)y * r.dst_stride);
+
+        switch (r.remap) {
+            case REMAP_ROTATE_CLOCKWISE:
+                for (int x = 0; x < r.dst_width; x++) {
+                    const guint32* src = reinterpret_cast<const guint32*>(
+                        r.src_data + (size_t)(r.src_height - 1 - x) * r.src_stride);
+                    dst[x] = src[y];
+                }
+                break;
+            case REMAP_ROTATE_COUNTER_CLOCKWISE:
+                for (int x = 0; x < r.dst_width; x++) {
+                    const guint32* src = reinterpret_cast<const guint32*>(
+                        r.src_data + (size_t)x * r.src_stride);
+                    dst[x] = src[r.src_width - 1 - y];
+                }
+                break;
+            case REMAP_FLIP_HORIZONTAL: {
+                const guint32* src = reinterpret_cast<const guint32*>(r.src_data + (size_t)y * r.src_stride);
+                for (int x = 0; x < r.dst_width; x++) {
+                    dst[x] = src[r.src_width - 1 - x];
+                }
+                break;
+            }
+            case REMAP_FLIP_VERTICAL:
+                memcpy(dst, r.src_data + (size_t)(r.src_height - 1 - y) * r.src_stride, (size_t)r.dst_width * 4);
+                break;
+            case REMAP_SCALE_NEAREST: {
+                int sy = std::min(r.src_height - 1, (int)((y + 0.5) * r.src_height / r.dst_height));
+                const guint32* src = reinterpret_cast<const guint32*>(r.src_data + (size_t)sy * r.src_stride);
+                for (int x = 0; x < r.dst_width; x++) {
+                    int sx = std::min(r.src_width - 1, (int)((x + 0.5) * r.src_width / r.dst_width));
+                    dst[x] = src[sx];
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Scanline fill of the 4-connected region of target-coloured pixels around
+// the start point. Only reads the surface, so it can run while the canvas
+// is still being displayed.
+void compute_flood_fill(cairo_surface_t* surface, int start_x, int start_y, guint32 target,
+    FloodFillMask& mask, GCancellable* cancellable) {
+    const unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+
+    mask.filled.assign((size_t)width * height, 0);
+    mask.min_x = mask.max_x = start_x;
+    mask.min_y = mask.max_y = start_y;
+
+    std::vector<std::pair<int, int>> seeds;
+    seeds.push_back({start_x, start_y});
+    int spans = 0;
+
+    while (!seeds.empty()) {
+        if ((++spans & 1023) == 0 && g_cancellable_is_cancelled(cancellable)) return;
+
+        int x = seeds.back().first;
+        int y = seeds.back().second;
+        seeds.pop_back();
+
+        const guint32* row = reinterpret_cast<const guint32*>(data + (size_t)y * stride);
+        unsigned char* filled = &mask.filled[(size_t)y * width];
+        if (filled[x] || row[x] != target) continue;
+
+        int left = x;
+        while (left > 0 && !filled[left - 1] && row[left - 1] == target) left--;
+        int right = x;
+        while (right < width - 1 && !filled[right + 1] && row[right + 1] == target) right++;
+        memset(filled + left, 1, right - left + 1);
+
+        mask.min_x = std::min(mask.min_x, left);
+        mask.max_x = std::max(mask.max_x, right);
+        mask.min_y = std::min(mask.min_y, y);
+        mask.max_y = std::max(mask.max_y, y);
+
+        for (int ny = y - 1; ny <= y + 1; ny += 2) {
+            if (ny < 0 || ny >= height) continue;
+
+            const guint32* next_row = reinterpret_cast<const guint32*>(data + (size_t)ny * stride);
+            const unsigned char* next_filled = &mask.filled[(size_t)ny * width];
+            bool in_run = false;
+            for (int nx = left; nx <= right; nx++) {
+                bool fillable = !next_filled[nx] && next_row[nx] == target;
+                if (fillable && !in_run) {
+                    seeds.push_back({nx, ny});
+                }
+                in_run = fillable;
+            }
+        }
+    }
+}
+
+// Write the replacement colour into mask rows [begin, end), counted from
+// the top of the mask's bounding box
+void apply_flood_fill_rows(cairo_surface_t* surface, const FloodFillMask& mask, guint32 replacement,
+    int begin, int end) {
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int width = cairo_image_surface_get_width(surface);
+
+    for (int y = mask.min_y + begin; y < mask.min_y + end; y++) {
+        guint32* row = reinterpret_cast<guint32*>(data + (size_t)y * stride);
+        const unsigned char* filled = &mask.filled[(size_t)y * width];
+        for (int x = mask.min_x; x <= mask.max_x; x++) {
+            if (filled[x]) row[x] = replacement;
+        }
+    }
+}
+
+cairo_surface_t* clone_surface(cairo_surface_t* source, int width, int height) {
+    if (!source || width <= 0 || height <= 0) {
+        return nullptr;
+    }
+
+    // Same-sized ARGB32 copies are a straight row copy into a pooled buffer
+    if (cairo_image_surface_get_format(source) == CAIRO_FORMAT_ARGB32 &&
+        cairo_image_surface_get_width(source) == width &&
+        cairo_image_surface_get_height(source) == height) {
+        cairo_surface_t* copy = create_pooled_surface_uninitialized(width, height);
+        cairo_surface_flush(source);
+        cairo_surface_flush(copy);
+
+        const unsigned char* src_data = cairo_image_surface_get_data(source);
+        int src_stride = cairo_image_surface_get_stride(source);
+        unsigned char* dst_data = cairo_image_surface_get_data(copy);
+        int dst_stride = cairo_image_surface_get_stride(copy);
+        for (int y = 0; y < height; y++) {
+            memcpy(dst_data + (size_t)y * dst_stride, src_data + (size_t)y * src_stride, (size_t)width * 4);
+        }
+        cairo_surface_mark_dirty(copy);
+        return copy;
+    }
+
+    cairo_surface_t* copy = create_pooled_surface(width, height);
+    cairo_t* cr = cairo_create(copy);
+    cairo_set_source_surface(cr, source, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return copy;
+}
+
+// One freehand stroke segment with the current source and operator
+void stroke_segment(cairo_t* cr, double x1, double y1, double x2, double y2, double width) {
+    cairo_set_line_width(cr, width);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_move_to(cr, x1, y1);
+    cairo_line_to(cr, x2, y2);
+    cairo_stroke(cr);
+}
+
+namespace {
+
+// x / 255, rounded, for x in [0, 255 * 255]
+inline guint32 div255(guint32 x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// OVER of the premultiplied solid through coverage, four pixels at a time:
+// every byte becomes dst * (255 - alpha * m / 255) / 255 + solid * m / 255,
+// rounded the way the scalar loop rounds. Returns how many pixels were
+// done; the caller finishes the rest.
+int blend_mask_pixels(guint32* dst, const unsigned char* coverage, int count, guint32 solid) {
+    int x = 0;
+#if defined(PIXEL_KERNELS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i source = _mm_unpacklo_epi8(_mm_set1_epi32((int)solid), zero);
+    for (; x + 4 <= count; x += 4) {
+        guint32 m4;
+        memcpy(&m4, coverage + x, 4);
+        // Each coverage byte spread over the four bytes of its pixel
+        __m128i m = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)m4), zero), zero);
+        m = _mm_or_si128(m, _mm_slli_epi32(m, 8));
+        m = _mm_or_si128(m, _mm_slli_epi32(m, 16));
+        __m128i m_low = _mm_unpacklo_epi8(m, zero);
+        __m128i m_high = _mm_unpackhi_epi8(m, zero);
+
+        __m128i s_low = _mm_add_epi16(_mm_mullo_epi16(source, m_low), bias);
+        __m128i s_high = _mm_add_epi16(_mm_mullo_epi16(source, m_high), bias);
+        s_low = _mm_srli_epi16(_mm_add_epi16(s_low, _mm_srli_epi16(s_low, 8)), 8);
+        s_high = _mm_srli_epi16(_mm_add_epi16(s_high, _mm_srli_epi16(s_high, 8)), 8);
+
+        // 255 minus the source alpha of each pixel, in all its lanes
+        __m128i i_low = _mm_sub_epi16(full,
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_low, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+        __m128i i_high = _mm_sub_epi16(full,
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_high, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x));
+        __m128i d_low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), i_low), bias);
+        __m128i d_high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), i_high), bias);
+        d_low = _mm_srli_epi16(_mm_add_epi16(d_low, _mm_srli_epi16(d_low, 8)), 8);
+        d_high = _mm_srli_epi16(_mm_add_epi16(d_high, _mm_srli_epi16(d_high, 8)), 8);
+
+        __m128i result = _mm_packus_epi16(_mm_add_epi16(d_low, s_low), _mm_add_epi16(d_high, s_high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), result);
+    }
+#elif defined(PIXEL_KERNELS_NEON)
+    static const uint8_t spread_low[8] = {0, 0, 0, 0, 1, 1, 1, 1};
+    static const uint8_t spread_high[8] = {2, 2, 2, 2, 3, 3, 3, 3};
+    static const uint8_t alphas[8] = {3, 3, 3, 3, 7, 7, 7, 7};
+    const uint8x8_t low_index = vld1_u8(spread_low);
+    const uint8x8_t high_index = vld1_u8(spread_high);
+    const uint8x8_t alpha_index = vld1_u8(alphas);
+    const uint16x8_t bias = vdupq_n_u16(128);
+    const uint8x8_t full = vdup_n_u8(255);
+    const uint8x8_t source = vreinterpret_u8_u32(vdup_n_u32(solid));
+    for (; x + 4 <= count; x += 4) {
+        guint32 m4;
+        memcpy(&m4, coverage + x, 4);
+        uint8x8_t m = vreinterpret_u8_u32(vdup_n_u32(m4));
+        uint16x8_t s_low = vaddq_u16(vmull_u8(source, vtbl1_u8(m, low_index)), bias);
+        uint16x8_t s_high = vaddq_u16(vmull_u8(source, vtbl1_u8(m, high_index)), bias);
+        uint8x8_t s8_low = vshrn_n_u16(vaddq_u16(s_low, vshrq_n_u16(s_low, 8)), 8);
+        uint8x8_t s8_high = vshrn_n_u16(vaddq_u16(s_high, vshrq_n_u16(s_high, 8)), 8);
+
+        uint8x16_t d = vld1q_u8(reinterpret_cast<const uint8_t*>(dst + x));
+        uint16x8_t d_low = vaddq_u16(vmull_u8(vget_low_u8(d), vsub_u8(full, vtbl1_u8(s8_low, alpha_index))), bias);
+        uint16x8_t d_high = vaddq_u16(vmull_u8(vget_high_u8(d), vsub_u8(full, vtbl1_u8(s8_high, alpha_index))), bias);
+        uint8x8_t d8_low = vshrn_n_u16(vaddq_u16(d_low, vshrq_n_u16(d_low, 8)), 8);
+        uint8x8_t d8_high = vshrn_n_u16(vaddq_u16(d_high, vshrq_n_u16(d_high, 8)), 8);
+
+        vst1q_u8(reinterpret_cast<uint8_t*>(dst + x),
+            vcombine_u8(vqadd_u8(d8_low, s8_low), vqadd_u8(d8_high, s8_high)));
+    }
+#else
+    (void)dst;
+    (void)coverage;
+    (void)count;
+    (void)solid;
+#endif
+    return x;
+}
+
+}
+
+void blend_color_through_mask(cairo_surface_t* surface, cairo_surface_t* mask, int x, int y, guint32 color) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int mask_width = cairo_image_surface_get_width(mask);
+    int mask_height = cairo_image_surface_get_height(mask);
+
+    int x1 = std::max(0, x);
+    int y1 = std::max(0, y);
+    int x2 = std::min(width, x + mask_width);
+    int y2 = std::min(height, y + mask_height);
+    if (x1 >= x2 || y1 >= y2) return;
+
+    guint32 a = color >> 24;
+    guint32 r = div255(((color >> 16) & 0xFF) * a);
+    guint32 g = div255(((color >> 8) & 0xFF) * a);
+    guint32 b = div255((color & 0xFF) * a);
+    guint32 solid = (a << 24) | (r << 16) | (g << 8) | b;
+
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    const unsigned char* mask_data = cairo_image_surface_get_data(mask);
+    int mask_stride = cairo_image_surface_get_stride(mask);
+
+    for (int row = y1; row < y2; row++) {
+        guint32* dst = reinterpret_cast<guint32*>(data + (size_t)row * stride);
+        const unsigned char* coverage = mask_data + (size_t)(row - y) * mask_stride - x;
+
+        int done = blend_mask_pixels(dst + x1, coverage + x1, x2 - x1, solid);
+        for (int col = x1 + done; col < x2; col++) {
+            guint32 m = coverage[col];
+            if (m == 255 && a == 255) {
+                dst[col] = solid;
+                continue;
+            }
+
+            guint32 sa = div255(a * m);
+            guint32 inverse = 255 - sa;
+            guint32 d = dst[col];
+            guint32 da = div255((d >> 24) * inverse) + sa;
+            guint32 dr = div255(((d >> 16) & 0xFF) * inverse) + div255(r * m);
+            guint32 dg = div255(((d >> 8) & 0xFF) * inverse) + div255(g * m);
+            guint32 db = div255((d & 0xFF) * inverse) + div255(b * m);
+            dst[col] = (da << 24) | (dr << 16) | (dg << 8) | db;
+        }
+    }
+}
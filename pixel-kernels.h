@@ -0,0 +1,56 @@
+// Pixel kernels shared by mate-paint and its benchmarks. They only touch
+// cairo image surfaces, so they are safe to run on worker threads.
+#ifndef MATE_PAINT_PIXEL_KERNELS_H
+#define MATE_PAINT_PIXEL_KERNELS_H
+
+#include <cairo.h>
+#include <gio/gio.h>
+#include <vector>
+
+// Per-pixel canvas transforms
+enum PixelRemap {
+    REMAP_ROTATE_CLOCKWISE,
+    REMAP_ROTATE_COUNTER_CLOCKWISE,
+    REMAP_FLIP_HORIZONTAL,
+    REMAP_FLIP_VERTICAL,
+    REMAP_SCALE_NEAREST
+};
+
+struct SurfaceRemap {
+    PixelRemap remap;
+    const unsigned char* src_data;
+    int src_stride;
+    int src_width;
+    int src_height;
+    unsigned char* dst_data;
+    int dst_stride;
+    int dst_width;
+    int dst_height;
+};
+
+SurfaceRemap make_surface_remap(PixelRemap remap, cairo_surface_t* source, cairo_surface_t* result);
+void remap_pixel_rows(const SurfaceRemap& r, int begin, int end);
+
+// Pixels reached by a flood fill and their bounding box
+struct FloodFillMask {
+    std::vector<unsigned char> filled;
+    int min_x = 0;
+    int min_y = 0;
+    int max_x = 0;
+    int max_y = 0;
+};
+
+void compute_flood_fill(cairo_surface_t* surface, int start_x, int start_y, guint32 target,
+    FloodFillMask& mask, GCancellable* cancellable);
+void apply_flood_fill_rows(cairo_surface_t* surface, const FloodFillMask& mask, guint32 replacement,
+    int begin, int end);
+
+cairo_surface_t* clone_surface(cairo_surface_t* source, int width, int height);
+void stroke_segment(cairo_t* cr, double x1, double y1, double x2, double y2, double width);
+
+// Blend a solid colour (straight ARGB) into an ARGB32 surface through an
+// A8 coverage mask whose top-left corner lands at (x, y). Clips to the
+// surface; the caller flushes and marks the surface dirty around a batch.
+void blend_color_through_mask(cairo_surface_t* surface, cairo_surface_t* mask, int x, int y, guint32 color);
+
+#endif
@@ -0,0 +1,347 @@
+#include "shape-raster.h"
+#include "pixel-convert.h"
+
+#include <cmath>
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__))
+#include <emmintrin.h>
+#define SHAPE_RASTER_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SHAPE_RASTER_NEON 1
+#endif
+
+namespace {
+
+typedef std::pair<double, double> Point;
+
+// cairo's defaults: miter length to line width, and how far a flattened
+// curve may stray from the true one
+const double miter_limit = 10.0;
+const double flatten_tolerance = 0.1;
+
+inline guint32 div255(guint32 x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+bool is_finite_point(const Point& point) {
+    return std::isfinite(point.first) && std::isfinite(point.second);
+}
+
+// Rows whose centre lies in [top, bottom), within the clip. Both ends are
+// clamped to the clip before the conversion so far-off shapes stay in range.
+void covered_rows(const ShapeOutline& outline, double top, double bottom, int& begin, int& end) {
+    double clip_top = outline.clip_y;
+    double clip_bottom = (double)outline.clip_y + outline.clip_height;
+    begin = (int)std::min(std::max(clip_top, std::ceil(top - 0.5)), clip_bottom);
+    end = (int)std::min(std::max(clip_top, std::ceil(bottom - 0.5)), clip_bottom);
+}
+
+// Columns are clamped to the clip first, which keeps their order and the
+// conversion in range
+void add_crossing(ShapeOutline& outline, int y, double x, int winding) {
+    double column = std::ceil(x - 0.5);
+    column = std::min<double>(std::max<double>(column, outline.clip_x), outline.clip_x + outline.clip_width);
+    ShapeCrossing crossing = {y, (int)column, winding};
+    outline.crossings.push_back(crossing);
+}
+
+// Downward edges enter the shape from the left; direction flips that
+void add_edge(ShapeOutline& outline, const Point& from, const Point& to, int direction) {
+    if (from.second == to.second) return;
+    const Point& top = from.second < to.second ? from : to;
+    const Point& bottom = from.second < to.second ? to : from;
+    int winding = from.second < to.second ? direction : -direction;
+
+    int begin, end;
+    covered_rows(outline, top.second, bottom.second, begin, end);
+    double slope = (bottom.first - top.first) / (bottom.second - top.second);
+    for (int y = begin; y < end; y++) {
+        add_crossing(outline, y, top.first + (y + 0.5 - top.second) * slope, winding);
+    }
+}
+
+// A convex piece of a stroke, turned so it winds the same way as every
+// other piece and overlaps add up instead of cancelling
+void add_stroke_piece(ShapeOutline& outline, const Point* points, int count) {
+    double area = 0;
+    for (int i = 0; i < count; i++) {
+        const Point& a = points[i];
+        const Point& b = points[(i + 1) % count];
+        area += a.first * b.second - b.first * a.second;
+    }
+    int direction = area > 0 ? -1 : 1;
+    for (int i = 0; i < count; i++) {
+        add_edge(outline, points[i], points[(i + 1) % count], direction);
+    }
+}
+
+Point offset_point(const Point& point, double dx, double dy) {
+    return Point(point.first + dx, point.second + dy);
+}
+
+void store_pixels(guint32* dst, int count, guint32 pixel) {
+    int x = 0;
+#if defined(SHAPE_RASTER_SSE2)
+    __m128i value = _mm_set1_epi32((int)pixel);
+    for (; x + 8 <= count; x += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), value);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 4), value);
+    }
+#elif defined(SHAPE_RASTER_NEON)
+    uint32x4_t value = vdupq_n_u32(pixel);
+    for (; x + 8 <= count; x += 8) {
+        vst1q_u32(dst + x, value);
+        vst1q_u32(dst + x + 4, value);
+    }
+#endif
+    for (; x < count; x++) {
+        dst[x] = pixel;
+    }
+}
+
+// OVER with a premultiplied source: every byte, alpha included, becomes
+// dst * (255 - alpha) / 255 + src
+void blend_pixels(guint32* dst, int count, guint32 pixel) {
+    guint32 inverse = 255 - (pixel >> 24);
+    int x = 0;
+#if defined(SHAPE_RASTER_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i factor = _mm_set1_epi16((short)inverse);
+    const __m128i source = _mm_set1_epi32((int)pixel);
+    for (; x + 4 <= count; x += 4) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x));
+        __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), factor), bias);
+        __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), factor), bias);
+        low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+        high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_add_epi8(_mm_packus_epi16(low, high), source));
+    }
+#elif defined(SHAPE_RASTER_NEON)
+    const uint16x8_t bias = vdupq_n_u16(128);
+    const uint8x8_t factor = vdup_n_u8((uint8_t)inverse);
+    const uint8x16_t source = vreinterpretq_u8_u32(vdupq_n_u32(pixel));
+    for (; x + 4 <= count; x += 4) {
+        uint8x16_t d = vld1q_u8(reinterpret_cast<const uint8_t*>(dst + x));
+        uint16x8_t low = vaddq_u16(vmull_u8(vget_low_u8(d), factor), bias);
+        uint16x8_t high = vaddq_u16(vmull_u8(vget_high_u8(d), factor), bias);
+        uint8x16_t scaled = vcombine_u8(vshrn_n_u16(vaddq_u16(low, vshrq_n_u16(low, 8)), 8),
+            vshrn_n_u16(vaddq_u16(high, vshrq_n_u16(high, 8)), 8));
+        vst1q_u8(reinterpret_cast<uint8_t*>(dst + x), vaddq_u8(scaled, source));
+    }
+#endif
+    for (; x < count; x++) {
+        guint32 d = dst[x];
+        guint32 result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            result |= (div255(((d >> shift) & 0xFF) * inverse) + ((pixel >> shift) & 0xFF)) << shift;
+        }
+        dst[x] = result;
+    }
+}
+
+}
+
+ShapeOutline create_surface_outline(cairo_surface_t* surface) {
+    return ShapeOutline(0, 0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
+}
+
+void outline_add_polygon(ShapeOutline& outline, const std::vector<std::pair<double, double>>& points) {
+    if (points.size() < 3) return;
+    for (const Point& point : points) {
+        if (!is_finite_point(point)) return;
+    }
+    for (size_t i = 0; i < points.size(); i++) {
+        add_edge(outline, points[i], points[(i + 1) % points.size()], 1);
+    }
+}
+
+void outline_add_rectangle(ShapeOutline& outline, double x, double y, double width, double height) {
+    outline_add_rounded_rectangle(outline, x, y, width, height, 0);
+}
+
+void outline_add_ellipse(ShapeOutline& outline, double cx, double cy, double rx, double ry) {
+    if (!(rx > 0 && ry > 0) || !std::isfinite(cx + cy + rx + ry)) return;
+
+    int begin, end;
+    covered_rows(outline, cy - ry, cy + ry, begin, end);
+    for (int y = begin; y < end; y++) {
+        double dy = (y + 0.5 - cy) / ry;
+        double half = rx * std::sqrt(std::max(0.0, 1.0 - dy * dy));
+        add_crossing(outline, y, cx - half, 1);
+        add_crossing(outline, y, cx + half, -1);
+    }
+}
+
+void outline_add_rounded_rectangle(ShapeOutline& outline, double x, double y, double width, double height,
+    double radius) {
+    if (!(width > 0 && height > 0) || !std::isfinite(x + y + width + height)) return;
+    radius = CLAMP(radius, 0.0, std::min(width, height) / 2.0);
+
+    int begin, end;
+    covered_rows(outline, y, y + height, begin, end);
+    for (int row = begin; row < end; row++) {
+        // How far into the top or bottom band of corners the row centre is
+        double centre = row + 0.5;
+        double depth = std::max(y + radius - centre, centre - (y + height - radius));
+        double inset = depth > 0 ? radius - std::sqrt(std::max(0.0, radius * radius - depth * depth)) : 0;
+        add_crossing(outline, row, x + inset, 1);
+        add_crossing(outline, row, x + width - inset, -1);
+    }
+}
+
+void outline_add_polygon_stroke(ShapeOutline& outline, const std::vector<std::pair<double, double>>& points,
+    double line_width) {
+    // cairo skips zero-length segments, so repeated points are dropped
+    std::vector<Point> path;
+    for (const Point& point : points) {
+        if (!is_finite_point(point)) return;
+        if (path.empty() || point != path.back()) {
+            path.push_back(point);
+        }
+    }
+    while (path.size() > 1 && path.front() == path.back()) {
+        path.pop_back();
+    }
+    if (path.size() < 2 || !(line_width > 0)) return;
+
+    double half = line_width / 2.0;
+    size_t count = path.size();
+    std::vector<Point> directions(count);
+    for (size_t i = 0; i < count; i++) {
+        const Point& a = path[i];
+        const Point& b = path[(i + 1) % count];
+        double length = std::hypot(b.first - a.first, b.second - a.second);
+        directions[i] = Point((b.first - a.first) / length, (b.second - a.second) / length);
+
+        double nx = -directions[i].second * half;
+        double ny = directions[i].first * half;
+        Point quad[4] = {
+            offset_point(a, nx, ny), offset_point(b, nx, ny),
+            offset_point(b, -nx, -ny), offset_point(a, -nx, -ny)
+        };
+        add_stroke_piece(outline, quad, 4);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const Point& in = directions[(i + count - 1) % count];
+        const Point& out = directions[i];
+        double cross = in.first * out.second - in.second * out.first;
+        if (cross == 0) continue;
+
+        // The join goes on the side the path turns away from
+        double side = cross > 0 ? -half : half;
+        double nx1 = -in.second * side;
+        double ny1 = in.first * side;
+        double nx2 = -out.second * side;
+        double ny2 = out.first * side;
+        double dot = in.first * out.first + in.second * out.second;
+        const Point& corner = path[i];
+        if (2 <= miter_limit * miter_limit * (1 + dot)) {
+            Point miter[4] = {
+                corner, offset_point(corner, nx1, ny1),
+                offset_point(corner, (nx1 + nx2) / (1 + dot), (ny1 + ny2) / (1 + dot)),
+                offset_point(corner, nx2, ny2)
+            };
+            add_stroke_piece(outline, miter, 4);
+        } else {
+            Point bevel[3] = {corner, offset_point(corner, nx1, ny1), offset_point(corner, nx2, ny2)};
+            add_stroke_piece(outline, bevel, 3);
+        }
+    }
+}
+
+void outline_add_ellipse_stroke(ShapeOutline& outline, double cx, double cy, double rx, double ry,
+    double line_width) {
+    if (!(rx > 0 && ry > 0) || !std::isfinite(cx + cy + rx + ry)) return;
+
+    // Segments short enough that none bulges more than the tolerance
+    // from the widest part of the curve
+    double radius = std::max(rx, ry);
+    double step = radius > flatten_tolerance ? 2 * std::acos(1 - flatten_tolerance / radius) : M_PI / 2;
+    int count = std::max(8, (int)std::ceil(2 * M_PI / step));
+    std::vector<Point> points(count);
+    for (int i = 0; i < count; i++) {
+        double angle = 2 * M_PI * i / count;
+        points[i] = Point(cx + rx * std::cos(angle), cy + ry * std::sin(angle));
+    }
+    outline_add_polygon_stroke(outline, points, line_width);
+}
+
+std::vector<PixelSpan> rasterize_outline(const ShapeOutline& outline, FillRule rule) {
+    std::vector<PixelSpan> spans;
+    if (outline.crossings.empty()) return spans;
+
+    // Bucket the crossings by row, then sort each row's handful by column
+    int rows = outline.clip_height;
+    std::vector<size_t> starts(rows + 1, 0);
+    for (const ShapeCrossing& crossing : outline.crossings) {
+        starts[crossing.y - outline.clip_y + 1]++;
+    }
+    for (int row = 0; row < rows; row++) {
+        starts[row + 1] += starts[row];
+    }
+    std::vector<ShapeCrossing> sorted(outline.crossings.size());
+    std::vector<size_t> next(starts.begin(), starts.end() - 1);
+    for (const ShapeCrossing& crossing : outline.crossings) {
+        sorted[next[crossing.y - outline.clip_y]++] = crossing;
+    }
+
+    for (int row = 0; row < rows; row++) {
+        ShapeCrossing* begin = sorted.data() + starts[row];
+        ShapeCrossing* end = sorted.data() + starts[row + 1];
+        std::sort(begin, end, [](const ShapeCrossing& a, const ShapeCrossing& b) {
+            return a.x < b.x;
+        });
+
+        int winding = 0;
+        int span_start = 0;
+        for (ShapeCrossing* crossing = begin; crossing != end; crossing++) {
+            bool was_inside = rule == FILL_RULE_EVEN_ODD ? (winding & 1) != 0 : winding != 0;
+            winding += crossing->winding;
+            bool inside = rule == FILL_RULE_EVEN_ODD ? (winding & 1) != 0 : winding != 0;
+            if (!was_inside && inside) {
+                span_start = crossing->x;
+            } else if (was_inside && !inside && crossing->x > span_start) {
+                int y = outline.clip_y + row;
+                if (!spans.empty() && spans.back().y == y && spans.back().x + spans.back().width == span_start) {
+                    spans.back().width = crossing->x - spans.back().x;
+                } else {
+                    PixelSpan span = {y, span_start, crossing->x - span_start};
+                    spans.push_back(span);
+                }
+            }
+        }
+    }
+    return spans;
+}
+
+void fill_spans(cairo_surface_t* surface, const std::vector<PixelSpan>& spans, guint32 color) {
+    guchar straight[4] = {
+        (guchar)(color >> 16), (guchar)(color >> 8), (guchar)color, (guchar)(color >> 24)
+    };
+    guint32 pixel;
+    premultiply_row(straight, &pixel, 1, 4, CHANNELS_RGBA);
+    if ((pixel >> 24) == 0) return;
+
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    bool opaque = (pixel >> 24) == 255;
+
+    for (const PixelSpan& span : spans) {
+        int x1 = std::max(0, span.x);
+        int x2 = std::min(width, span.x + span.width);
+        if (span.y < 0 || span.y >= height || x1 >= x2) continue;
+
+        guint32* row = reinterpret_cast<guint32*>(data + (size_t)span.y * stride) + x1;
+        if (opaque) {
+            store_pixels(row, x2 - x1, pixel);
+        } else {
+            blend_pixels(row, x2 - x1, pixel);
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#include "surface-pool.h"
+
+#include <glib.h>
+#include <list>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+const size_t pool_alignment = 4096;
+// Idle memory kept around for reuse; enough for a few 4K canvases
+const size_t pool_idle_limit = 256 * 1024 * 1024;
+
+struct PooledBuffer {
+    unsigned char* data;
+    size_t size;
+};
+
+GMutex pool_mutex;
+// Most recently released first
+std::list<PooledBuffer> idle_buffers;
+size_t idle_bytes = 0;
+cairo_user_data_key_t pooled_buffer_key;
+
+// Caller holds pool_mutex
+void evict_idle_buffers(size_t max_bytes) {
+    while (idle_bytes > max_bytes && !idle_buffers.empty()) {
+        PooledBuffer& oldest = idle_buffers.back();
+        free(oldest.data);
+        idle_bytes -= oldest.size;
+        idle_buffers.pop_back();
+    }
+}
+
+unsigned char* take_buffer(size_t size) {
+    unsigned char* data = nullptr;
+
+    g_mutex_lock(&pool_mutex);
+    for (auto it = idle_buffers.begin(); it != idle_buffers.end(); ++it) {
+        if (it->size == size) {
+            data = it->data;
+            idle_bytes -= size;
+            idle_buffers.erase(it);
+            break;
+        }
+    }
+    g_mutex_unlock(&pool_mutex);
+
+    if (!data) {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, pool_alignment, size) != 0) {
+            return nullptr;
+        }
+        data = static_cast<unsigned char*>(memory);
+    }
+    return data;
+}
+
+// Runs when cairo finalizes a pooled surface, possibly on a worker thread
+void release_buffer(void* user_data) {
+    PooledBuffer* buffer = static_cast<PooledBuffer*>(user_data);
+
+    g_mutex_lock(&pool_mutex);
+    idle_buffers.push_front(*buffer);
+    idle_bytes += buffer->size;
+    evict_idle_buffers(pool_idle_limit);
+    g_mutex_unlock(&pool_mutex);
+
+    delete buffer;
+}
+
+cairo_surface_t* create_surface_on_pool(int width, int height, bool clear) {
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    if (width <= 0 || height <= 0 || stride <= 0) {
+        return cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    }
+
+    size_t size = (size_t)stride * height;
+    unsigned char* data = take_buffer(size);
+    if (!data) {
+        return cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    }
+    if (clear) {
+        memset(data, 0, size);
+    }
+
+    cairo_surface_t* surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32, width, height, stride);
+    PooledBuffer* buffer = new PooledBuffer{data, size};
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_set_user_data(surface, &pooled_buffer_key, buffer, release_buffer) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        release_buffer(buffer);
+        return cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    }
+    return surface;
+}
+
+}
+
+cairo_surface_t* create_pooled_surface(int width, int height) {
+    return create_surface_on_pool(width, height, true);
+}
+
+cairo_surface_t* create_pooled_surface_uninitialized(int width, int height) {
+    return create_surface_on_pool(width, height, false);
+}
+
+void trim_surface_pool(size_t max_bytes) {
+    g_mutex_lock(&pool_mutex);
+    evict_idle_buffers(max_bytes);
+    g_mutex_unlock(&pool_mutex);
+}
+
+size_t surface_pool_idle_bytes() {
+    g_mutex_lock(&pool_mutex);
+    size_t bytes = idle_bytes;
+    g_mutex_unlock(&pool_mutex);
+    return bytes;
+}
@@ -0,0 +1,22 @@
+// Recycled pixel buffers for short-lived ARGB32 surfaces. Undo snapshots,
+// transform results and selections are multi-megabyte and mostly come in a
+// handful of sizes, so reusing their memory avoids a fresh allocation and
+// its page faults on every operation.
+#ifndef MATE_PAINT_SURFACE_POOL_H
+#define MATE_PAINT_SURFACE_POOL_H
+
+#include <cairo.h>
+#include <stddef.h>
+
+// An ARGB32 surface on page-aligned pooled memory, cleared to transparent.
+// Destroy it with cairo_surface_destroy() as usual; the buffer goes back to
+// the pool. Safe to call from any thread.
+cairo_surface_t* create_pooled_surface(int width, int height);
+// Same, for callers that overwrite every pixel; contents are undefined
+cairo_surface_t* create_pooled_surface_uninitialized(int width, int height);
+
+// Free idle buffers, least recently used first, until at most max_bytes remain
+void trim_surface_pool(size_t max_bytes);
+size_t surface_pool_idle_bytes();
+
+#endif